@@ -190,6 +190,56 @@ unsigned graphics_max_total_placements = 4096;
 /// The ratio by which limits can be exceeded. This is to reduce the frequency
 /// of image removal.
 double graphics_excess_tolerance_ratio = 0.05;
+/// Opaque placements whose width and height in pixels don't exceed this value
+/// are kept in shared server-side pixmaps (atlases) and drawn by copying from
+/// them. Set to 0 to disable atlases.
+int graphics_atlas_max_item_size = 256;
+/// How long to keep scaled images of deleted placements, in milliseconds. A
+/// new placement identical to a recently deleted one reuses its scaled image.
+/// Set to 0 to disable.
+unsigned graphics_tombstone_lifetime_ms = 3000;
+/// Raw pixel images (f=24 and f=32) uploaded in chunks are displayed while the
+/// upload is in progress, redrawn with newly arrived rows at most once per this
+/// many milliseconds. Set to 0 to display images only when fully uploaded.
+unsigned graphics_progressive_redraw_interval_ms = 100;
+/// How long an animation frame is shown if the client doesn't specify it, in
+/// milliseconds.
+unsigned graphics_default_frame_gap_ms = 40;
+/// Cached data of images of at most this many bytes (small PNGs, JPEGs and raw
+/// pixels) is packed into shared segment files instead of one file per image.
+/// Set to 0 to always use one file per image.
+unsigned graphics_cache_pack_max_item_size = 256 * 1024;
+/// The size of one segment file of the packed disk cache.
+unsigned graphics_cache_segment_size = 8 * 1024 * 1024;
+/// A segment is compacted when this fraction of its data belongs to deleted
+/// images.
+double graphics_cache_compaction_ratio = 0.5;
+/// Raw pixel uploads (f=24 and f=32) sent without compression are compressed
+/// with zlib at the fastest level before being written to the disk cache.
+char graphics_cache_compress_raw = 1;
+/// Scaled images of placements that haven't been visible on the screen for this
+/// many milliseconds are dropped, the original images are kept in RAM. Set to 0
+/// to keep them until the RAM limits are reached.
+unsigned graphics_offscreen_scaled_lifetime_ms = 10000;
+/// Time budget per frame for rescaling placements after the cell size changes
+/// (e.g. on zoom), in milliseconds. When it is spent, the old scaled images are
+/// stretched as previews and rescaled exactly during the next frames. Set to 0
+/// to always rescale immediately.
+unsigned graphics_rescale_budget_ms = 30;
+/// Time budget for processing terminal input containing image commands, in
+/// milliseconds. When uploads take longer, the rest of the input is processed
+/// after handling X events and drawing, so that the terminal stays responsive.
+/// Set to 0 to process all input at once.
+unsigned graphics_command_budget_ms = 20;
+/// The number of threads decoding PNG and JPEG images in the background right
+/// after they are uploaded (at most 8). Set to 0 to decode images only when
+/// they are displayed.
+unsigned graphics_decoding_threads = 2;
+/// The filter used to scale images: 1 averages pixels when shrinking and
+/// interpolates bilinearly when enlarging, 2 uses the sharper but slower
+/// Lanczos-3 filter, 0 uses imlib's anti-aliased scaling. The time spent on
+/// scaling each placement is logged in the debug mode.
+unsigned graphics_scaling_filter = 1;
 
 /*
  * Force mouse select/shortcuts while mask is active (when MODE_MOUSE is set).
@@ -15,14 +15,24 @@ PKG_CONFIG = pkg-config
 # includes and libs
 INCS = -I$(X11INC) \
        `$(PKG_CONFIG) --cflags imlib2` \
+       `$(PKG_CONFIG) --cflags libjpeg` \
+       `$(PKG_CONFIG) --cflags libpng` \
        `$(PKG_CONFIG) --cflags fontconfig` \
        `$(PKG_CONFIG) --cflags freetype2`
-LIBS = -L$(X11LIB) -lm -lrt -lX11 -lutil -lXft \
+LIBS = -L$(X11LIB) -lm -lrt -lpthread -lX11 -lXrender -lutil -lXft \
        `$(PKG_CONFIG) --libs imlib2` \
        `$(PKG_CONFIG) --libs zlib` \
+       `$(PKG_CONFIG) --libs libjpeg` \
+       `$(PKG_CONFIG) --libs libpng` \
        `$(PKG_CONFIG) --libs fontconfig` \
        `$(PKG_CONFIG) --libs freetype2`
 
+# optional compression methods for raw pixel uploads: zstd (o=s), LZ4 (o=l)
+#INCS += `$(PKG_CONFIG) --cflags libzstd` -DGRAPHICS_ZSTD
+#LIBS += `$(PKG_CONFIG) --libs libzstd`
+#INCS += `$(PKG_CONFIG) --cflags liblz4` -DGRAPHICS_LZ4
+#LIBS += `$(PKG_CONFIG) --libs liblz4`
+
 # flags
 STCPPFLAGS = -DVERSION=\"$(VERSION)\" -D_XOPEN_SOURCE=600
 STCFLAGS = $(INCS) $(STCPPFLAGS) $(CPPFLAGS) $(CFLAGS)
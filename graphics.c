@@ -32,25 +32,51 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <zlib.h>
+#ifdef GRAPHICS_ZSTD
+#include <zstd.h>
+#endif
+#ifdef GRAPHICS_LZ4
+#include <lz4frame.h>
+#endif
 #include <Imlib2.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define GR_RESAMPLE_X86
+#include <immintrin.h>
+#endif
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrender.h>
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <jpeglib.h>
+#include <png.h>
 
 #include "graphics.h"
 #include "khash.h"
 
 #define MAX_FILENAME_SIZE 256
 #define MAX_INFO_LEN 256
-#define MAX_IMAGE_RECTS 20
+#define MAX_ATLASES 4
+#define ATLAS_SIZE 1024
+#define MAX_TOMBSTONES 64
+#define MAX_DECODE_REDUCTION 64
+#define MAX_CACHE_SEGMENTS 64
+// The amount of data moved by one call of `gr_compact_cache`.
+#define COMPACTION_STEP_SIZE (1024 * 1024)
 
 enum ScaleMode {
 	SCALE_MODE_UNSET = 0,
@@ -106,6 +132,70 @@ struct ImagePlacement;
 
 KHASH_MAP_INIT_INT(id2image, struct Image *)
 KHASH_MAP_INIT_INT(id2placement, struct ImagePlacement *)
+KHASH_MAP_INIT_INT64(rectbucket, int)
+
+/// The state of an animation (see the `s=` key of `a=a`).
+typedef enum {
+	ANIMATION_STOPPED = 1,
+	/// Run, but wait for more frames instead of looping after the last one.
+	ANIMATION_LOADING = 2,
+	ANIMATION_RUNNING = 3,
+} AnimationState;
+
+/// An animation frame. Only the rectangle that differs from the frame it's
+/// based on is stored, the full frame is composited when it's displayed.
+typedef struct {
+	/// The frame (1-based) this frame is drawn on top of, or 0 if it's
+	/// drawn on a canvas filled with `background`.
+	int base;
+	/// The background color in imlib2's ARGB representation.
+	DATA32 background;
+	/// The rectangle of the image covered by `pixels`.
+	int x, y, width, height;
+	/// The pixels of the rectangle, NULL for the first frame.
+	DATA32 *pixels;
+	/// Whether the pixels replace the base frame instead of being
+	/// alpha-blended onto it.
+	char overwrite;
+	/// How long the frame is shown, in milliseconds. Frames with a negative
+	/// gap are skipped.
+	int gap;
+} ImageFrame;
+
+/// The layout of the pixels of a `PixelBuffer`.
+typedef enum {
+	/// 4 bytes per pixel in imlib's ARGB format (BGRA in memory on
+	/// little-endian machines).
+	PIXEL_BGRA = 0,
+	/// 3 bytes per pixel: blue, green, red. All pixels are opaque.
+	PIXEL_BGR = 1,
+	/// 1 byte per pixel, the gray level. All pixels are opaque.
+	PIXEL_GRAY8 = 2,
+	/// 1 byte per pixel, an index into the palette.
+	PIXEL_PALETTE8 = 3,
+} PixelLayout;
+
+const char *pixel_layout_strings[4] = {
+	"BGRA",
+	"BGR",
+	"GRAY8",
+	"PALETTE8",
+};
+
+/// A buffer of pixels owned by the terminal. Original images are stored in
+/// the most compact layout that represents their pixels exactly, and are
+/// converted to ARGB only when scaled.
+typedef struct PixelBuffer {
+	/// See `PixelLayout`.
+	unsigned char layout;
+	int width, height;
+	/// The number of bytes between the starts of two consecutive rows.
+	size_t stride;
+	unsigned char *data;
+	/// The ARGB colors of a `PIXEL_PALETTE8` buffer and their number.
+	DATA32 *palette;
+	int palette_size;
+} PixelBuffer;
 
 /// The structure representing an image. It's the original image, we store it on
 /// disk, and then load it to ram when needed, but we don't display it directly.
@@ -126,6 +216,16 @@ typedef struct Image {
 	uint64_t global_command_index;
 	/// The size of the corresponding file cached on disk.
 	unsigned disk_size;
+	/// If the data is packed into a segment of the disk cache instead of
+	/// being stored in its own file, the 1-based index of the segment and
+	/// the offset of the data in it. Zero otherwise.
+	int segment;
+	unsigned segment_offset;
+	/// The data of a direct upload accumulated in memory until the upload
+	/// is complete and it can be packed into a segment. NULL if the data
+	/// is written to its own file.
+	unsigned char *pending_data;
+	unsigned pending_capacity;
 	/// The expected size of the image file (specified with 'S='), used to
 	/// check if uploading uploading succeeded.
 	unsigned expected_size;
@@ -133,6 +233,13 @@ typedef struct Image {
 	int format;
 	/// Compression mode (see the `o=` key).
 	char compression;
+	/// Set if raw pixels uploaded without compression are stored in the
+	/// disk cache compressed with zlib. The stream is kept while uploading.
+	char cache_compressed;
+	z_stream *cache_deflate;
+	/// The number of bytes received during a direct upload. It may differ
+	/// from `disk_size` if the data is compressed in the disk cache.
+	unsigned uploaded_size;
 	/// Pixel width and height if format is 32 or 24.
 	int pix_width, pix_height;
 	/// The status (see `ImageStatus`).
@@ -144,7 +251,18 @@ typedef struct Image {
 	/// The file corresponding to the on-disk cache, used when uploading.
 	FILE *open_file;
 	/// The original image loaded into RAM.
-	Imlib_Image original_image;
+	PixelBuffer *original_image;
+	/// Set when the original image is loaded if all its pixels are opaque.
+	/// Kept when the image is unloaded.
+	char opaque;
+	/// The background decoding job of the original image, if any.
+	struct DecodingJob *decoding_job;
+	/// The number of background scaling jobs reading `original_image`.
+	int scaling_jobs;
+	/// If `original_image` was decoded at a reduced resolution to save
+	/// memory, how many times its sides are smaller than the size of the
+	/// image (`pix_width` x `pix_height`). 0 or 1 otherwise.
+	int reduction;
 	/// Image placements.
 	khash_t(id2placement) *placements;
 	/// The default placement.
@@ -152,8 +270,65 @@ typedef struct Image {
 	/// The initial placement id, specified with the transmission command,
 	/// used to report success or failure.
 	uint32_t initial_placement_id;
+	/// Set while raw pixels of a direct upload are decoded into
+	/// `original_image` as they arrive, so that the image can be displayed
+	/// before the upload is finished.
+	char progressive;
+	/// The number of pixels decoded so far during progressive uploading,
+	/// and the bytes of a pixel split between two chunks.
+	size_t progressive_pixels;
+	unsigned char progressive_partial[4];
+	int progressive_partial_size;
+	/// The number of rows already propagated to the scaled placements, and
+	/// when it was last done.
+	int progressive_rows_shown;
+	struct timespec progressive_refresh_time;
+	/// Animation frames. The first frame is the image itself, `frames[0]`
+	/// only holds its gap. NULL if the image has never been animated.
+	ImageFrame *frames;
+	int frame_count, frame_capacity;
+	/// The frame being displayed (1-based).
+	int current_frame;
+	/// The composited pixels of a frame other than the first one, and the
+	/// number of that frame (0 if the pixels are outdated).
+	Imlib_Image frame_image;
+	int frame_image_index;
+	/// The animation state (see `AnimationState`), the number of loops
+	/// requested with `v=` (0 or 1 means infinite) and the loops done so
+	/// far.
+	char animation_state;
+	int max_loops, loops_done;
+	/// When the next frame should be shown.
+	struct timespec next_frame_time;
+	/// Set when the current frame changes, until the cells are redrawn.
+	char frame_changed;
+	/// Incremented whenever the pixels of the current frame change, see
+	/// `ImagePlacement.scaled_frame_serial`.
+	uint32_t frame_serial;
+	/// If nonzero, this is a temporary image holding the data of a frame of
+	/// the image with this id (`a=f`). It's deleted when the frame is
+	/// added.
+	uint32_t frame_of;
+	/// The parameters of the frame from the `a=f` command.
+	int frame_x, frame_y, frame_base, frame_edit, frame_gap;
+	char frame_overwrite;
+	uint32_t frame_background;
 } Image;
 
+/// A classic placement partially covered by a placement with a higher z-index
+/// (or a newer one with the same z-index), see `gr_stack_placements`.
+typedef struct Underlay {
+	uint32_t image_id;
+	uint32_t placement_id;
+	/// The serial number of the covered placement when it was covered.
+	uint32_t serial;
+	/// The cell of the covered placement shown under the cell (col, row) of
+	/// the covering one is (col + dcol, row + drow).
+	int dcol, drow;
+	/// The z-index of the covered placement, underlays are sorted by it.
+	int32_t z_index;
+} Underlay;
+
 typedef struct ImagePlacement {
 	/// The original image.
 	Image *image;
@@ -173,14 +348,58 @@ typedef struct ImagePlacement {
 	int src_pix_x, src_pix_y;
 	/// Height and width of the source rectangle (zero if full image).
 	int src_pix_width, src_pix_height;
-	/// The image appropriately scaled and loaded into RAM.
+	/// The image appropriately scaled and loaded into RAM. Its pixels are
+	/// premultiplied by alpha, imlib must not blend it directly.
 	Imlib_Image scaled_image;
+	/// A copy of `scaled_image` with inverted colors, used to draw reverse
+	/// cells. Created on demand and freed together with `scaled_image`.
+	Imlib_Image scaled_image_reverse;
+	/// Set if all pixels of `scaled_image` are opaque, so that it can be
+	/// copied to the screen without blending.
+	char scaled_opaque;
 	/// The dimensions of the cell used to scale the image. If cell
 	/// dimensions are changed (font change), the image will be rescaled.
 	uint16_t scaled_cw, scaled_ch;
+	/// The `Image.frame_serial` of the frame `scaled_image` was scaled
+	/// from. The image is shown until the current frame is scaled.
+	uint32_t scaled_frame_serial;
+	/// The index of the atlas holding a copy of `scaled_image` plus 1, or 0
+	/// if the placement is not in an atlas.
+	char atlas;
+	/// Set if the scaled image turned out to be unsuitable for atlases.
+	char atlas_ineligible;
+	/// The position of the copy in the atlas.
+	int atlas_x, atlas_y;
+	/// The index of this placement in `Atlas.items`.
+	int atlas_item;
+	/// Server-side copies of `scaled_image` and `scaled_image_reverse` used
+	/// to composite translucent placements with XRender. Created on demand.
+	Picture picture, picture_reverse;
+	/// Changes each time `scaled_image` is recreated, used by the terminal
+	/// to find out whether cells showing this placement need redrawing.
+	uint32_t generation;
 	/// If true, do not move the cursor when displaying this placement
 	/// (non-virtual placements only).
 	char do_not_move_cursor;
+	/// The z-index of the placement ('z=' of the put command).
+	int32_t z_index;
+	/// A number identifying this placement object, ids may be reused.
+	uint32_t serial;
+	/// The placements partially covered by this one. They are drawn under
+	/// it unless this placement is opaque.
+	Underlay *underlays;
+	int underlay_count;
+	/// Whether the terminal has already been asked to create a placeholder
+	/// for this placement.
+	char placeholder_requested;
+	/// Set if `scaled_image` is the old scaled image stretched to the new
+	/// cell size, to be replaced with an exact one when there is time.
+	char preview;
+	/// The background job creating the scaled image, if any.
+	struct DecodingJob *scaling_job;
+	/// Set when a background job has made the placement ready to be drawn,
+	/// so that `gr_update_decoded_images` redraws its cells.
+	char picked_up;
 } ImagePlacement;
 
 /// A rectangular piece of an image to be drawn.
@@ -196,25 +415,97 @@ typedef struct {
 	int cw, ch;
 	/// Whether colors should be inverted.
 	int reverse;
+	/// The index of the next rect in the same merge bucket (-1 if none).
+	int next_in_bucket;
 } ImageRect;
 
+/// A horizontal strip of an atlas holding items of similar height.
+typedef struct {
+	int y, height;
+	/// The width occupied by items (they are allocated left to right).
+	int used_width;
+} AtlasShelf;
+
+/// A server-side pixmap holding copies of small opaque placements.
+typedef struct {
+	Pixmap pixmap;
+	AtlasShelf *shelves;
+	int shelf_count, shelf_capacity;
+	/// The top of the free space below the last shelf.
+	int next_shelf_y;
+	/// The placements stored in the atlas.
+	struct ImagePlacement **items;
+	int item_count, item_capacity;
+} Atlas;
+
+/// The scaled image of a recently deleted placement, which may be adopted by a
+/// new identical placement of the same image.
+typedef struct {
+	/// The image the placement belonged to. Zero if the slot is free.
+	uint32_t image_id;
+	/// The parameters of the placement that determine the scaled image.
+	int src_pix_x, src_pix_y, src_pix_width, src_pix_height;
+	uint16_t rows, cols;
+	char scale_mode;
+	uint16_t scaled_cw, scaled_ch;
+	/// The scaled image itself and whether it's opaque.
+	Imlib_Image scaled_image;
+	char scaled_opaque;
+	/// Its ram size, accounted in `images_ram_size`.
+	unsigned ram_size;
+	/// When the placement was deleted.
+	struct timespec deletion_time;
+} Tombstone;
+
+/// A segment file of the packed disk cache. Data of small images is appended
+/// to the active segment, the space of deleted images is reclaimed by moving
+/// the remaining images out of the segment and deleting it.
+typedef struct {
+	/// The file descriptor of the segment.
+	int fd;
+	/// The whole segment mapped into memory for reading, NULL if the slot
+	/// is free.
+	unsigned char *map;
+	/// The number of bytes written to the segment, and how many of them
+	/// belong to deleted images.
+	unsigned used, dead;
+} CacheSegment;
+
 static Image *gr_find_image(uint32_t image_id);
+static void gr_atlas_release(ImagePlacement *placement);
+static void gr_render_release(ImagePlacement *placement);
+static void gr_free_frames(Image *img);
+int gr_cmp_timespec(const struct timespec *t1, const struct timespec *t2);
 static void gr_get_image_filename(Image *img, char *out, size_t max_len);
+static void gr_make_sure_tmpdir_exists();
 static void gr_delete_image(Image *img);
+static void gr_cancel_decoding(Image *img);
+static void gr_drop_scaling_jobs(Image *img);
+static void gr_cancel_scaling(ImagePlacement *placement);
+static void gr_queue_image_scaling(Image *img);
+static void gr_bump_placement_generation(ImagePlacement *placement);
 static void gr_check_limits();
 static char *gr_base64dec(const char *src, size_t *size);
 static void sanitize_str(char *str, size_t max_len);
 static const char *sanitized_filename(const char *str);
 
 /// The array of image rectangles to draw. It is reset each frame.
-static ImageRect image_rects[MAX_IMAGE_RECTS] = {{0}};
+static ImageRect *image_rects = NULL;
+static int image_rects_count = 0, image_rects_capacity = 0;
+/// Rects that may be extended downwards, grouped by placement, cell size,
+/// inversion, position on the screen and the last row. Maps a key computed by
+/// `gr_rect_bucket_key` to the index of the first rect in a linked list.
+static khash_t(rectbucket) *image_rect_buckets = NULL;
 /// The known images (including the ones being uploaded).
 static khash_t(id2image) *images = NULL;
 /// The total number of placements in all images.
 static unsigned total_placement_count = 0;
+/// The serial number of the next created placement.
+static uint32_t next_placement_serial = 1;
 /// The total size of all image files stored in the on-disk cache.
 static int64_t images_disk_size = 0;
-/// The total size of all images and placements loaded into ram.
+/// The total size of all images and placements loaded into ram, including the
+/// scaled images of pending scaling jobs.
 static int64_t images_ram_size = 0;
 /// The id of the last loaded image.
 static uint32_t last_image_id = 0;
@@ -226,12 +517,46 @@ static uint32_t current_upload_image_id = 0;
 static clock_t drawing_start_time;
 /// The global index of the current command.
 static uint64_t global_command_counter = 0;
+/// The last value assigned to `ImagePlacement.generation`.
+static uint32_t placement_generation_counter = 0;
+/// When the screen was last scanned for visible placements.
+static struct timespec last_visibility_sweep_time;
+/// The time spent on loading placements during the current frame, in
+/// milliseconds, and whether there may be placements shown as previews.
+static double rescale_ms_spent = 0;
+static char previews_exist = 0;
+/// Whether there may be running animations or changed frames, see
+/// `gr_update_animations`.
+static char animations_exist = 0;
 
 /// The directory where the cache files are stored.
 static char cache_dir[MAX_FILENAME_SIZE - 16];
-
-/// The table used for color inversion.
-static unsigned char reverse_table[256];
+/// The segments of the packed disk cache and the one new data is appended to
+/// (-1 if there is none).
+static CacheSegment cache_segments[MAX_CACHE_SEGMENTS];
+static int active_cache_segment = -1;
+/// The segment whose data is being moved by `gr_compact_cache`, or -1.
+static int compacting_cache_segment = -1;
+/// The total size of the data of deleted images that still occupies space in
+/// the segments. Not included in `images_disk_size`.
+static int64_t cache_dead_size = 0;
+
+/// Scaled images of recently deleted placements.
+static Tombstone tombstones[MAX_TOMBSTONES];
+
+/// The atlases for small placements and the GC used to copy from them.
+static Atlas atlases[MAX_ATLASES];
+static GC atlas_gc = NULL;
+
+/// Whether translucent placements can be composited with XRender.
+static char render_available = 0;
+/// The formats of placement pictures and of the drawable.
+static XRenderPictFormat *render_argb_format = NULL;
+static XRenderPictFormat *render_dest_format = NULL;
+/// The picture of the drawable, created on demand for the current frame.
+static Picture render_dest = None;
+/// The GC used to upload pixels to 32-bit pixmaps.
+static GC render_gc = NULL;
 
 // Declared in the header.
 GraphicsDebugMode graphics_debug_mode = GRAPHICS_DEBUG_NONE;
@@ -246,6 +571,18 @@ extern unsigned graphics_max_single_image_ram_size;
 extern unsigned graphics_max_total_ram_size;
 extern unsigned graphics_max_total_placements;
 extern double graphics_excess_tolerance_ratio;
+extern int graphics_atlas_max_item_size;
+extern unsigned graphics_tombstone_lifetime_ms;
+extern unsigned graphics_progressive_redraw_interval_ms;
+extern unsigned graphics_default_frame_gap_ms;
+extern unsigned graphics_cache_pack_max_item_size;
+extern unsigned graphics_cache_segment_size;
+extern double graphics_cache_compaction_ratio;
+extern char graphics_cache_compress_raw;
+extern unsigned graphics_offscreen_scaled_lifetime_ms;
+extern unsigned graphics_rescale_budget_ms;
+extern unsigned graphics_decoding_threads;
+extern unsigned graphics_scaling_filter;
 
 
 #define MIN(a, b)		((a) < (b) ? (a) : (b))
@@ -259,917 +596,4631 @@ extern double graphics_excess_tolerance_ratio;
 	do { if(graphics_debug_mode) fprintf(stderr, __VA_ARGS__); } while(0)
 
 ////////////////////////////////////////////////////////////////////////////////
-// Basic image management functions (create, delete, find, etc).
+// Packed disk cache.
+//
+// Storing thousands of small images as separate files is slow on most file
+// systems, so small uploads are appended to a few large segment files instead.
+// The location of the data of each image is stored in the image itself, and
+// segments are read through memory mappings.
 ////////////////////////////////////////////////////////////////////////////////
 
-/// Finds the image corresponding to the client id. Returns NULL if cannot find.
-static Image *gr_find_image(uint32_t image_id) {
-	khiter_t k = kh_get(id2image, images, image_id);
-	if (k == kh_end(images))
-		return NULL;
-	Image *res = kh_value(images, k);
-	return res;
+/// Writes the name of the file of the segment `index` to `out`.
+static void gr_get_segment_filename(int index, char *out, size_t max_len) {
+	snprintf(out, max_len, "%s/pack-%d", cache_dir, index);
 }
 
-/// Finds the newest image corresponding to the image number. Returns NULL if
-/// cannot find.
-static Image *gr_find_image_by_number(uint32_t image_number) {
-	if (image_number == 0)
-		return NULL;
-	Image *newest_img = NULL;
-	Image *img = NULL;
-	kh_foreach_value(images, img, {
-		if (img->image_number == image_number &&
-		    (!newest_img || newest_img->global_command_index <
-					    img->global_command_index))
-			newest_img = img;
-	});
-	if (!newest_img)
-		GR_LOG("Image number %u not found\n", image_number);
-	else
-		GR_LOG("Found image number %u, its id is %u\n", image_number,
-		       img->image_id);
-	return newest_img;
+/// Returns 1 if the data of `size` bytes may be packed into a segment.
+static int gr_pack_accepts(unsigned size) {
+	return graphics_cache_pack_max_item_size &&
+	       size <= graphics_cache_pack_max_item_size &&
+	       size <= graphics_cache_segment_size;
 }
 
-/// Finds the placement corresponding to the id. If the placement id is 0,
-/// returns some default placement.
-static ImagePlacement *gr_find_placement(Image *img, uint32_t placement_id) {
-	if (!img)
-		return NULL;
-	if (placement_id == 0) {
-		// Try to get the default placement.
-		ImagePlacement *dflt = NULL;
-		if (img->default_placement != 0)
-			dflt = gr_find_placement(img, img->default_placement);
-		if (dflt)
-			return dflt;
-		// If there is no default placement, return the first one and
-		// set it as the default.
-		kh_foreach_value(img->placements, dflt, {
-			img->default_placement = dflt->placement_id;
-			return dflt;
-		});
-		// If there are no placements, return NULL.
-		return NULL;
+/// Creates a new segment and makes it active. Returns 0 on failure.
+static int gr_open_segment() {
+	int index = 0;
+	while (index < MAX_CACHE_SEGMENTS && cache_segments[index].map)
+		index++;
+	if (index == MAX_CACHE_SEGMENTS)
+		return 0;
+	gr_make_sure_tmpdir_exists();
+	char filename[MAX_FILENAME_SIZE];
+	gr_get_segment_filename(index, filename, MAX_FILENAME_SIZE);
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "error: could not create the segment file %s\n",
+			sanitized_filename(filename));
+		return 0;
 	}
-	khiter_t k = kh_get(id2placement, img->placements, placement_id);
-	if (k == kh_end(img->placements))
-		return NULL;
-	ImagePlacement *res = kh_value(img->placements, k);
-	return res;
+	// The file is sparse, so the space is allocated only when written.
+	void *map = MAP_FAILED;
+	if (ftruncate(fd, graphics_cache_segment_size) == 0)
+		map = mmap(NULL, graphics_cache_segment_size, PROT_READ,
+			   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "error: could not map the segment file %s\n",
+			sanitized_filename(filename));
+		close(fd);
+		unlink(filename);
+		return 0;
+	}
+	CacheSegment *seg = &cache_segments[index];
+	seg->fd = fd;
+	seg->map = map;
+	seg->used = seg->dead = 0;
+	active_cache_segment = index;
+	GR_LOG("Created cache segment %d\n", index);
+	return 1;
 }
 
-/// Finds the placement by image id and placement id.
-static ImagePlacement *gr_find_image_and_placement(uint32_t image_id,
-						   uint32_t placement_id) {
-	return gr_find_placement(gr_find_image(image_id), placement_id);
+/// Deletes the segment `index`. It must not contain data of existing images.
+static void gr_close_segment(int index) {
+	CacheSegment *seg = &cache_segments[index];
+	if (!seg->map)
+		return;
+	munmap(seg->map, graphics_cache_segment_size);
+	close(seg->fd);
+	char filename[MAX_FILENAME_SIZE];
+	gr_get_segment_filename(index, filename, MAX_FILENAME_SIZE);
+	unlink(filename);
+	cache_dead_size -= seg->dead;
+	seg->map = NULL;
+	seg->used = seg->dead = 0;
+	if (active_cache_segment == index)
+		active_cache_segment = -1;
+	if (compacting_cache_segment == index)
+		compacting_cache_segment = -1;
+	GR_LOG("Deleted cache segment %d\n", index);
 }
 
-/// Writes the name of the on-disk cache file to `out`. `max_len` should be the
-/// size of `out`. The name will be something like "/tmp/st-images-xxx/img-ID".
-static void gr_get_image_filename(Image *img, char *out, size_t max_len) {
-	snprintf(out, max_len, "%s/img-%.3u", cache_dir, img->image_id);
+/// Appends the data of the image to the active segment, creating a new one if
+/// there is not enough space. `img->disk_size` is not changed. Returns 0 if the
+/// data can't be packed.
+static int gr_pack_image_data(Image *img, const unsigned char *data,
+			      unsigned size) {
+	if (!gr_pack_accepts(size))
+		return 0;
+	if (active_cache_segment < 0 ||
+	    graphics_cache_segment_size -
+			    cache_segments[active_cache_segment].used <
+		    size) {
+		if (!gr_open_segment())
+			return 0;
+	}
+	CacheSegment *seg = &cache_segments[active_cache_segment];
+	for (unsigned written = 0; written < size;) {
+		ssize_t res = pwrite(seg->fd, data + written, size - written,
+				     seg->used + written);
+		if (res <= 0) {
+			// The space is lost, but the segment is still usable.
+			seg->used += written;
+			seg->dead += written;
+			cache_dead_size += written;
+			return 0;
+		}
+		written += res;
+	}
+	img->segment = active_cache_segment + 1;
+	img->segment_offset = seg->used;
+	seg->used += size;
+	return 1;
 }
 
-/// Returns the (estimation) of the RAM size used by the image when loaded.
-static unsigned gr_image_ram_size(Image *img) {
-	return (unsigned)img->pix_width * img->pix_height * 4;
+/// Marks the packed data of the image as deleted. Segments that contain only
+/// deleted data are removed or, if it's the active one, reused.
+static void gr_release_packed_data(Image *img) {
+	if (!img->segment)
+		return;
+	int index = img->segment - 1;
+	CacheSegment *seg = &cache_segments[index];
+	img->segment = 0;
+	seg->dead += img->disk_size;
+	cache_dead_size += img->disk_size;
+	if (seg->dead < seg->used)
+		return;
+	if (index == active_cache_segment) {
+		cache_dead_size -= seg->dead;
+		seg->used = seg->dead = 0;
+	} else {
+		gr_close_segment(index);
+	}
 }
 
-/// Returns the (estimation) of the RAM size used by the placemenet when loaded.
-static unsigned gr_placement_ram_size(ImagePlacement *placement) {
-	return (unsigned)placement->rows * placement->cols *
-	       placement->scaled_ch * placement->scaled_cw * 4;
+/// Opens the cached data of the image for reading, no matter whether it's
+/// packed into a segment or stored in its own file. Returns NULL on failure.
+static FILE *gr_open_image_data(Image *img) {
+	if (img->segment) {
+		CacheSegment *seg = &cache_segments[img->segment - 1];
+		return fmemopen(seg->map + img->segment_offset, img->disk_size,
+				"rb");
+	}
+	char filename[MAX_FILENAME_SIZE];
+	gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
+	return fopen(filename, "rb");
 }
 
-/// Unload the image from RAM (i.e. delete the corresponding imlib object).
-/// If the on-disk file of the image is preserved, it can be reloaded later.
-static void gr_unload_image(Image *img) {
-	if (!img->original_image)
-		return;
-
-	imlib_context_set_image(img->original_image);
-	imlib_free_image_and_decache();
-
-	images_ram_size -= gr_image_ram_size(img);
+/// Moves the packed data of the image to its own file, which is needed to load
+/// it with imlib or to show it to the user. Returns 0 on failure.
+static int gr_unpack_image(Image *img) {
+	if (!img->segment)
+		return 1;
+	CacheSegment *seg = &cache_segments[img->segment - 1];
+	gr_make_sure_tmpdir_exists();
+	char filename[MAX_FILENAME_SIZE];
+	gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
+	FILE *file = fopen(filename, "wb");
+	if (!file)
+		return 0;
+	size_t written = fwrite(seg->map + img->segment_offset, 1,
+				img->disk_size, file);
+	if (fclose(file) != 0 || written != img->disk_size) {
+		unlink(filename);
+		return 0;
+	}
+	GR_LOG("Unpacked image %u to %s\n", img->image_id,
+	       sanitized_filename(filename));
+	gr_release_packed_data(img);
+	return 1;
+}
 
-	img->original_image = NULL;
+/// Appends data of a direct upload to the in-memory buffer of the image.
+/// `img->disk_size` is not changed. Returns 0 on failure.
+static int gr_append_pending_data(Image *img, const char *data, unsigned size) {
+	unsigned needed = img->disk_size + size;
+	if (needed > img->pending_capacity) {
+		unsigned capacity = MAX(needed, img->pending_capacity * 2);
+		capacity = MIN(capacity, graphics_cache_pack_max_item_size);
+		unsigned char *buf = realloc(img->pending_data, capacity);
+		if (!buf)
+			return 0;
+		img->pending_data = buf;
+		img->pending_capacity = capacity;
+	}
+	memcpy(img->pending_data + img->disk_size, data, size);
+	return 1;
+}
 
-	GR_LOG("After unloading image %u ram: %ld KiB\n", img->image_id,
-	       images_ram_size / 1024);
+/// Stores the data accumulated in memory when the upload is complete. It's
+/// packed into a segment if we can decode it from memory (PNG, JPEG or raw
+/// pixels), and written to its own file otherwise. Returns 0 on failure.
+static int gr_store_pending_data(Image *img) {
+	unsigned char *data = img->pending_data;
+	unsigned size = img->disk_size;
+	img->pending_data = NULL;
+	img->pending_capacity = 0;
+	char raw = img->format == 24 || img->format == 32;
+	char png = size >= 2 && data[0] == 0x89 && data[1] == 'P';
+	char jpeg = size >= 2 && data[0] == 0xFF && data[1] == 0xD8;
+	int res = 0;
+	if (size > 0 && (raw || png || jpeg))
+		res = gr_pack_image_data(img, data, size);
+	if (!res) {
+		gr_make_sure_tmpdir_exists();
+		char filename[MAX_FILENAME_SIZE];
+		gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
+		FILE *file = fopen(filename, "wb");
+		if (file) {
+			res = fwrite(data, 1, size, file) == size;
+			res = fclose(file) == 0 && res;
+		}
+	}
+	free(data);
+	return res;
 }
 
-/// Unload the placement from RAM (i.e. delete the corresponding imlib object).
-/// If the on-disk file of the corresponding image is preserved, it can be
-/// reloaded later.
-static void gr_unload_placement(ImagePlacement *placement) {
-	if (!placement->scaled_image)
+/// Moves the data of the remaining images out of one segment with too much
+/// deleted data and deletes the segment. To spread the work, at most
+/// `COMPACTION_STEP_SIZE` bytes (or one image) are moved per call, and the
+/// next calls continue with the same segment. If `force` is set, any segment
+/// with deleted data may be compacted.
+static void gr_compact_cache(char force) {
+	int worst = compacting_cache_segment;
+	for (int i = 0; worst < 0 && i < MAX_CACHE_SEGMENTS; ++i) {
+		CacheSegment *seg = &cache_segments[i];
+		if (!seg->map || seg->dead == 0 ||
+		    (!force &&
+		     seg->dead < seg->used * graphics_cache_compaction_ratio))
+			continue;
+		if (worst < 0 || cache_segments[worst].dead < seg->dead)
+			worst = i;
+	}
+	if (worst < 0)
 		return;
+	GR_LOG("Compacting cache segment %d: %u KiB of %u KiB are dead\n",
+	       worst, cache_segments[worst].dead / 1024,
+	       cache_segments[worst].used / 1024);
+	// Don't append to the segment we are compacting.
+	if (worst == active_cache_segment)
+		active_cache_segment = -1;
+	compacting_cache_segment = worst;
+	CacheSegment *seg = &cache_segments[worst];
+	unsigned moved = 0;
+	Image *img = NULL;
+	kh_foreach_value(images, img, {
+		if (img->segment == worst + 1) {
+			if (moved && moved + img->disk_size >
+					     COMPACTION_STEP_SIZE)
+				return;
+			moved += img->disk_size;
+			unsigned offset = img->segment_offset;
+			if (!gr_pack_image_data(img, seg->map + offset,
+						img->disk_size)) {
+				// Keep the data where it is, we will retry
+				// later.
+				return;
+			}
+			seg->dead += img->disk_size;
+			cache_dead_size += img->disk_size;
+		}
+	});
+	gr_close_segment(worst);
+}
 
-	imlib_context_set_image(placement->scaled_image);
-	imlib_free_image();
-
-	images_ram_size -= gr_placement_ram_size(placement);
+/// Deletes all segments.
+static void gr_delete_all_segments() {
+	for (int i = 0; i < MAX_CACHE_SEGMENTS; ++i)
+		gr_close_segment(i);
+}
 
-	placement->scaled_image = NULL;
-	placement->scaled_ch = placement->scaled_cw = 0;
+////////////////////////////////////////////////////////////////////////////////
+// Pixel buffers.
+//
+// Decoders produce ARGB pixels, which are then compacted: opaque gray images
+// take 1 byte per pixel, images with at most 256 colors are paletted, and other
+// opaque images take 3 bytes per pixel. These functions don't use imlib or any
+// global state, so they can be called from the decoding threads.
+////////////////////////////////////////////////////////////////////////////////
 
-	GR_LOG("After unloading placement %u/%u ram: %ld KiB\n",
-	       placement->image->image_id, placement->placement_id,
-	       images_ram_size / 1024);
+/// Returns the number of bytes per pixel of the layout.
+static int gr_pixel_size(int layout) {
+	switch (layout) {
+	case PIXEL_BGRA:
+		return 4;
+	case PIXEL_BGR:
+		return 3;
+	default:
+		return 1;
+	}
 }
 
-/// Delete the on-disk cache file corresponding to the image. The in-ram image
-/// object (if it exists) is not deleted, so the image may still be displayed
-/// with the same cell width/height values.
-static void gr_delete_imagefile(Image *img) {
-	// It may still be being loaded. Close the file in this case.
-	if (img->open_file) {
-		fclose(img->open_file);
-		img->open_file = NULL;
+/// Allocates a pixel buffer with rows that are `stride` bytes apart. The
+/// pixels are zeroed, which is transparent black for `PIXEL_BGRA`. Returns
+/// NULL on failure.
+static PixelBuffer *gr_pixbuf_new(int layout, int width, int height,
+				  size_t stride) {
+	PixelBuffer *buf = calloc(1, sizeof(PixelBuffer));
+	if (!buf)
+		return NULL;
+	buf->data = calloc(height, stride);
+	if (!buf->data) {
+		free(buf);
+		return NULL;
 	}
+	buf->layout = layout;
+	buf->width = width;
+	buf->height = height;
+	buf->stride = stride;
+	return buf;
+}
 
-	if (img->disk_size == 0)
+/// Frees the pixel buffer.
+static void gr_pixbuf_free(PixelBuffer *buf) {
+	if (!buf)
 		return;
+	free(buf->data);
+	free(buf->palette);
+	free(buf);
+}
 
-	char filename[MAX_FILENAME_SIZE];
-	gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
-	remove(filename);
-
-	images_disk_size -= img->disk_size;
-	img->disk_size = 0;
-
-	GR_LOG("After deleting image file %u disk: %ld KiB\n", img->image_id,
-	       images_disk_size / 1024);
+/// Wraps ARGB pixels with rows `stride` bytes apart into a `PIXEL_BGRA` buffer
+/// that takes ownership of them. Returns NULL and frees the pixels on failure.
+static PixelBuffer *gr_pixbuf_wrap(DATA32 *pixels, int width, int height,
+				   size_t stride) {
+	PixelBuffer *buf = calloc(1, sizeof(PixelBuffer));
+	if (!buf) {
+		free(pixels);
+		return NULL;
+	}
+	buf->layout = PIXEL_BGRA;
+	buf->width = width;
+	buf->height = height;
+	buf->stride = stride;
+	buf->data = (unsigned char *)pixels;
+	return buf;
 }
 
-/// Deletes the given placement: unloads, frees the object, but doesn't change
-/// the `placements` hash table.
-static void gr_delete_placement_keep_id(ImagePlacement *placement) {
-	if (!placement)
-		return;
-	GR_LOG("Deleting placement %u/%u\n", placement->image->image_id,
-	       placement->placement_id);
-	gr_unload_placement(placement);
-	free(placement);
-	total_placement_count--;
+/// Returns the RAM size used by the pixels of the buffer.
+static unsigned gr_pixbuf_ram_size(PixelBuffer *buf) {
+	return buf->stride * buf->height + buf->palette_size * sizeof(DATA32);
 }
 
-/// Deletes all placements of `img`.
-static void gr_delete_all_placements(Image *img) {
-	ImagePlacement *placement = NULL;
-	kh_foreach_value(img->placements, placement, {
-		gr_delete_placement_keep_id(placement);
-	});
-	kh_clear(id2placement, img->placements);
+/// Returns a pointer to the row `y` of the buffer.
+static inline unsigned char *gr_pixbuf_row(PixelBuffer *buf, int y) {
+	return buf->data + (size_t)y * buf->stride;
 }
 
-/// Deletes the given image: unloads, deletes the file, frees the Image object,
-/// but doesn't change the `images` hash table.
-static void gr_delete_image_keep_id(Image *img) {
-	if (!img)
-		return;
-	GR_LOG("Deleting image %u\n", img->image_id);
-	gr_unload_image(img);
-	gr_delete_imagefile(img);
-	gr_delete_all_placements(img);
-	kh_destroy(id2placement, img->placements);
-	free(img);
+/// Converts `count` pixels of the row `y` starting from the column `x` to ARGB.
+static void gr_pixbuf_read_row(PixelBuffer *buf, int x, int y, int count,
+			       DATA32 *out) {
+	unsigned char *row = gr_pixbuf_row(buf, y);
+	switch (buf->layout) {
+	case PIXEL_BGRA:
+		memcpy(out, row + (size_t)x * 4, count * sizeof(DATA32));
+		break;
+	case PIXEL_BGR:
+		row += (size_t)x * 3;
+		for (int i = 0; i < count; ++i, row += 3)
+			out[i] = 0xFF000000 | (row[2] << 16) | (row[1] << 8) |
+				 row[0];
+		break;
+	case PIXEL_GRAY8:
+		row += x;
+		for (int i = 0; i < count; ++i)
+			out[i] = 0xFF000000 | (row[i] * 0x010101);
+		break;
+	case PIXEL_PALETTE8:
+		row += x;
+		for (int i = 0; i < count; ++i)
+			out[i] = buf->palette[row[i]];
+		break;
+	}
 }
 
-/// Deletes the given image: unloads, deletes the file, frees the Image object,
-/// and also removes it from `images`.
-static void gr_delete_image(Image *img) {
-	if (!img)
-		return;
-	uint32_t id = img->image_id;
-	gr_delete_image_keep_id(img);
-	khiter_t k = kh_get(id2image, images, id);
-	kh_del(id2image, images, k);
+/// Converts the rectangle of the buffer to ARGB pixels with rows `out_stride`
+/// pixels apart.
+static void gr_pixbuf_read_rect(PixelBuffer *buf, int x, int y, int w, int h,
+				DATA32 *out, size_t out_stride) {
+	for (int i = 0; i < h; ++i)
+		gr_pixbuf_read_row(buf, x, y + i, w, out + i * out_stride);
 }
 
-/// Deletes the given placement: unloads, frees the object, and also removes it
-/// from `placements`.
-static void gr_delete_placement(ImagePlacement *placement) {
-	if (!placement)
-		return;
-	uint32_t id = placement->placement_id;
-	Image *img = placement->image;
-	gr_delete_placement_keep_id(placement);
-	khiter_t k = kh_get(id2placement, img->placements, id);
-	kh_del(id2placement, img->placements, k);
+/// Returns whether all pixels of the buffer are opaque.
+static int gr_pixbuf_is_opaque(PixelBuffer *buf) {
+	DATA32 all = 0xFF000000;
+	if (buf->layout == PIXEL_BGR || buf->layout == PIXEL_GRAY8)
+		return 1;
+	if (buf->layout == PIXEL_PALETTE8) {
+		for (int i = 0; i < buf->palette_size; ++i)
+			all &= buf->palette[i];
+		return all == 0xFF000000;
+	}
+	for (int y = 0; y < buf->height; ++y) {
+		DATA32 *row = (DATA32 *)gr_pixbuf_row(buf, y);
+		for (int x = 0; x < buf->width; ++x)
+			all &= row[x];
+	}
+	return all == 0xFF000000;
 }
 
-/// Deletes all images and clears `images`.
-static void gr_delete_all_images() {
-	Image *img = NULL;
-	kh_foreach_value(images, img, {
-		gr_delete_image_keep_id(img);
-	});
-	kh_clear(id2image, images);
+/// A set of up to 256 colors with their palette indices, used to store images
+/// with few colors as paletted. Open addressing with linear probing, the table
+/// is never more than half full.
+typedef struct {
+	DATA32 colors[512];
+	/// The palette index of the color in the slot, -1 for empty slots.
+	short indices[512];
+	DATA32 palette[256];
+	int count;
+} ColorTable;
+
+/// Returns the palette index of the color, adding it to the table if needed.
+/// Returns -1 if the color is new and the table is full.
+static int gr_color_table_index(ColorTable *table, DATA32 color) {
+	unsigned slot = (uint32_t)(color * 2654435761u) >> 23;
+	while (table->indices[slot] >= 0) {
+		if (table->colors[slot] == color)
+			return table->indices[slot];
+		slot = (slot + 1) & 511;
+	}
+	if (table->count == 256)
+		return -1;
+	table->colors[slot] = color;
+	table->indices[slot] = table->count;
+	table->palette[table->count] = color;
+	return table->count++;
 }
 
-/// A helper to compare timespecs.
-int gr_cmp_timespec(const struct timespec *t1, const struct timespec *t2) {
-	if (t1->tv_sec < t2->tv_sec)
-		return -1;
-	if (t1->tv_sec > t2->tv_sec)
-		return 1;
-	if (t1->tv_nsec < t2->tv_nsec)
-		return -1;
-	if (t1->tv_nsec > t2->tv_nsec)
-		return 1;
-	return 0;
+/// Stores the pixels of a `PIXEL_BGRA` buffer in the most compact layout that
+/// represents them exactly, and frees the buffer if a compact copy was made.
+/// Returns the buffer to use, which is `buf` itself if it can't be made
+/// smaller or if the allocation failed.
+static PixelBuffer *gr_pixbuf_compact(PixelBuffer *buf) {
+	if (!buf || buf->layout != PIXEL_BGRA)
+		return buf;
+	ColorTable table;
+	memset(table.indices, 0xFF, sizeof(table.indices));
+	table.count = 0;
+	DATA32 all = 0xFF000000;
+	char gray = 1, paletted = 1;
+	// Consecutive pixels are often the same, don't look them up again.
+	DATA32 last = 0;
+	int last_index = -1;
+	for (int y = 0; y < buf->height; ++y) {
+		DATA32 *row = (DATA32 *)gr_pixbuf_row(buf, y);
+		for (int x = 0; x < buf->width; ++x) {
+			DATA32 p = row[x];
+			all &= p;
+			if (gray && (((p >> 16) ^ p) & 0xFF ||
+				     ((p >> 8) ^ p) & 0xFF))
+				gray = 0;
+			if (paletted && (last_index < 0 || p != last)) {
+				last = p;
+				last_index = gr_color_table_index(&table, p);
+				paletted = last_index >= 0;
+			}
+		}
+		if (!paletted && all != 0xFF000000)
+			return buf;
+	}
+	char opaque = all == 0xFF000000;
+
+	int layout = PIXEL_BGRA;
+	if (opaque && gray)
+		layout = PIXEL_GRAY8;
+	else if (paletted)
+		layout = PIXEL_PALETTE8;
+	else if (opaque)
+		layout = PIXEL_BGR;
+	size_t stride = (size_t)buf->width * gr_pixel_size(layout);
+	size_t palette_size = layout == PIXEL_PALETTE8 ? table.count : 0;
+	if (layout == PIXEL_BGRA ||
+	    stride * buf->height + palette_size * sizeof(DATA32) >=
+		    gr_pixbuf_ram_size(buf))
+		return buf;
+
+	PixelBuffer *res = gr_pixbuf_new(layout, buf->width, buf->height,
+					 stride);
+	if (!res)
+		return buf;
+	last_index = -1;
+	if (palette_size) {
+		res->palette = malloc(palette_size * sizeof(DATA32));
+		if (!res->palette) {
+			gr_pixbuf_free(res);
+			return buf;
+		}
+		memcpy(res->palette, table.palette,
+		       palette_size * sizeof(DATA32));
+		res->palette_size = palette_size;
+	}
+	for (int y = 0; y < buf->height; ++y) {
+		DATA32 *row = (DATA32 *)gr_pixbuf_row(buf, y);
+		unsigned char *out = gr_pixbuf_row(res, y);
+		for (int x = 0; x < buf->width; ++x) {
+			DATA32 p = row[x];
+			switch (layout) {
+			case PIXEL_GRAY8:
+				out[x] = p & 0xFF;
+				break;
+			case PIXEL_PALETTE8:
+				if (last_index < 0 || p != last) {
+					last = p;
+					last_index = gr_color_table_index(
+						&table, p);
+				}
+				out[x] = last_index;
+				break;
+			case PIXEL_BGR:
+				out[3 * x] = p & 0xFF;
+				out[3 * x + 1] = (p >> 8) & 0xFF;
+				out[3 * x + 2] = (p >> 16) & 0xFF;
+				break;
+			}
+		}
+	}
+	gr_pixbuf_free(buf);
+	return res;
 }
 
-/// A helper to compare images by atime for qsort.
-static int gr_cmp_images_by_atime(const void *a, const void *b) {
-	Image *img_a = *(Image *const *)a;
-	Image *img_b = *(Image *const *)b;
-	return gr_cmp_timespec(&img_a->atime, &img_b->atime);
+/// Creates an imlib image with alpha from the rectangle of the pixel buffer,
+/// to be used as the source of scaling. Contiguous rows of a `PIXEL_BGRA`
+/// buffer are used without copying, so the buffer must outlive the image. The
+/// image must be freed with `imlib_free_image`. Returns NULL on failure.
+static Imlib_Image gr_pixbuf_to_imlib(PixelBuffer *buf, int x, int y, int w,
+				      int h) {
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > buf->width ||
+	    y + h > buf->height)
+		return NULL;
+	Imlib_Image image = NULL;
+	if (buf->layout == PIXEL_BGRA && x == 0 && w == buf->width &&
+	    buf->stride == (size_t)w * 4) {
+		image = imlib_create_image_using_data(
+			w, h, (DATA32 *)gr_pixbuf_row(buf, y));
+		if (!image)
+			return NULL;
+		imlib_context_set_image(image);
+	} else {
+		image = imlib_create_image(w, h);
+		if (!image)
+			return NULL;
+		imlib_context_set_image(image);
+		DATA32 *data = imlib_image_get_data();
+		gr_pixbuf_read_rect(buf, x, y, w, h, data, w);
+		imlib_image_put_back_data(data);
+	}
+	imlib_image_set_has_alpha(1);
+	return image;
 }
 
-/// A helper to compare placements by atime for qsort.
-static int gr_cmp_placements_by_atime(const void *a, const void *b) {
-	ImagePlacement *p_a = *(ImagePlacement **)a;
-	ImagePlacement *p_b = *(ImagePlacement **)b;
-	return gr_cmp_timespec(&p_a->atime, &p_b->atime);
+/// Copies the pixels of an image loaded by imlib into a compacted pixel buffer
+/// and frees the imlib image, so that imlib is used only as a decoder. Returns
+/// NULL on failure.
+static PixelBuffer *gr_pixbuf_from_imlib(Imlib_Image image) {
+	imlib_context_set_image(image);
+	int width = imlib_image_get_width();
+	int height = imlib_image_get_height();
+	size_t num_pixels = (size_t)width * height;
+	DATA32 *pixels = malloc(num_pixels * sizeof(DATA32));
+	if (pixels) {
+		memcpy(pixels, imlib_image_get_data_for_reading_only(),
+		       num_pixels * sizeof(DATA32));
+		// The alpha channel of images without alpha is undefined.
+		if (!imlib_image_has_alpha())
+			for (size_t i = 0; i < num_pixels; ++i)
+				pixels[i] |= 0xFF000000;
+	}
+	imlib_free_image_and_decache();
+	if (!pixels)
+		return NULL;
+	return gr_pixbuf_compact(
+		gr_pixbuf_wrap(pixels, width, height, width * sizeof(DATA32)));
 }
 
-/// Returns an array of pointers to all images sorted by atime. The size of the
-/// array is `kh_size(images)`. Returns NULL if there are no images.
-static Image **gr_get_images_sorted_by_atime() {
-	if (kh_size(images) == 0)
-		return NULL;
-	Image **images_sorted = malloc(sizeof(Image *) * kh_size(images));
-	Image *img = NULL;
-	int i = 0;
-	kh_foreach_value(images, img, {
-		images_sorted[i] = img;
-		i++;
-	});
-	qsort(images_sorted, kh_size(images), sizeof(Image *),
-	      gr_cmp_images_by_atime);
-	return images_sorted;
+////////////////////////////////////////////////////////////////////////////////
+// Resampling.
+//
+// Placements are scaled with a separable filter: each source row is filtered
+// horizontally, and each output row is a weighted sum of the filtered rows. The
+// weights of both passes are computed once per scaling operation. Pixels are
+// filtered as premultiplied floats, so that transparent pixels don't bleed
+// their color, and the result is stored premultiplied. The inner loops have
+// SSE4.1 and AVX2 versions, chosen at runtime, and scalar ones for other CPUs.
+////////////////////////////////////////////////////////////////////////////////
+
+/// The filters for `graphics_scaling_filter`.
+enum ScalingFilter {
+	/// Use imlib's anti-aliased scaling.
+	SCALING_FILTER_IMLIB = 0,
+	/// Average the pixels (box filter) when shrinking, interpolate
+	/// bilinearly when enlarging.
+	SCALING_FILTER_BOX = 1,
+	/// Lanczos-3, sharper but slower.
+	SCALING_FILTER_LANCZOS = 2,
+};
+
+const char *scaling_filter_strings[3] = {
+	"imlib",
+	"box",
+	"lanczos",
+};
+
+/// The weights of the source pixels contributing to each output pixel along
+/// one axis. The output pixel `i` is the sum of `count[i]` source pixels
+/// starting from `start[i]` with weights `weights[i * max_count + k]`.
+typedef struct {
+	int *start, *count;
+	float *weights;
+	int max_count;
+} ResampleAxis;
+
+static float gr_filter_box(float x) { return x > -0.5f && x <= 0.5f; }
+
+static float gr_filter_triangle(float x) {
+	x = fabsf(x);
+	return x < 1.0f ? 1.0f - x : 0.0f;
 }
 
-/// Returns an array of pointers to all placements sorted by atime. The size of
-/// the array is `total_placement_count`. Returns NULL if there are no
-/// placements. The array must be freed with `free()` by the caller.
-static ImagePlacement **gr_get_placements_sorted_by_atime() {
-	if (total_placement_count == 0)
-		return NULL;
-	ImagePlacement **placements_sorted =
-		malloc(sizeof(ImagePlacement *) * total_placement_count);
-	Image *img = NULL;
-	ImagePlacement *placement = NULL;
-	int i = 0;
-	kh_foreach_value(images, img, {
-		kh_foreach_value(img->placements, placement, {
-			if (i < total_placement_count)
-				placements_sorted[i] = placement;
-			i++;
-		});
-	});
-	if (i != total_placement_count) {
-		// This should never happen, but if it does, report an error,
-		// set the correct count, and redo the sorting.
-		fprintf(stderr,
-			"error: total_placement_count (%d) is wrong, the "
-			"correct value is %d\n",
-			total_placement_count, i);
-		free(placements_sorted);
-		total_placement_count = i;
-		return gr_get_placements_sorted_by_atime();
-	}
-	qsort(placements_sorted, total_placement_count,
-	      sizeof(ImagePlacement *), gr_cmp_placements_by_atime);
-	return placements_sorted;
+static float gr_filter_lanczos(float x) {
+	const float pi = 3.14159265f;
+	if (x == 0.0f)
+		return 1.0f;
+	if (x <= -3.0f || x >= 3.0f)
+		return 0.0f;
+	float px = pi * x;
+	return 3.0f * sinf(px) * sinf(px / 3.0f) / (px * px);
 }
 
-/// Returns the limit adjusted by the excess tolerance ratio.
-static inline unsigned apply_tolerance(unsigned limit) {
-	return limit + (unsigned)(limit * graphics_excess_tolerance_ratio);
+static void gr_resample_axis_free(ResampleAxis *axis) {
+	free(axis->start);
+	free(axis->count);
+	free(axis->weights);
 }
 
-/// Checks RAM and disk cache limits and deletes/unloads some images.
-static void gr_check_limits() {
-	Image **images_sorted = NULL;
-	ImagePlacement **placements_sorted = NULL;
-	int images_begin = 0;
-	int placements_begin = 0;
-	// First reduce the number of images if there are too many.
-	if (kh_size(images) > apply_tolerance(graphics_max_total_placements)) {
-		GR_LOG("Too many images: %d\n", kh_size(images));
-		images_sorted = gr_get_images_sorted_by_atime();
-		int to_delete = kh_size(images) -
-				graphics_max_total_placements;
-		for (int i = 0; i < to_delete; i++) {
-			gr_delete_image(images_sorted[images_begin]);
-			images_begin++;
-		}
+/// Computes the weights for scaling `in_size` pixels to `out_size` pixels.
+/// Returns 0 on allocation failure.
+static int gr_resample_axis_init(ResampleAxis *axis, int in_size,
+				 int out_size, int filter) {
+	double scale = (double)in_size / out_size;
+	// When shrinking, the filter is stretched to cover all source pixels.
+	double filter_scale = MAX(scale, 1.0);
+	float (*kernel)(float) = gr_filter_triangle;
+	double support = 1.0;
+	if (filter == SCALING_FILTER_LANCZOS) {
+		kernel = gr_filter_lanczos;
+		support = 3.0;
+	} else if (scale > 1.0) {
+		kernel = gr_filter_box;
+		support = 0.5;
 	}
-	// Then reduce the number of placements if there are too many.
-	if (total_placement_count >
-	    apply_tolerance(graphics_max_total_placements)) {
-		GR_LOG("Too many placements: %d\n", total_placement_count);
-		placements_sorted = gr_get_placements_sorted_by_atime();
-		int to_delete = total_placement_count -
-				graphics_max_total_placements;
-		for (int i = 0; i < to_delete; i++) {
-			if (placements_sorted[placements_begin]->protected)
-				break;
-			gr_delete_placement(placements_sorted[placements_begin]);
-			placements_begin++;
-		}
+	support *= filter_scale;
+
+	axis->max_count = (int)ceil(support * 2) + 1;
+	axis->start = malloc(out_size * sizeof(int));
+	axis->count = malloc(out_size * sizeof(int));
+	axis->weights =
+		malloc((size_t)out_size * axis->max_count * sizeof(float));
+	if (!axis->start || !axis->count || !axis->weights) {
+		gr_resample_axis_free(axis);
+		return 0;
 	}
-	// Then reduce the size of the image file cache.
-	if (images_disk_size >
-	    apply_tolerance(graphics_total_file_cache_size)) {
-		GR_LOG("Too big disk cache: %ld KiB\n",
-		       images_disk_size / 1024);
-		if (!images_sorted)
-			images_sorted = gr_get_images_sorted_by_atime();
-		int i = 0;
-		int total_images = kh_size(images);
-		while (images_disk_size > graphics_total_file_cache_size &&
-		       i < total_images) {
-			gr_delete_imagefile(images_sorted[images_begin + i]);
-			i++;
+	for (int i = 0; i < out_size; ++i) {
+		double center = (i + 0.5) * scale;
+		int from = MAX((int)(center - support + 0.5), 0);
+		int to = MIN((int)(center + support + 0.5), in_size);
+		to = MIN(to, from + axis->max_count);
+		float *w = axis->weights + (size_t)i * axis->max_count;
+		double total = 0;
+		for (int k = 0; k < to - from; ++k) {
+			w[k] = kernel((from + k - center + 0.5) / filter_scale);
+			total += w[k];
+		}
+		if (to <= from || total == 0) {
+			// Can't happen with sane sizes, take the nearest pixel.
+			from = MIN((int)center, in_size - 1);
+			to = from + 1;
+			w[0] = 1.0f;
+			total = 1.0;
 		}
+		for (int k = 0; k < to - from; ++k)
+			w[k] /= total;
+		axis->start[i] = from;
+		axis->count[i] = to - from;
 	}
-	// Then unload images from RAM.
-	if (images_ram_size > apply_tolerance(graphics_max_total_ram_size)) {
-		GR_LOG("Too much ram: %ld KiB\n", images_ram_size / 1024);
-		if (!images_sorted)
-			images_sorted = gr_get_images_sorted_by_atime();
-		int i = 0;
-		unsigned total_images = kh_size(images);
-		while (images_ram_size > graphics_max_total_ram_size &&
-		       i < total_images) {
-			gr_unload_image(images_sorted[images_begin + i]);
-			i++;
+	return 1;
+}
+
+/// Converts ARGB pixels to premultiplied floats (blue, green, red, alpha).
+static void gr_resample_convert_scalar(const DATA32 *in, float *out, int n) {
+	for (int i = 0; i < n; ++i) {
+		DATA32 p = in[i];
+		float a = p >> 24;
+		float f = a / 255.0f;
+		out[4 * i] = (p & 0xFF) * f;
+		out[4 * i + 1] = ((p >> 8) & 0xFF) * f;
+		out[4 * i + 2] = ((p >> 16) & 0xFF) * f;
+		out[4 * i + 3] = a;
+	}
+}
+
+/// Filters the row `in` horizontally, producing the output pixels from `from`
+/// to `to` (exclusive).
+static void gr_resample_horizontal_scalar(const float *in, float *out,
+					  ResampleAxis *axis, int from,
+					  int to) {
+	for (int i = from; i < to; ++i, out += 4) {
+		const float *w = axis->weights + (size_t)i * axis->max_count;
+		const float *p = in + (size_t)axis->start[i] * 4;
+		float b = 0, g = 0, r = 0, a = 0;
+		for (int k = 0; k < axis->count[i]; ++k, p += 4) {
+			b += w[k] * p[0];
+			g += w[k] * p[1];
+			r += w[k] * p[2];
+			a += w[k] * p[3];
 		}
+		out[0] = b;
+		out[1] = g;
+		out[2] = r;
+		out[3] = a;
 	}
-	// Then unload placements from RAM.
-	if (images_ram_size > apply_tolerance(graphics_max_total_ram_size)) {
-		GR_LOG("Still too much ram: %ld KiB\n", images_ram_size / 1024);
-		if (!placements_sorted)
-			placements_sorted = gr_get_placements_sorted_by_atime();
-		int i = 0;
-		while (images_ram_size > graphics_max_total_ram_size &&
-		       i < total_placement_count) {
-			if (!placements_sorted[placements_begin + i]->protected)
-				gr_unload_placement(
-					placements_sorted[placements_begin +
-							  i]);
-			i++;
+}
+
+/// Computes the weighted sum of `count` filtered rows of `n` floats.
+static void gr_resample_vertical_scalar(float **rows, const float *weights,
+					int count, float *out, int n) {
+	for (int j = 0; j < n; ++j) {
+		float sum = 0;
+		for (int k = 0; k < count; ++k)
+			sum += weights[k] * rows[k][j];
+		out[j] = sum;
+	}
+}
+
+/// Packs premultiplied floats into premultiplied ARGB pixels. Color channels
+/// are clamped to the alpha, filters with negative lobes may overshoot.
+static void gr_resample_store_scalar(const float *in, DATA32 *out, int n) {
+	for (int i = 0; i < n; ++i, in += 4) {
+		float a = in[3] < 0 ? 0 : in[3] > 255 ? 255 : in[3];
+		DATA32 p = (DATA32)(a + 0.5f) << 24;
+		for (int c = 0; c < 3; ++c) {
+			float v = in[c] < 0 ? 0 : in[c] > a ? a : in[c];
+			p |= (DATA32)(v + 0.5f) << (8 * c);
 		}
+		out[i] = p;
 	}
-	if (images_sorted || placements_sorted) {
-		GR_LOG("After cleaning:  ram: %ld KiB  disk: %ld KiB  "
-		       "img count: %d  placement count: %d\n",
-		       images_ram_size / 1024, images_disk_size / 1024,
-		       kh_size(images), total_placement_count);
+}
+
+#ifdef GR_RESAMPLE_X86
+__attribute__((target("sse4.1")))
+static void gr_resample_convert_sse41(const DATA32 *in, float *out, int n) {
+	const __m128 scale = _mm_set1_ps(1.0f / 255.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (int i = 0; i < n; ++i) {
+		__m128 p = _mm_cvtepi32_ps(
+			_mm_cvtepu8_epi32(_mm_cvtsi32_si128(in[i])));
+		__m128 f = _mm_mul_ps(_mm_shuffle_ps(p, p, 0xFF), scale);
+		// Don't premultiply the alpha itself.
+		f = _mm_blend_ps(f, one, 0x8);
+		_mm_storeu_ps(out + 4 * i, _mm_mul_ps(p, f));
 	}
-	free(images_sorted);
-	free(placements_sorted);
 }
 
-/// Unloads all images by user request.
-void gr_unload_images_to_reduce_ram() {
-	Image *img = NULL;
-	ImagePlacement *placement = NULL;
-	kh_foreach_value(images, img, {
-		kh_foreach_value(img->placements, placement, {
-			if (placement->protected)
-				continue;
-			gr_unload_placement(placement);
-		});
-		gr_unload_image(img);
-	});
+__attribute__((target("sse4.1")))
+static void gr_resample_horizontal_sse41(const float *in, float *out,
+					 ResampleAxis *axis, int from, int to) {
+	for (int i = from; i < to; ++i, out += 4) {
+		const float *w = axis->weights + (size_t)i * axis->max_count;
+		const float *p = in + (size_t)axis->start[i] * 4;
+		__m128 acc = _mm_setzero_ps();
+		for (int k = 0; k < axis->count[i]; ++k, p += 4)
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]),
+							 _mm_loadu_ps(p)));
+		_mm_storeu_ps(out, acc);
+	}
 }
 
-/// Update the atime of the image.
-static void gr_touch_image(Image *img) {
-	clock_gettime(CLOCK_MONOTONIC, &img->atime);
+__attribute__((target("sse4.1")))
+static void gr_resample_vertical_sse41(float **rows, const float *weights,
+				       int count, float *out, int n) {
+	int j = 0;
+	for (; j + 4 <= n; j += 4) {
+		__m128 acc = _mm_setzero_ps();
+		for (int k = 0; k < count; ++k)
+			acc = _mm_add_ps(acc,
+					 _mm_mul_ps(_mm_set1_ps(weights[k]),
+						    _mm_loadu_ps(rows[k] + j)));
+		_mm_storeu_ps(out + j, acc);
+	}
+	gr_resample_vertical_scalar(rows, weights, count, out + j, n - j);
 }
 
-/// Update the atime of the placement. Touches the images too.
-static void gr_touch_placement(ImagePlacement *placement) {
-	clock_gettime(CLOCK_MONOTONIC, &placement->atime);
-	placement->image->atime = placement->atime;
+__attribute__((target("sse4.1")))
+static void gr_resample_store_sse41(const float *in, DATA32 *out, int n) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 max = _mm_set1_ps(255.0f);
+	for (int i = 0; i < n; ++i, in += 4) {
+		__m128 p = _mm_loadu_ps(in);
+		__m128 a = _mm_shuffle_ps(p, p, 0xFF);
+		a = _mm_min_ps(_mm_max_ps(a, zero), max);
+		__m128i c = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(p, zero), a));
+		c = _mm_packus_epi32(c, c);
+		out[i] = _mm_cvtsi128_si32(_mm_packus_epi16(c, c));
+	}
 }
 
-/// Creates a new image with the given id. If an image with that id already
-/// exists, it is deleted first. If the provided id is 0, generates a
-/// random id.
-static Image *gr_new_image(uint32_t id) {
-	if (id == 0) {
-		do {
-			id = rand();
-			// Avoid IDs that don't need full 32 bits.
-		} while ((id & 0xFF000000) == 0 || (id & 0x00FFFF00) == 0 ||
-			 gr_find_image(id));
-		GR_LOG("Generated random image id %u\n", id);
+__attribute__((target("avx2")))
+static void gr_resample_convert_avx2(const DATA32 *in, float *out, int n) {
+	const __m256 scale = _mm256_set1_ps(1.0f / 255.0f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	int i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m256 p = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+			_mm_loadl_epi64((const __m128i *)(in + i))));
+		__m256 f = _mm256_mul_ps(_mm256_shuffle_ps(p, p, 0xFF), scale);
+		f = _mm256_blend_ps(f, one, 0x88);
+		_mm256_storeu_ps(out + 4 * i, _mm256_mul_ps(p, f));
 	}
-	Image *img = gr_find_image(id);
-	gr_delete_image_keep_id(img);
-	GR_LOG("Creating image %u\n", id);
-	img = malloc(sizeof(Image));
-	memset(img, 0, sizeof(Image));
-	img->placements = kh_init(id2placement);
-	int ret;
-	khiter_t k = kh_put(id2image, images, id, &ret);
-	kh_value(images, k) = img;
-	img->image_id = id;
-	gr_touch_image(img);
-	img->global_command_index = global_command_counter;
-	return img;
+	gr_resample_convert_sse41(in + i, out + 4 * i, n - i);
 }
 
-/// Creates a new placement with the given id. If a placement with that id
-/// already exists, it is deleted first. If the provided id is 0, generates a
-/// random id.
-static ImagePlacement *gr_new_placement(Image *img, uint32_t id) {
-	if (id == 0) {
-		do {
-			// Currently we support only 24-bit IDs.
-			id = rand() & 0xFFFFFF;
-			// Avoid IDs that need only one byte.
-		} while ((id & 0x00FFFF00) == 0 || gr_find_placement(img, id));
+__attribute__((target("avx2")))
+static void gr_resample_horizontal_avx2(const float *in, float *out,
+					ResampleAxis *axis, int from, int to) {
+	for (int i = from; i < to; ++i, out += 4) {
+		const float *w = axis->weights + (size_t)i * axis->max_count;
+		const float *p = in + (size_t)axis->start[i] * 4;
+		int count = axis->count[i];
+		// Two source pixels per iteration, one in each half.
+		__m256 acc = _mm256_setzero_ps();
+		int k = 0;
+		for (; k + 2 <= count; k += 2, p += 8) {
+			__m256 wk = _mm256_insertf128_ps(
+				_mm256_castps128_ps256(_mm_set1_ps(w[k])),
+				_mm_set1_ps(w[k + 1]), 1);
+			acc = _mm256_add_ps(acc,
+					    _mm256_mul_ps(wk, _mm256_loadu_ps(p)));
+		}
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+					_mm256_extractf128_ps(acc, 1));
+		if (k < count)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(w[k]),
+							 _mm_loadu_ps(p)));
+		_mm_storeu_ps(out, sum);
 	}
-	ImagePlacement *placement = gr_find_placement(img, id);
-	gr_delete_placement_keep_id(placement);
-	GR_LOG("Creating placement %u/%u\n", img->image_id, id);
-	placement = malloc(sizeof(ImagePlacement));
-	memset(placement, 0, sizeof(ImagePlacement));
-	total_placement_count++;
-	int ret;
-	khiter_t k = kh_put(id2placement, img->placements, id, &ret);
-	kh_value(img->placements, k) = placement;
-	placement->image = img;
-	placement->placement_id = id;
-	gr_touch_placement(placement);
-	if (img->default_placement == 0)
-		img->default_placement = id;
+}
+
+__attribute__((target("avx2")))
+static void gr_resample_vertical_avx2(float **rows, const float *weights,
+				      int count, float *out, int n) {
+	int j = 0;
+	for (; j + 8 <= n; j += 8) {
+		__m256 acc = _mm256_setzero_ps();
+		for (int k = 0; k < count; ++k)
+			acc = _mm256_add_ps(
+				acc, _mm256_mul_ps(_mm256_set1_ps(weights[k]),
+						   _mm256_loadu_ps(rows[k] + j)));
+		_mm256_storeu_ps(out + j, acc);
+	}
+	gr_resample_vertical_sse41(rows, weights, count, out + j, n - j);
+}
+#endif
+
+/// The inner loops of the resampler for the current CPU.
+static void (*gr_resample_convert)(const DATA32 *, float *,
+				   int) = gr_resample_convert_scalar;
+static void (*gr_resample_horizontal)(const float *, float *, ResampleAxis *,
+				      int, int) = gr_resample_horizontal_scalar;
+static void (*gr_resample_vertical)(float **, const float *, int, float *,
+				    int) = gr_resample_vertical_scalar;
+static void (*gr_resample_store)(const float *, DATA32 *,
+				 int) = gr_resample_store_scalar;
+
+/// Picks the fastest versions of the inner loops supported by the CPU. Returns
+/// the name of the instruction set.
+static const char *gr_resample_init_kernels() {
+#ifdef GR_RESAMPLE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		gr_resample_convert = gr_resample_convert_avx2;
+		gr_resample_horizontal = gr_resample_horizontal_avx2;
+		gr_resample_vertical = gr_resample_vertical_avx2;
+		gr_resample_store = gr_resample_store_sse41;
+		return "AVX2";
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		gr_resample_convert = gr_resample_convert_sse41;
+		gr_resample_horizontal = gr_resample_horizontal_sse41;
+		gr_resample_vertical = gr_resample_vertical_sse41;
+		gr_resample_store = gr_resample_store_sse41;
+		return "SSE4.1";
+	}
+#endif
+	return "scalar";
+}
+
+/// Converts straight ARGB pixels to premultiplied ones in place.
+static void gr_premultiply(DATA32 *pixels, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		DATA32 p = pixels[i];
+		DATA32 a = p >> 24;
+		if (a == 0xFF)
+			continue;
+		DATA32 res = p & 0xFF000000;
+		for (int shift = 0; shift < 24; shift += 8)
+			res |= ((((p >> shift) & 0xFF) * a + 127) / 255) << shift;
+		pixels[i] = res;
+	}
+}
+
+/// Converts premultiplied ARGB pixels to straight ones in place.
+static void gr_unpremultiply(DATA32 *pixels, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		DATA32 p = pixels[i];
+		DATA32 a = p >> 24;
+		if (a == 0xFF || a == 0)
+			continue;
+		DATA32 res = p & 0xFF000000;
+		for (int shift = 0; shift < 24; shift += 8) {
+			DATA32 c = (((p >> shift) & 0xFF) * 255 + a / 2) / a;
+			res |= MIN(c, 0xFF) << shift;
+		}
+		pixels[i] = res;
+	}
+}
+
+/// Scales the rectangle `src_x, src_y, src_w, src_h` of the buffer to
+/// `dest_w` x `dest_h` pixels, and writes them at `dest_x, dest_y` into the
+/// premultiplied ARGB image `out` of size `out_w` x `out_h`, overwriting its
+/// pixels. Only the part inside `out` is computed. Returns 0 on allocation
+/// failure.
+static int gr_resample(PixelBuffer *src, int src_x, int src_y, int src_w,
+		       int src_h, DATA32 *out, int out_w, int out_h,
+		       int dest_x, int dest_y, int dest_w, int dest_h,
+		       int filter) {
+	int x0 = MAX(-dest_x, 0), x1 = MIN(dest_w, out_w - dest_x);
+	int y0 = MAX(-dest_y, 0), y1 = MIN(dest_h, out_h - dest_y);
+	if (x0 >= x1 || y0 >= y1 || src_w <= 0 || src_h <= 0)
+		return 1;
+	int vis_w = x1 - x0;
+
+	ResampleAxis horz = {0}, vert = {0};
+	if (!gr_resample_axis_init(&horz, src_w, dest_w, filter))
+		return 0;
+	if (!gr_resample_axis_init(&vert, src_h, dest_h, filter)) {
+		gr_resample_axis_free(&horz);
+		return 0;
+	}
+
+	// Horizontally filtered source rows are kept in a ring buffer, which is
+	// big enough for all rows contributing to an output row.
+	int ring_size = vert.max_count;
+	size_t row_floats = (size_t)vis_w * 4;
+	DATA32 *src_row = malloc(src_w * sizeof(DATA32));
+	float *src_floats = malloc((size_t)src_w * 4 * sizeof(float));
+	float *ring = malloc(ring_size * row_floats * sizeof(float));
+	int *ring_rows = malloc(ring_size * sizeof(int));
+	float **rows = malloc(ring_size * sizeof(float *));
+	float *sum = malloc(row_floats * sizeof(float));
+	int ok = src_row && src_floats && ring && ring_rows && rows && sum;
+	for (int i = 0; ok && i < ring_size; ++i)
+		ring_rows[i] = -1;
+
+	for (int y = y0; ok && y < y1; ++y) {
+		int start = vert.start[y];
+		int count = vert.count[y];
+		for (int k = 0; k < count; ++k) {
+			int sy = start + k;
+			int slot = sy % ring_size;
+			rows[k] = ring + slot * row_floats;
+			if (ring_rows[slot] == sy)
+				continue;
+			gr_pixbuf_read_row(src, src_x, src_y + sy, src_w,
+					   src_row);
+			gr_resample_convert(src_row, src_floats, src_w);
+			gr_resample_horizontal(src_floats, rows[k], &horz, x0,
+					       x1);
+			ring_rows[slot] = sy;
+		}
+		gr_resample_vertical(rows,
+				     vert.weights + (size_t)y * vert.max_count,
+				     count, sum, row_floats);
+		gr_resample_store(sum,
+				  out + (size_t)(dest_y + y) * out_w + dest_x +
+					  x0,
+				  vis_w);
+	}
+
+	free(src_row);
+	free(src_floats);
+	free(ring);
+	free(ring_rows);
+	free(rows);
+	free(sum);
+	gr_resample_axis_free(&horz);
+	gr_resample_axis_free(&vert);
+	return ok;
+}
+
+/// Copies the rectangle `src_x, src_y, w, h` of the buffer without scaling to
+/// `dest_x, dest_y` in the premultiplied ARGB image `out` of size `out_w` x
+/// `out_h`. Only the part inside `out` is copied. Premultiplication is skipped
+/// if the buffer is known to be `opaque`.
+static void gr_copy_unscaled(PixelBuffer *src, int src_x, int src_y, int w,
+			     int h, DATA32 *out, int out_w, int out_h,
+			     int dest_x, int dest_y, char opaque) {
+	int x0 = MAX(-dest_x, 0), x1 = MIN(w, out_w - dest_x);
+	int y0 = MAX(-dest_y, 0), y1 = MIN(h, out_h - dest_y);
+	if (x0 >= x1)
+		return;
+	for (int y = y0; y < y1; ++y) {
+		DATA32 *row = out + (size_t)(dest_y + y) * out_w + dest_x + x0;
+		gr_pixbuf_read_row(src, src_x + x0, src_y + y, x1 - x0, row);
+		if (!opaque)
+			gr_premultiply(row, x1 - x0);
+	}
+}
+
+/// How the loaded pixels of an image are fit into the scaled image of a
+/// placement, see `gr_get_scaling_params`.
+typedef struct {
+	/// The size of the scaled image.
+	int scaled_w, scaled_h;
+	/// The source rectangle in the coordinates of the loaded pixels.
+	int src_x, src_y, src_w, src_h;
+	/// The destination rectangle in the scaled image.
+	int dest_x, dest_y, dest_w, dest_h;
+	/// Whether the loaded pixels are known to be opaque, and whether the
+	/// scaled image will be opaque too.
+	char source_opaque, opaque;
+} ScalingParams;
+
+/// Fills the premultiplied ARGB image `out` according to `p` using
+/// `filter`. Returns the name of the method used, or NULL if the imlib filter
+/// is requested or resampling fails, in which case only the transparent
+/// background is filled. Doesn't use imlib, so decoding threads may call it.
+static const char *gr_scale_pixels(PixelBuffer *src, const ScalingParams *p,
+				   int filter, DATA32 *out) {
+	if (!p->opaque)
+		memset(out, 0,
+		       (size_t)p->scaled_w * p->scaled_h * sizeof(DATA32));
+	if (p->dest_w <= 0 || p->dest_h <= 0)
+		return "nothing";
+	if (p->dest_w == p->src_w && p->dest_h == p->src_h) {
+		// Nothing to filter (e.g. sixel images), just copy the pixels.
+		gr_copy_unscaled(src, p->src_x, p->src_y, p->src_w, p->src_h,
+				 out, p->scaled_w, p->scaled_h, p->dest_x,
+				 p->dest_y, p->source_opaque);
+		return "copy";
+	}
+	if (filter == SCALING_FILTER_IMLIB ||
+	    !gr_resample(src, p->src_x, p->src_y, p->src_w, p->src_h, out,
+			 p->scaled_w, p->scaled_h, p->dest_x, p->dest_y,
+			 p->dest_w, p->dest_h, filter))
+		return NULL;
+	return scaling_filter_strings[filter];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Basic image management functions (create, delete, find, etc).
+////////////////////////////////////////////////////////////////////////////////
+
+/// Finds the image corresponding to the client id. Returns NULL if cannot find.
+static Image *gr_find_image(uint32_t image_id) {
+	khiter_t k = kh_get(id2image, images, image_id);
+	if (k == kh_end(images))
+		return NULL;
+	Image *res = kh_value(images, k);
+	return res;
+}
+
+/// Finds the newest image corresponding to the image number. Returns NULL if
+/// cannot find.
+static Image *gr_find_image_by_number(uint32_t image_number) {
+	if (image_number == 0)
+		return NULL;
+	Image *newest_img = NULL;
+	Image *img = NULL;
+	kh_foreach_value(images, img, {
+		if (img->image_number == image_number &&
+		    (!newest_img || newest_img->global_command_index <
+					    img->global_command_index))
+			newest_img = img;
+	});
+	if (!newest_img)
+		GR_LOG("Image number %u not found\n", image_number);
+	else
+		GR_LOG("Found image number %u, its id is %u\n", image_number,
+		       img->image_id);
+	return newest_img;
+}
+
+/// Finds the placement corresponding to the id. If the placement id is 0,
+/// returns some default placement.
+static ImagePlacement *gr_find_placement(Image *img, uint32_t placement_id) {
+	if (!img)
+		return NULL;
+	if (placement_id == 0) {
+		// Try to get the default placement.
+		ImagePlacement *dflt = NULL;
+		if (img->default_placement != 0)
+			dflt = gr_find_placement(img, img->default_placement);
+		if (dflt)
+			return dflt;
+		// If there is no default placement, return the first one and
+		// set it as the default.
+		kh_foreach_value(img->placements, dflt, {
+			img->default_placement = dflt->placement_id;
+			return dflt;
+		});
+		// If there are no placements, return NULL.
+		return NULL;
+	}
+	khiter_t k = kh_get(id2placement, img->placements, placement_id);
+	if (k == kh_end(img->placements))
+		return NULL;
+	ImagePlacement *res = kh_value(img->placements, k);
+	return res;
+}
+
+/// Finds the placement by image id and placement id.
+static ImagePlacement *gr_find_image_and_placement(uint32_t image_id,
+						   uint32_t placement_id) {
+	return gr_find_placement(gr_find_image(image_id), placement_id);
+}
+
+/// Returns the placement referred to by the underlay, or NULL if it doesn't
+/// exist anymore.
+static ImagePlacement *gr_underlay_placement(Underlay *underlay) {
+	ImagePlacement *placement = gr_find_image_and_placement(
+		underlay->image_id, underlay->placement_id);
+	if (!placement || placement->serial != underlay->serial)
+		return NULL;
 	return placement;
 }
 
-static int64_t ceil_div(int64_t a, int64_t b) {
-	return (a + b - 1) / b;
+/// The maximum nesting of underlays drawn under a placement.
+#define MAX_UNDERLAY_DEPTH 8
+
+/// Writes the name of the on-disk cache file to `out`. `max_len` should be the
+/// size of `out`. The name will be something like "/tmp/st-images-xxx/img-ID".
+static void gr_get_image_filename(Image *img, char *out, size_t max_len) {
+	snprintf(out, max_len, "%s/img-%.3u", cache_dir, img->image_id);
+}
+
+/// Returns the size of an image side of `size` pixels decoded at 1/`reduction`
+/// of its resolution.
+static int gr_reduced_size(int size, int reduction) {
+	return reduction > 1 ? (size + reduction - 1) / reduction : size;
+}
+
+/// Returns the RAM size used by the loaded original image, 0 if it's not
+/// loaded.
+static unsigned gr_image_ram_size(Image *img) {
+	return img->original_image ? gr_pixbuf_ram_size(img->original_image)
+				   : 0;
+}
+
+/// Returns the RAM size used by the composited frame of the image.
+static unsigned gr_frame_image_ram_size(Image *img) {
+	return (unsigned)img->pix_width * img->pix_height * 4;
+}
+
+/// Returns the (estimation) of the RAM size used by one scaled buffer of the
+/// placement (the normal or the inverted one).
+static unsigned gr_scaled_image_ram_size(ImagePlacement *placement) {
+	return (unsigned)placement->rows * placement->cols *
+	       placement->scaled_ch * placement->scaled_cw * 4;
+}
+
+/// Returns the (estimation) of the RAM size used by the placemenet when loaded,
+/// including the inverted copy and the XRender pictures if there are any.
+static unsigned gr_placement_ram_size(ImagePlacement *placement) {
+	unsigned copies = 1 + !!placement->scaled_image_reverse +
+			  !!placement->picture + !!placement->picture_reverse;
+	return gr_scaled_image_ram_size(placement) * copies;
+}
+
+/// Unload the image from RAM (i.e. free its pixel buffer). If the on-disk file
+/// of the image is preserved, it can be reloaded later.
+static void gr_unload_image(Image *img) {
+	gr_drop_scaling_jobs(img);
+	if (!img->original_image)
+		return;
+
+	images_ram_size -= gr_image_ram_size(img);
+	gr_pixbuf_free(img->original_image);
+
+	img->original_image = NULL;
+	img->reduction = 0;
+	// The composited frame is cheap to recreate compared to the original.
+	if (img->frame_image) {
+		imlib_context_set_image(img->frame_image);
+		imlib_free_image();
+		images_ram_size -= gr_frame_image_ram_size(img);
+		img->frame_image = NULL;
+		img->frame_image_index = 0;
+	}
+	// If the image is still being uploaded, the pixels decoded so far are
+	// lost, it will be loaded from the file when the upload is finished.
+	img->progressive = 0;
+
+	GR_LOG("After unloading image %u ram: %ld KiB\n", img->image_id,
+	       images_ram_size / 1024);
+}
+
+/// Unload the placement from RAM (i.e. delete the corresponding imlib object).
+/// If the on-disk file of the corresponding image is preserved, it can be
+/// reloaded later.
+static void gr_unload_placement(ImagePlacement *placement) {
+	if (!placement->scaled_image)
+		return;
+
+	gr_render_release(placement);
+	images_ram_size -= gr_placement_ram_size(placement);
+	gr_atlas_release(placement);
+	placement->atlas_ineligible = 0;
+
+	imlib_context_set_image(placement->scaled_image);
+	imlib_free_image();
+	if (placement->scaled_image_reverse) {
+		imlib_context_set_image(placement->scaled_image_reverse);
+		imlib_free_image();
+	}
+
+	placement->scaled_image = NULL;
+	placement->scaled_image_reverse = NULL;
+	placement->scaled_ch = placement->scaled_cw = 0;
+	placement->preview = 0;
+
+	GR_LOG("After unloading placement %u/%u ram: %ld KiB\n",
+	       placement->image->image_id, placement->placement_id,
+	       images_ram_size / 1024);
+}
+
+/// Frees the scaled image kept in the tombstone and marks the slot as free.
+static void gr_free_tombstone(Tombstone *ts) {
+	if (!ts->image_id)
+		return;
+	imlib_context_set_image(ts->scaled_image);
+	imlib_free_image();
+	images_ram_size -= ts->ram_size;
+	memset(ts, 0, sizeof(Tombstone));
+}
+
+/// Frees tombstones belonging to the image `image_id`, or all tombstones if
+/// `image_id` is 0.
+static void gr_free_tombstones_of_image(uint32_t image_id) {
+	for (int i = 0; i < MAX_TOMBSTONES; ++i) {
+		if (!image_id || tombstones[i].image_id == image_id)
+			gr_free_tombstone(&tombstones[i]);
+	}
+}
+
+/// Returns the number of milliseconds elapsed since `past`.
+static double gr_ms_since(const struct timespec *now,
+			  const struct timespec *past) {
+	return difftime(now->tv_sec, past->tv_sec) * 1000 +
+	       (now->tv_nsec - past->tv_nsec) / 1e6;
+}
+
+/// Adds `ms` milliseconds to `t`.
+static void gr_add_ms(struct timespec *t, long ms) {
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += (ms % 1000) * 1000000;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+/// Frees tombstones that are older than `graphics_tombstone_lifetime_ms`.
+static void gr_free_expired_tombstones() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int i = 0; i < MAX_TOMBSTONES; ++i) {
+		Tombstone *ts = &tombstones[i];
+		if (ts->image_id && gr_ms_since(&now, &ts->deletion_time) >
+					    graphics_tombstone_lifetime_ms)
+			gr_free_tombstone(ts);
+	}
+}
+
+/// The state of a scan of the screen for visible placements. Consecutive cells
+/// usually belong to the same placement, so the last lookup is cached.
+typedef struct {
+	struct timespec now;
+	uint32_t image_id, placement_id;
+} VisibilitySweep;
+
+/// Sets the atime of the placements covered by `placement` (they are drawn
+/// through it, but own no cells) and of their images to `now`.
+static void gr_touch_underlays(ImagePlacement *placement,
+			       struct timespec now, int depth) {
+	if (depth >= MAX_UNDERLAY_DEPTH)
+		return;
+	for (int i = 0; i < placement->underlay_count; ++i) {
+		ImagePlacement *under =
+			gr_underlay_placement(&placement->underlays[i]);
+		if (!under)
+			continue;
+		under->atime = now;
+		under->image->atime = now;
+		gr_touch_underlays(under, now, depth + 1);
+	}
+}
+
+/// Touches the placement shown in the cell and the placements it covers. Used
+/// with `gr_for_each_image_cell`.
+static int gr_mark_visible_cell(void *data, uint32_t image_id,
+				uint32_t placement_id, int col, int row,
+				char is_classic) {
+	VisibilitySweep *sweep = data;
+	if (image_id == sweep->image_id && placement_id == sweep->placement_id)
+		return 0;
+	sweep->image_id = image_id;
+	sweep->placement_id = placement_id;
+	ImagePlacement *placement =
+		gr_find_image_and_placement(image_id, placement_id);
+	if (placement) {
+		placement->atime = sweep->now;
+		placement->image->atime = sweep->now;
+		gr_touch_underlays(placement, sweep->now, 0);
+	}
+	return 0;
+}
+
+/// Unloads the scaled images of placements that haven't been on the screen for
+/// `graphics_offscreen_scaled_lifetime_ms`, so that memory usage follows what
+/// is visible rather than the history. The original images are kept, so the
+/// placements can come back cheaply. The screen is scanned at most once per
+/// second.
+static void gr_unload_offscreen_placements() {
+	unsigned lifetime = graphics_offscreen_scaled_lifetime_ms;
+	if (!lifetime)
+		return;
+	VisibilitySweep sweep = {0};
+	clock_gettime(CLOCK_MONOTONIC, &sweep.now);
+	if (gr_ms_since(&sweep.now, &last_visibility_sweep_time) <
+	    MIN(1000, lifetime / 2))
+		return;
+	last_visibility_sweep_time = sweep.now;
+	gr_for_each_image_cell(gr_mark_visible_cell, &sweep);
+	Image *img = NULL;
+	ImagePlacement *placement = NULL;
+	kh_foreach_value(images, img, {
+		kh_foreach_value(img->placements, placement, {
+			if (placement->scaled_image && !placement->protected &&
+			    gr_ms_since(&sweep.now, &placement->atime) >
+				    lifetime) {
+				GR_LOG("Placement %u/%u is off-screen\n",
+				       img->image_id, placement->placement_id);
+				gr_unload_placement(placement);
+			}
+		});
+	});
+}
+
+/// Frees the inverted copy of the scaled image and the XRender pictures and
+/// removes the placement from its atlas, e.g. when the scaled image is about to
+/// change.
+static void gr_drop_scaled_image_copies(ImagePlacement *placement) {
+	gr_atlas_release(placement);
+	gr_render_release(placement);
+	if (placement->scaled_image_reverse) {
+		imlib_context_set_image(placement->scaled_image_reverse);
+		imlib_free_image();
+		images_ram_size -= gr_scaled_image_ram_size(placement);
+		placement->scaled_image_reverse = NULL;
+	}
+}
+
+/// Moves the scaled image of a placement that is being deleted to a tombstone,
+/// so that it can be reused if an identical placement is created soon. The
+/// oldest tombstone is evicted if there are no free slots.
+static void gr_bury_scaled_image(ImagePlacement *placement) {
+	// Scaled images of partially uploaded images are not worth keeping.
+	if (!placement->scaled_image || !graphics_tombstone_lifetime_ms ||
+	    placement->preview ||
+	    placement->image->status == STATUS_UPLOADING ||
+	    placement->image->frame_count > 1)
+		return;
+	Tombstone *ts = &tombstones[0];
+	for (int i = 0; i < MAX_TOMBSTONES && ts->image_id; ++i) {
+		if (!tombstones[i].image_id ||
+		    gr_cmp_timespec(&tombstones[i].deletion_time,
+				    &ts->deletion_time) < 0)
+			ts = &tombstones[i];
+	}
+	gr_free_tombstone(ts);
+
+	// Only the scaled image survives, drop the inverted copy and the atlas
+	// entry.
+	gr_drop_scaled_image_copies(placement);
+
+	ts->image_id = placement->image->image_id;
+	ts->src_pix_x = placement->src_pix_x;
+	ts->src_pix_y = placement->src_pix_y;
+	ts->src_pix_width = placement->src_pix_width;
+	ts->src_pix_height = placement->src_pix_height;
+	ts->rows = placement->rows;
+	ts->cols = placement->cols;
+	ts->scale_mode = placement->scale_mode;
+	ts->scaled_cw = placement->scaled_cw;
+	ts->scaled_ch = placement->scaled_ch;
+	ts->scaled_image = placement->scaled_image;
+	ts->scaled_opaque = placement->scaled_opaque;
+	ts->ram_size = gr_scaled_image_ram_size(placement);
+	clock_gettime(CLOCK_MONOTONIC, &ts->deletion_time);
+
+	// The ram is now accounted for in the tombstone.
+	placement->scaled_image = NULL;
+	placement->scaled_cw = placement->scaled_ch = 0;
+	GR_LOG("Buried the scaled image of placement %u/%u\n",
+	       placement->image->image_id, placement->placement_id);
+}
+
+/// Looks for a tombstone with a scaled image matching the placement (whose
+/// size must already be inferred) and the cell size. If found, the scaled image
+/// is removed from the tombstone and returned, otherwise returns NULL.
+static Imlib_Image gr_dig_up_scaled_image(ImagePlacement *placement, int cw,
+					  int ch) {
+	for (int i = 0; i < MAX_TOMBSTONES; ++i) {
+		Tombstone *ts = &tombstones[i];
+		if (ts->image_id != placement->image->image_id ||
+		    ts->src_pix_x != placement->src_pix_x ||
+		    ts->src_pix_y != placement->src_pix_y ||
+		    ts->src_pix_width != placement->src_pix_width ||
+		    ts->src_pix_height != placement->src_pix_height ||
+		    ts->rows != placement->rows || ts->cols != placement->cols ||
+		    ts->scale_mode != placement->scale_mode ||
+		    ts->scaled_cw != cw || ts->scaled_ch != ch)
+			continue;
+		Imlib_Image scaled_image = ts->scaled_image;
+		placement->scaled_opaque = ts->scaled_opaque;
+		images_ram_size -= ts->ram_size;
+		memset(ts, 0, sizeof(Tombstone));
+		GR_LOG("Reusing a buried scaled image for placement %u/%u\n",
+		       placement->image->image_id, placement->placement_id);
+		return scaled_image;
+	}
+	return NULL;
+}
+
+/// Delete the on-disk cache file corresponding to the image. The in-ram image
+/// object (if it exists) is not deleted, so the image may still be displayed
+/// with the same cell width/height values.
+static void gr_delete_imagefile(Image *img) {
+	// It may still be being loaded. Close the file in this case.
+	if (img->open_file) {
+		fclose(img->open_file);
+		img->open_file = NULL;
+	}
+
+	// Or it may still be compressed or accumulated in memory.
+	if (img->cache_deflate) {
+		deflateEnd(img->cache_deflate);
+		free(img->cache_deflate);
+		img->cache_deflate = NULL;
+	}
+	free(img->pending_data);
+	img->pending_data = NULL;
+	img->pending_capacity = 0;
+
+	if (img->disk_size == 0)
+		return;
+
+	if (img->segment) {
+		gr_release_packed_data(img);
+	} else {
+		char filename[MAX_FILENAME_SIZE];
+		gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
+		remove(filename);
+	}
+
+	images_disk_size -= img->disk_size;
+	img->disk_size = 0;
+
+	GR_LOG("After deleting image file %u disk: %ld KiB\n", img->image_id,
+	       images_disk_size / 1024);
+}
+
+/// Deletes the given placement: unloads, frees the object, but doesn't change
+/// the `placements` hash table.
+static void gr_delete_placement_keep_id(ImagePlacement *placement) {
+	if (!placement)
+		return;
+	GR_LOG("Deleting placement %u/%u\n", placement->image->image_id,
+	       placement->placement_id);
+	gr_cancel_scaling(placement);
+	gr_bury_scaled_image(placement);
+	gr_unload_placement(placement);
+	free(placement->underlays);
+	free(placement);
+	total_placement_count--;
+}
+
+/// Deletes all placements of `img`.
+static void gr_delete_all_placements(Image *img) {
+	ImagePlacement *placement = NULL;
+	kh_foreach_value(img->placements, placement, {
+		gr_delete_placement_keep_id(placement);
+	});
+	kh_clear(id2placement, img->placements);
+}
+
+/// Deletes the given image: unloads, deletes the file, frees the Image object,
+/// but doesn't change the `images` hash table.
+static void gr_delete_image_keep_id(Image *img) {
+	if (!img)
+		return;
+	GR_LOG("Deleting image %u\n", img->image_id);
+	gr_cancel_decoding(img);
+	gr_unload_image(img);
+	gr_delete_imagefile(img);
+	gr_delete_all_placements(img);
+	gr_free_tombstones_of_image(img->image_id);
+	gr_free_frames(img);
+	kh_destroy(id2placement, img->placements);
+	free(img);
+}
+
+/// Deletes the given image: unloads, deletes the file, frees the Image object,
+/// and also removes it from `images`.
+static void gr_delete_image(Image *img) {
+	if (!img)
+		return;
+	uint32_t id = img->image_id;
+	gr_delete_image_keep_id(img);
+	khiter_t k = kh_get(id2image, images, id);
+	kh_del(id2image, images, k);
+}
+
+/// Deletes the given placement: unloads, frees the object, and also removes it
+/// from `placements`.
+static void gr_delete_placement(ImagePlacement *placement) {
+	if (!placement)
+		return;
+	uint32_t id = placement->placement_id;
+	Image *img = placement->image;
+	gr_delete_placement_keep_id(placement);
+	khiter_t k = kh_get(id2placement, img->placements, id);
+	kh_del(id2placement, img->placements, k);
+}
+
+/// Deletes all images and clears `images`.
+static void gr_delete_all_images() {
+	Image *img = NULL;
+	kh_foreach_value(images, img, {
+		gr_delete_image_keep_id(img);
+	});
+	kh_clear(id2image, images);
+}
+
+/// A helper to compare timespecs.
+int gr_cmp_timespec(const struct timespec *t1, const struct timespec *t2) {
+	if (t1->tv_sec < t2->tv_sec)
+		return -1;
+	if (t1->tv_sec > t2->tv_sec)
+		return 1;
+	if (t1->tv_nsec < t2->tv_nsec)
+		return -1;
+	if (t1->tv_nsec > t2->tv_nsec)
+		return 1;
+	return 0;
+}
+
+/// A helper to compare images by atime for qsort.
+static int gr_cmp_images_by_atime(const void *a, const void *b) {
+	Image *img_a = *(Image *const *)a;
+	Image *img_b = *(Image *const *)b;
+	return gr_cmp_timespec(&img_a->atime, &img_b->atime);
+}
+
+/// A helper to compare placements by atime for qsort.
+static int gr_cmp_placements_by_atime(const void *a, const void *b) {
+	ImagePlacement *p_a = *(ImagePlacement **)a;
+	ImagePlacement *p_b = *(ImagePlacement **)b;
+	return gr_cmp_timespec(&p_a->atime, &p_b->atime);
+}
+
+/// Returns an array of pointers to all images sorted by atime. The size of the
+/// array is `kh_size(images)`. Returns NULL if there are no images.
+static Image **gr_get_images_sorted_by_atime() {
+	if (kh_size(images) == 0)
+		return NULL;
+	Image **images_sorted = malloc(sizeof(Image *) * kh_size(images));
+	Image *img = NULL;
+	int i = 0;
+	kh_foreach_value(images, img, {
+		images_sorted[i] = img;
+		i++;
+	});
+	qsort(images_sorted, kh_size(images), sizeof(Image *),
+	      gr_cmp_images_by_atime);
+	return images_sorted;
+}
+
+/// Returns an array of pointers to all placements sorted by atime. The size of
+/// the array is `total_placement_count`. Returns NULL if there are no
+/// placements. The array must be freed with `free()` by the caller.
+static ImagePlacement **gr_get_placements_sorted_by_atime() {
+	if (total_placement_count == 0)
+		return NULL;
+	ImagePlacement **placements_sorted =
+		malloc(sizeof(ImagePlacement *) * total_placement_count);
+	Image *img = NULL;
+	ImagePlacement *placement = NULL;
+	int i = 0;
+	kh_foreach_value(images, img, {
+		kh_foreach_value(img->placements, placement, {
+			if (i < total_placement_count)
+				placements_sorted[i] = placement;
+			i++;
+		});
+	});
+	if (i != total_placement_count) {
+		// This should never happen, but if it does, report an error,
+		// set the correct count, and redo the sorting.
+		fprintf(stderr,
+			"error: total_placement_count (%d) is wrong, the "
+			"correct value is %d\n",
+			total_placement_count, i);
+		free(placements_sorted);
+		total_placement_count = i;
+		return gr_get_placements_sorted_by_atime();
+	}
+	qsort(placements_sorted, total_placement_count,
+	      sizeof(ImagePlacement *), gr_cmp_placements_by_atime);
+	return placements_sorted;
+}
+
+/// Returns the limit adjusted by the excess tolerance ratio.
+static inline unsigned apply_tolerance(unsigned limit) {
+	return limit + (unsigned)(limit * graphics_excess_tolerance_ratio);
+}
+
+/// Checks RAM and disk cache limits and deletes/unloads some images.
+static void gr_check_limits() {
+	Image **images_sorted = NULL;
+	ImagePlacement **placements_sorted = NULL;
+	int images_begin = 0;
+	int placements_begin = 0;
+	// First reduce the number of images if there are too many.
+	if (kh_size(images) > apply_tolerance(graphics_max_total_placements)) {
+		GR_LOG("Too many images: %d\n", kh_size(images));
+		images_sorted = gr_get_images_sorted_by_atime();
+		int to_delete = kh_size(images) -
+				graphics_max_total_placements;
+		for (int i = 0; i < to_delete; i++) {
+			gr_delete_image(images_sorted[images_begin]);
+			images_begin++;
+		}
+	}
+	// Then reduce the number of placements if there are too many.
+	if (total_placement_count >
+	    apply_tolerance(graphics_max_total_placements)) {
+		GR_LOG("Too many placements: %d\n", total_placement_count);
+		placements_sorted = gr_get_placements_sorted_by_atime();
+		int to_delete = total_placement_count -
+				graphics_max_total_placements;
+		for (int i = 0; i < to_delete; i++) {
+			if (placements_sorted[placements_begin]->protected)
+				break;
+			gr_delete_placement(placements_sorted[placements_begin]);
+			placements_begin++;
+		}
+	}
+	// Then reclaim the space of deleted images in the packed disk cache,
+	// even if there is not much of it when the cache is too big.
+	gr_compact_cache(images_disk_size + cache_dead_size >
+			 apply_tolerance(graphics_total_file_cache_size));
+	// Then reduce the size of the image file cache.
+	if (images_disk_size >
+	    apply_tolerance(graphics_total_file_cache_size)) {
+		GR_LOG("Too big disk cache: %ld KiB\n",
+		       images_disk_size / 1024);
+		if (!images_sorted)
+			images_sorted = gr_get_images_sorted_by_atime();
+		int i = 0;
+		int total_images = kh_size(images);
+		while (images_disk_size > graphics_total_file_cache_size &&
+		       i < total_images) {
+			gr_delete_imagefile(images_sorted[images_begin + i]);
+			i++;
+		}
+	}
+	// Then drop scaled images of deleted placements.
+	if (images_ram_size > apply_tolerance(graphics_max_total_ram_size))
+		gr_free_tombstones_of_image(0);
+	// Then unload images from RAM.
+	if (images_ram_size > apply_tolerance(graphics_max_total_ram_size)) {
+		GR_LOG("Too much ram: %ld KiB\n", images_ram_size / 1024);
+		if (!images_sorted)
+			images_sorted = gr_get_images_sorted_by_atime();
+		int i = 0;
+		unsigned total_images = kh_size(images);
+		while (images_ram_size > graphics_max_total_ram_size &&
+		       i < total_images) {
+			gr_unload_image(images_sorted[images_begin + i]);
+			i++;
+		}
+	}
+	// Then unload placements from RAM.
+	if (images_ram_size > apply_tolerance(graphics_max_total_ram_size)) {
+		GR_LOG("Still too much ram: %ld KiB\n", images_ram_size / 1024);
+		if (!placements_sorted)
+			placements_sorted = gr_get_placements_sorted_by_atime();
+		int i = 0;
+		while (images_ram_size > graphics_max_total_ram_size &&
+		       i < total_placement_count) {
+			if (!placements_sorted[placements_begin + i]->protected)
+				gr_unload_placement(
+					placements_sorted[placements_begin +
+							  i]);
+			i++;
+		}
+	}
+	if (images_sorted || placements_sorted) {
+		GR_LOG("After cleaning:  ram: %ld KiB  disk: %ld KiB  "
+		       "img count: %d  placement count: %d\n",
+		       images_ram_size / 1024, images_disk_size / 1024,
+		       kh_size(images), total_placement_count);
+	}
+	free(images_sorted);
+	free(placements_sorted);
+}
+
+/// Unloads all images by user request.
+void gr_unload_images_to_reduce_ram() {
+	Image *img = NULL;
+	ImagePlacement *placement = NULL;
+	kh_foreach_value(images, img, {
+		kh_foreach_value(img->placements, placement, {
+			if (placement->protected)
+				continue;
+			gr_unload_placement(placement);
+		});
+		gr_unload_image(img);
+	});
+	gr_free_tombstones_of_image(0);
+}
+
+/// Update the atime of the image.
+static void gr_touch_image(Image *img) {
+	clock_gettime(CLOCK_MONOTONIC, &img->atime);
+}
+
+/// Update the atime of the placement. Touches the images too.
+static void gr_touch_placement(ImagePlacement *placement) {
+	clock_gettime(CLOCK_MONOTONIC, &placement->atime);
+	placement->image->atime = placement->atime;
+}
+
+/// Creates a new image with the given id. If an image with that id already
+/// exists, it is deleted first. If the provided id is 0, generates a
+/// random id.
+static Image *gr_new_image(uint32_t id) {
+	if (id == 0) {
+		do {
+			id = rand();
+			// Avoid IDs that don't need full 32 bits.
+		} while ((id & 0xFF000000) == 0 || (id & 0x00FFFF00) == 0 ||
+			 gr_find_image(id));
+		GR_LOG("Generated random image id %u\n", id);
+	}
+	Image *img = gr_find_image(id);
+	gr_delete_image_keep_id(img);
+	GR_LOG("Creating image %u\n", id);
+	img = malloc(sizeof(Image));
+	memset(img, 0, sizeof(Image));
+	img->placements = kh_init(id2placement);
+	int ret;
+	khiter_t k = kh_put(id2image, images, id, &ret);
+	kh_value(images, k) = img;
+	img->image_id = id;
+	gr_touch_image(img);
+	img->global_command_index = global_command_counter;
+	return img;
+}
+
+/// Creates a new placement with the given id. If a placement with that id
+/// already exists, it is deleted first. If the provided id is 0, generates a
+/// random id.
+static ImagePlacement *gr_new_placement(Image *img, uint32_t id) {
+	if (id == 0) {
+		do {
+			// Currently we support only 24-bit IDs.
+			id = rand() & 0xFFFFFF;
+			// Avoid IDs that need only one byte.
+		} while ((id & 0x00FFFF00) == 0 || gr_find_placement(img, id));
+	}
+	ImagePlacement *placement = gr_find_placement(img, id);
+	gr_delete_placement_keep_id(placement);
+	GR_LOG("Creating placement %u/%u\n", img->image_id, id);
+	placement = malloc(sizeof(ImagePlacement));
+	memset(placement, 0, sizeof(ImagePlacement));
+	total_placement_count++;
+	int ret;
+	khiter_t k = kh_put(id2placement, img->placements, id, &ret);
+	kh_value(img->placements, k) = placement;
+	placement->image = img;
+	placement->placement_id = id;
+	placement->serial = next_placement_serial++;
+	gr_touch_placement(placement);
+	if (img->default_placement == 0)
+		img->default_placement = id;
+	// The animation of the image may have been waiting for a placement.
+	if (img->frame_count > 1)
+		animations_exist = 1;
+	return placement;
+}
+
+/// Returns whether the scaled image of the placement covers all of its cells
+/// with opaque pixels, so that nothing under it needs to be drawn.
+static int gr_placement_is_opaque(ImagePlacement *placement) {
+	Image *img = placement->image;
+	if (!img->opaque || img->frame_count > 1)
+		return 0;
+	if (placement->scale_mode == SCALE_MODE_FILL)
+		return 1;
+	return placement->scale_mode == SCALE_MODE_NONE &&
+	       placement->src_pix_width ==
+		       placement->cols * placement->scaled_cw &&
+	       placement->src_pix_height ==
+		       placement->rows * placement->scaled_ch;
+}
+
+static int64_t ceil_div(int64_t a, int64_t b) {
+	return (a + b - 1) / b;
+}
+
+/// Computes the best number of rows and columns for a placement if it's not
+/// specified, and also adjusts the source rectangle size.
+static void gr_infer_placement_size_maybe(ImagePlacement *placement) {
+	// Negative values are not allowed. Quietly set them to 0.
+	if (placement->src_pix_x < 0)
+		placement->src_pix_x = 0;
+	if (placement->src_pix_y < 0)
+		placement->src_pix_y = 0;
+	if (placement->src_pix_width < 0)
+		placement->src_pix_width = 0;
+	if (placement->src_pix_height < 0)
+		placement->src_pix_height = 0;
+	// If the source rectangle is outside the image, truncate it.
+	if (placement->src_pix_x > placement->image->pix_width)
+		placement->src_pix_x = placement->image->pix_width;
+	if (placement->src_pix_y > placement->image->pix_height)
+		placement->src_pix_y = placement->image->pix_height;
+	// If the source rectangle is not specified, use the whole image. If
+	// it's partially outside the image, truncate it.
+	if (placement->src_pix_width == 0 ||
+	    placement->src_pix_x + placement->src_pix_width >
+		    placement->image->pix_width)
+		placement->src_pix_width =
+			placement->image->pix_width - placement->src_pix_x;
+	if (placement->src_pix_height == 0 ||
+	    placement->src_pix_y + placement->src_pix_height >
+		    placement->image->pix_height)
+		placement->src_pix_height =
+			placement->image->pix_height - placement->src_pix_y;
+
+	if (placement->cols != 0 && placement->rows != 0)
+		return;
+	if (placement->src_pix_width == 0 || placement->src_pix_height == 0)
+		return;
+	if (current_cw == 0 || current_ch == 0)
+		return;
+
+	// If no size is specified, use the image size.
+	if (placement->cols == 0 && placement->rows == 0) {
+		placement->cols =
+			ceil_div(placement->src_pix_width, current_cw);
+		placement->rows =
+			ceil_div(placement->src_pix_height, current_ch);
+		return;
+	}
+
+	// It doesn't seem to be documented anywhere, but some applications
+	// specify only one of the dimensions.
+	if (placement->scale_mode == SCALE_MODE_CONTAIN) {
+		// If we preserve aspect ratio and fit to width/height, the most
+		// logical thing is to find the minimum size of the
+		// non-specified dimension that allows the image to fit the
+		// specified dimension.
+		if (placement->cols == 0) {
+			placement->cols = ceil_div(
+				placement->src_pix_width * placement->rows *
+					current_ch,
+				placement->src_pix_height * current_cw);
+			return;
+		}
+		if (placement->rows == 0) {
+			placement->rows =
+				ceil_div(placement->src_pix_height *
+						 placement->cols * current_cw,
+					 placement->src_pix_width * current_ch);
+			return;
+		}
+	} else {
+		// Otherwise we stretch the image or preserve the original size.
+		// In both cases we compute the best number of columns from the
+		// pixel size and cell size to be compatible with kitty.
+		if (!placement->cols)
+			placement->cols =
+				ceil_div(placement->src_pix_width, current_cw);
+		if (!placement->rows)
+			placement->rows =
+				ceil_div(placement->src_pix_height, current_ch);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Image loading.
+////////////////////////////////////////////////////////////////////////////////
+
+/// Copies `num_pixels` pixels (not bytes!) from a buffer `from` to an imlib2
+/// image data `to`. The format may be 24 (RGBA) or 32 (RGB), and it's converted
+/// to imlib2's representation, which depends on the endianness, and on
+/// little-endian architectures the memory layout is actually BGRA.
+static inline void gr_copy_pixels(DATA32 *to, unsigned char *from, int format,
+				  size_t num_pixels) {
+	size_t pixel_size = format == 24 ? 3 : 4;
+	if (format == 32) {
+		for (unsigned i = 0; i < num_pixels; ++i) {
+			unsigned byte_i = i * pixel_size;
+			to[i] = ((DATA32)from[byte_i + 2]) |
+				((DATA32)from[byte_i + 1]) << 8 |
+				((DATA32)from[byte_i]) << 16 |
+				((DATA32)from[byte_i + 3]) << 24;
+		}
+	} else {
+		for (unsigned i = 0; i < num_pixels; ++i) {
+			unsigned byte_i = i * pixel_size;
+			to[i] = ((DATA32)from[byte_i + 2]) |
+				((DATA32)from[byte_i + 1]) << 8 |
+				((DATA32)from[byte_i]) << 16 | 0xFF000000;
+		}
+	}
+}
+
+/// Loads uncompressed RGB or RGBA image data from a file.
+static void gr_load_raw_pixel_data_uncompressed(DATA32 *data, FILE *file,
+						int format,
+						size_t total_pixels) {
+	unsigned char chunk[BUFSIZ];
+	size_t pixel_size = format == 24 ? 3 : 4;
+	size_t chunk_size_pix = BUFSIZ / 4;
+	size_t chunk_size_bytes = chunk_size_pix * pixel_size;
+	size_t bytes = total_pixels * pixel_size;
+	for (size_t chunk_start_pix = 0; chunk_start_pix < total_pixels;
+	     chunk_start_pix += chunk_size_pix) {
+		size_t read_size = fread(chunk, 1, chunk_size_bytes, file);
+		size_t read_pixels = read_size / pixel_size;
+		if (chunk_start_pix + read_pixels > total_pixels)
+			read_pixels = total_pixels - chunk_start_pix;
+		gr_copy_pixels(data + chunk_start_pix, chunk, format,
+			       read_pixels);
+	}
+}
+
+#define COMPRESSED_CHUNK_SIZE BUFSIZ
+#define DECOMPRESSED_CHUNK_SIZE (BUFSIZ * 4)
+
+/// A streaming decompressor for one of the supported compression methods
+/// (the value of the 'o=' key).
+typedef struct {
+	char method;
+	union {
+		z_stream zlib;
+#ifdef GRAPHICS_ZSTD
+		ZSTD_DStream *zstd;
+#endif
+#ifdef GRAPHICS_LZ4
+		LZ4F_dctx *lz4;
+#endif
+	};
+} Decompressor;
+
+/// Returns 1 if the compression method `method` (the value of 'o=') is
+/// supported by this build.
+static int gr_compression_supported(char method) {
+	switch (method) {
+	case 'z':
+		return 1;
+#ifdef GRAPHICS_ZSTD
+	case 's':
+		return 1;
+#endif
+#ifdef GRAPHICS_LZ4
+	case 'l':
+		return 1;
+#endif
+	}
+	return 0;
+}
+
+/// Initializes the decompressor for the given method. Returns 0 on success.
+static int gr_decompressor_init(Decompressor *dec, char method) {
+	memset(dec, 0, sizeof(*dec));
+	dec->method = method;
+	switch (method) {
+	case 'z':
+		dec->zlib.zalloc = Z_NULL;
+		dec->zlib.zfree = Z_NULL;
+		dec->zlib.opaque = Z_NULL;
+		dec->zlib.next_in = Z_NULL;
+		dec->zlib.avail_in = 0;
+		return inflateInit(&dec->zlib) == Z_OK ? 0 : 1;
+#ifdef GRAPHICS_ZSTD
+	case 's':
+		dec->zstd = ZSTD_createDStream();
+		return dec->zstd ? 0 : 1;
+#endif
+#ifdef GRAPHICS_LZ4
+	case 'l':
+		return LZ4F_isError(LZ4F_createDecompressionContext(
+			       &dec->lz4, LZ4F_VERSION))
+			       ? 1
+			       : 0;
+#endif
+	}
+	return 1;
+}
+
+/// Decompresses some data from `in` (of size `*in_size`) to `out` (of size
+/// `*out_size`). On return `*in_size` is set to the number of consumed bytes
+/// and `*out_size` to the number of produced bytes. Returns 0 on success and
+/// prints an error and returns 1 if the data is corrupted.
+static int gr_decompress(Decompressor *dec, const unsigned char *in,
+			 size_t *in_size, unsigned char *out, size_t *out_size) {
+	switch (dec->method) {
+	case 'z': {
+		z_stream *strm = &dec->zlib;
+		strm->next_in = (unsigned char *)in;
+		strm->avail_in = *in_size;
+		strm->next_out = out;
+		strm->avail_out = *out_size;
+		int ret = inflate(strm, Z_SYNC_FLUSH);
+		*in_size -= strm->avail_in;
+		*out_size -= strm->avail_out;
+		if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+			fprintf(stderr,
+				"error: could not decompress the image, error "
+				"%s\n",
+				ret == Z_MEM_ERROR ? "Z_MEM_ERROR"
+						   : "Z_DATA_ERROR");
+			return 1;
+		}
+		return 0;
+	}
+#ifdef GRAPHICS_ZSTD
+	case 's': {
+		ZSTD_inBuffer zin = {in, *in_size, 0};
+		ZSTD_outBuffer zout = {out, *out_size, 0};
+		size_t ret = ZSTD_decompressStream(dec->zstd, &zout, &zin);
+		*in_size = zin.pos;
+		*out_size = zout.pos;
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr,
+				"error: could not decompress the image: %s\n",
+				ZSTD_getErrorName(ret));
+			return 1;
+		}
+		return 0;
+	}
+#endif
+#ifdef GRAPHICS_LZ4
+	case 'l': {
+		size_t ret = LZ4F_decompress(dec->lz4, out, out_size, in,
+					     in_size, NULL);
+		if (LZ4F_isError(ret)) {
+			fprintf(stderr,
+				"error: could not decompress the image: %s\n",
+				LZ4F_getErrorName(ret));
+			return 1;
+		}
+		return 0;
+	}
+#endif
+	}
+	*in_size = *out_size = 0;
+	return 1;
+}
+
+/// Releases the resources of the decompressor.
+static void gr_decompressor_end(Decompressor *dec) {
+	switch (dec->method) {
+	case 'z':
+		inflateEnd(&dec->zlib);
+		break;
+#ifdef GRAPHICS_ZSTD
+	case 's':
+		ZSTD_freeDStream(dec->zstd);
+		break;
+#endif
+#ifdef GRAPHICS_LZ4
+	case 'l':
+		LZ4F_freeDecompressionContext(dec->lz4);
+		break;
+#endif
+	}
+}
+
+/// Loads compressed RGB or RGBA image data from a file. `compression` is the
+/// compression method (the value of 'o=').
+static int gr_load_raw_pixel_data_compressed(DATA32 *data, FILE *file,
+					     int format, char compression,
+					     size_t total_pixels) {
+	size_t pixel_size = format == 24 ? 3 : 4;
+	unsigned char compressed_chunk[COMPRESSED_CHUNK_SIZE];
+	unsigned char decompressed_chunk[DECOMPRESSED_CHUNK_SIZE];
+	// The number of pending bytes in each of the buffers. The pending
+	// compressed data always starts at the beginning of the buffer.
+	size_t compressed_len = 0;
+	size_t decompressed_len = 0;
+
+	Decompressor dec;
+	if (gr_decompressor_init(&dec, compression) != 0)
+		return 1;
+
+	int error = 0;
+	int progress = 0;
+	size_t total_copied_pixels = 0;
+	while (1) {
+		// If we don't have enough data in the input buffer, try to read
+		// from the file.
+		if (compressed_len <= COMPRESSED_CHUNK_SIZE / 4) {
+			size_t bytes_read = fread(
+				compressed_chunk + compressed_len, 1,
+				COMPRESSED_CHUNK_SIZE - compressed_len, file);
+			compressed_len += bytes_read;
+			if (bytes_read != 0)
+				progress = 1;
+		}
+
+		// Try to decompress the data.
+		size_t consumed = compressed_len;
+		size_t produced = DECOMPRESSED_CHUNK_SIZE - decompressed_len;
+		if (gr_decompress(&dec, compressed_chunk, &consumed,
+				  decompressed_chunk + decompressed_len,
+				  &produced) != 0) {
+			error = 1;
+			break;
+		}
+		if (consumed != 0 || produced != 0)
+			progress = 1;
+		// Move the remaining input data to the beginning.
+		compressed_len -= consumed;
+		memmove(compressed_chunk, compressed_chunk + consumed,
+			compressed_len);
+		decompressed_len += produced;
+
+		// Copy the data from the output buffer to the image.
+		size_t full_pixels = decompressed_len / pixel_size;
+		// Make sure we don't overflow the image.
+		if (full_pixels > total_pixels - total_copied_pixels)
+			full_pixels = total_pixels - total_copied_pixels;
+		if (full_pixels > 0) {
+			// Copy pixels.
+			gr_copy_pixels(data, decompressed_chunk, format,
+				       full_pixels);
+			data += full_pixels;
+			total_copied_pixels += full_pixels;
+			if (total_copied_pixels >= total_pixels) {
+				// We filled the whole image, there may be some
+				// data left, but we just truncate it.
+				break;
+			}
+			// Move the remaining data to the beginning.
+			size_t copied_bytes = full_pixels * pixel_size;
+			decompressed_len -= copied_bytes;
+			memmove(decompressed_chunk,
+				decompressed_chunk + copied_bytes,
+				decompressed_len);
+		}
+
+		// If we haven't made any progress, then we have reached the end
+		// of both the file and the decompressed data.
+		if (!progress)
+			break;
+		progress = 0;
+	}
+
+	gr_decompressor_end(&dec);
+	return error;
+}
+
+#undef COMPRESSED_CHUNK_SIZE
+#undef DECOMPRESSED_CHUNK_SIZE
+
+/// Load the image from a file containing raw pixel data (RGB or RGBA), the data
+/// may be compressed.
+static PixelBuffer *gr_load_raw_pixel_data(Image *img,
+					   const char *filename) {
+	size_t total_pixels = img->pix_width * img->pix_height;
+	if (total_pixels * 4 > graphics_max_single_image_ram_size) {
+		fprintf(stderr,
+			"error: image %u is too big too load: %zu > %u\n",
+			img->image_id, total_pixels * 4,
+			graphics_max_single_image_ram_size);
+		return NULL;
+	}
+
+	FILE* file = gr_open_image_data(img);
+	if (!file) {
+		fprintf(stderr,
+			"error: could not open image file: %s\n",
+			sanitized_filename(filename));
+		return NULL;
+	}
+
+	DATA32 *data = calloc(total_pixels, sizeof(DATA32));
+	if (!data) {
+		fprintf(stderr,
+			"error: could not allocate an image of size %d x %d\n",
+			img->pix_width, img->pix_height);
+		fclose(file);
+		return NULL;
+	}
+
+	char compression = img->cache_compressed ? 'z' : img->compression;
+	if (compression == 0) {
+		gr_load_raw_pixel_data_uncompressed(data, file, img->format,
+						    total_pixels);
+	} else {
+		int ret = gr_load_raw_pixel_data_compressed(
+			data, file, img->format, compression, total_pixels);
+		if (ret != 0) {
+			free(data);
+			fclose(file);
+			return NULL;
+		}
+	}
+
+	fclose(file);
+	return gr_pixbuf_compact(gr_pixbuf_wrap(
+		data, img->pix_width, img->pix_height,
+		img->pix_width * sizeof(DATA32)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reduced-resolution decoding.
+////////////////////////////////////////////////////////////////////////////////
+
+/// Box-filters rows of RGB or RGBA pixels into an image whose sides are
+/// `factor` times smaller.
+typedef struct {
+	int factor;
+	int in_width, out_width, out_height;
+	/// The number of input rows accumulated for the current output row.
+	int rows;
+	/// The index of the current output row.
+	int out_row;
+	/// Sums of alpha and of alpha-weighted color components for each
+	/// pixel of the current output row.
+	uint32_t *acc;
+	DATA32 *out;
+} Downsampler;
+
+/// Initializes the downsampler writing to `out`. `acc` must be a zeroed buffer
+/// of 4 numbers per output pixel of a row.
+static void gr_downsampler_init(Downsampler *ds, int factor, int in_width,
+				int in_height, DATA32 *out, uint32_t *acc) {
+	ds->factor = factor;
+	ds->in_width = in_width;
+	ds->out_width = gr_reduced_size(in_width, factor);
+	ds->out_height = gr_reduced_size(in_height, factor);
+	ds->rows = 0;
+	ds->out_row = 0;
+	ds->out = out;
+	ds->acc = acc;
+}
+
+/// Writes the current output row if any input rows were accumulated for it.
+static void gr_downsampler_flush(Downsampler *ds) {
+	if (ds->rows == 0 || ds->out_row >= ds->out_height)
+		return;
+	DATA32 *out = ds->out + (size_t)ds->out_row * ds->out_width;
+	for (int x = 0; x < ds->out_width; ++x) {
+		uint32_t *acc = ds->acc + x * 4;
+		int box_w = MIN(ds->factor, ds->in_width - x * ds->factor);
+		uint32_t count = (uint32_t)box_w * ds->rows;
+		DATA32 pixel = (acc[0] / count) << 24;
+		if (acc[0])
+			pixel |= (acc[1] / acc[0]) << 16 |
+				 (acc[2] / acc[0]) << 8 | acc[3] / acc[0];
+		out[x] = pixel;
+	}
+	memset(ds->acc, 0, (size_t)ds->out_width * 4 * sizeof(uint32_t));
+	ds->rows = 0;
+	ds->out_row++;
+}
+
+/// Adds a row of RGB (`channels` is 3) or RGBA pixels.
+static void gr_downsampler_add_row(Downsampler *ds, const unsigned char *row,
+				   int channels) {
+	for (int x = 0; x < ds->in_width; ++x, row += channels) {
+		uint32_t *acc = ds->acc + (x / ds->factor) * 4;
+		uint32_t a = channels == 4 ? row[3] : 255;
+		acc[0] += a;
+		acc[1] += row[0] * a;
+		acc[2] += row[1] * a;
+		acc[3] += row[2] * a;
+	}
+	if (++ds->rows == ds->factor)
+		gr_downsampler_flush(ds);
+}
+
+typedef struct {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+} JpegErrorHandler;
+
+static void gr_jpeg_error_exit(j_common_ptr cinfo) {
+	JpegErrorHandler *handler = (JpegErrorHandler *)cinfo->err;
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(handler->jmp, 1);
+}
+
+/// Decodes a JPEG file at 1/`reduction` of its resolution using the scaled
+/// IDCT of libjpeg (which can reduce up to 8 times), and box-filters the rest.
+/// Returns ARGB pixels allocated with malloc, or NULL if the file is not a JPEG
+/// or can't be decoded. Doesn't use imlib, so it's safe to call from worker
+/// threads.
+static DATA32 *gr_decode_jpeg_reduced(FILE *file, int reduction, int *width,
+				      int *height) {
+	struct jpeg_decompress_struct cinfo;
+	JpegErrorHandler handler;
+	DATA32 *volatile data = NULL;
+	unsigned char *volatile row = NULL;
+	uint32_t *volatile acc = NULL;
+	Downsampler ds;
+
+	cinfo.err = jpeg_std_error(&handler.mgr);
+	handler.mgr.error_exit = gr_jpeg_error_exit;
+	if (setjmp(handler.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(data);
+		free(row);
+		free(acc);
+		return NULL;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, file);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = MIN(reduction, 8);
+	jpeg_start_decompress(&cinfo);
+
+	int factor = reduction / cinfo.scale_denom;
+	*width = gr_reduced_size(cinfo.output_width, factor);
+	*height = gr_reduced_size(cinfo.output_height, factor);
+	data = malloc((size_t)*width * *height * sizeof(DATA32));
+	row = malloc((size_t)cinfo.output_width * 3);
+	acc = calloc((size_t)*width * 4, sizeof(uint32_t));
+	if (!data || !row || !acc)
+		longjmp(handler.jmp, 1);
+	gr_downsampler_init(&ds, factor, cinfo.output_width,
+			    cinfo.output_height, data, acc);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW rows[1] = {row};
+		jpeg_read_scanlines(&cinfo, rows, 1);
+		gr_downsampler_add_row(&ds, row, 3);
+	}
+	gr_downsampler_flush(&ds);
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(row);
+	free(acc);
+	return data;
+}
+
+/// Decodes a non-interlaced PNG file row by row, box-filtering it to
+/// 1/`reduction` of its resolution. Returns ARGB pixels allocated with malloc,
+/// or NULL if the file is not a suitable PNG or can't be decoded. Safe to call
+/// from worker threads.
+static DATA32 *gr_decode_png_reduced(FILE *file, int reduction, int *width,
+				     int *height) {
+	png_structp png =
+		png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png)
+		return NULL;
+	png_infop info = png_create_info_struct(png);
+	DATA32 *volatile data = NULL;
+	unsigned char *volatile row = NULL;
+	uint32_t *volatile acc = NULL;
+	Downsampler ds;
+	if (!info || setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, info ? &info : NULL, NULL);
+		free(data);
+		free(row);
+		free(acc);
+		return NULL;
+	}
+	png_init_io(png, file);
+	png_read_info(png, info);
+	png_uint_32 in_width = png_get_image_width(png, info);
+	png_uint_32 in_height = png_get_image_height(png, info);
+	// Interlaced images can't be decoded row by row.
+	if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+		png_longjmp(png, 1);
+	// Convert everything to 8-bit RGBA.
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_gray_to_rgb(png);
+	png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+	png_read_update_info(png, info);
+	if (png_get_rowbytes(png, info) != (size_t)in_width * 4)
+		png_longjmp(png, 1);
+
+	*width = gr_reduced_size(in_width, reduction);
+	*height = gr_reduced_size(in_height, reduction);
+	data = malloc((size_t)*width * *height * sizeof(DATA32));
+	row = malloc((size_t)in_width * 4);
+	acc = calloc((size_t)*width * 4, sizeof(uint32_t));
+	if (!data || !row || !acc)
+		png_longjmp(png, 1);
+	gr_downsampler_init(&ds, reduction, in_width, in_height, data, acc);
+	for (png_uint_32 y = 0; y < in_height; ++y) {
+		png_read_row(png, row, NULL);
+		gr_downsampler_add_row(&ds, row, 4);
+	}
+	gr_downsampler_flush(&ds);
+	png_destroy_read_struct(&png, &info, NULL);
+	free(row);
+	free(acc);
+	return data;
+}
+
+/// Decodes a PNG or JPEG file at 1/`reduction` of its resolution. Returns ARGB
+/// pixels allocated with malloc, or NULL if it's not possible. Safe to call
+/// from worker threads.
+static DATA32 *gr_decode_image_file(FILE *file, int reduction, int *width,
+				    int *height) {
+	unsigned char magic[2] = {0};
+	size_t len = fread(magic, 1, sizeof(magic), file);
+	rewind(file);
+	if (len == 2 && magic[0] == 0x89 && magic[1] == 'P')
+		return gr_decode_png_reduced(file, reduction, width, height);
+	if (len == 2 && magic[0] == 0xFF && magic[1] == 0xD8)
+		return gr_decode_jpeg_reduced(file, reduction, width, height);
+	return NULL;
+}
+
+/// Checks that the size of the pixels decoded at 1/`reduction` of the
+/// resolution of `img` agrees with the header we have probed. Returns 0 if it
+/// doesn't.
+static int gr_check_decoded_size(Image *img, int reduction, int width,
+				 int height) {
+	if (reduction == 1) {
+		img->pix_width = width;
+		img->pix_height = height;
+	}
+	if (width != gr_reduced_size(img->pix_width, reduction) ||
+	    height != gr_reduced_size(img->pix_height, reduction)) {
+		fprintf(stderr,
+			"error: unexpected size of the reduced image %u: %dx%d\n",
+			img->image_id, width, height);
+		return 0;
+	}
+	return 1;
+}
+
+/// Decodes a PNG or JPEG image at 1/`reduction` of its resolution, which
+/// must be a power of two. Returns NULL if it's not possible.
+static PixelBuffer *gr_load_image_file_reduced(Image *img, int reduction) {
+	FILE *file = gr_open_image_data(img);
+	if (!file)
+		return NULL;
+	int width = 0, height = 0;
+	DATA32 *pixels = gr_decode_image_file(file, reduction, &width, &height);
+	fclose(file);
+	if (!pixels)
+		return NULL;
+	if (!gr_check_decoded_size(img, reduction, width, height)) {
+		free(pixels);
+		return NULL;
+	}
+	return gr_pixbuf_compact(gr_pixbuf_wrap(pixels, width, height,
+						width * sizeof(DATA32)));
+}
+
+/// Returns the smallest reduction (a power of two) at which the original image
+/// fits into `graphics_max_single_image_ram_size`, or 1 if the image can't be
+/// decoded at a reduced resolution.
+static int gr_min_decode_reduction(Image *img) {
+	if ((img->format != 100 && img->format != 0) || img->frame_count > 1 ||
+	    img->pix_width <= 0 || img->pix_height <= 0)
+		return 1;
+	int reduction = 1;
+	while (reduction < MAX_DECODE_REDUCTION &&
+	       (uint64_t)gr_reduced_size(img->pix_width, reduction) *
+			       gr_reduced_size(img->pix_height, reduction) * 4 >
+		       graphics_max_single_image_ram_size)
+		reduction *= 2;
+	return reduction;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Background decoding.
+////////////////////////////////////////////////////////////////////////////////
+
+// PNG and JPEG images are decoded by worker threads as soon as they are
+// uploaded, so that the first frame showing them doesn't have to. The same
+// threads scale placements of loaded images when they are put. The main
+// thread posts jobs and picks up the results, the workers don't touch any
+// state other than the jobs, and don't use imlib, which is not thread safe.
+
+/// The maximum number of decoding threads.
+#define MAX_DECODING_THREADS 8
+
+typedef enum {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+} DecodingJobState;
+
+typedef struct DecodingJob {
+	/// The image being decoded, NULL if the image was deleted while the
+	/// job was running. For scaling jobs, the image whose original is
+	/// scaled, it's not unloaded until the job is freed. Used only by the
+	/// main thread.
+	Image *img;
+	/// The job parameters: the reduction, and the cached file, or a copy of
+	/// the packed data if `data` is not NULL.
+	int reduction;
+	char filename[MAX_FILENAME_SIZE];
+	unsigned char *data;
+	size_t data_size;
+	/// The results: the compacted pixels (NULL on failure), and whether
+	/// they are all opaque.
+	PixelBuffer *pixels;
+	char opaque;
+	/// For scaling jobs: the placement (NULL if it was deleted), used only
+	/// by the main thread, the original image, how to scale it and the
+	/// cell size.
+	ImagePlacement *placement;
+	PixelBuffer *source;
+	ScalingParams params;
+	int filter, cw, ch;
+	/// For frames other than the first one: a copy of the composited frame
+	/// owned by the job, which is the source, and the serial of the frame.
+	PixelBuffer *frame;
+	uint32_t frame_serial;
+	/// The scaled image created by the main thread, and its pixels filled
+	/// by the job. `scaled` is NULL for decoding jobs.
+	Imlib_Image scaled_image;
+	DATA32 *scaled;
+	/// The result of a scaling job: the method used or NULL on failure.
+	const char *method;
+	/// See `DecodingJobState`.
+	char state;
+	struct DecodingJob *next;
+} DecodingJob;
+
+/// All jobs in the order of posting, protected by `decoding_mutex`.
+static DecodingJob *decoding_jobs = NULL;
+static pthread_mutex_t decoding_mutex = PTHREAD_MUTEX_INITIALIZER;
+/// Signalled when a job is posted or the workers must stop.
+static pthread_cond_t decoding_posted = PTHREAD_COND_INITIALIZER;
+/// Signalled when a job is done.
+static pthread_cond_t decoding_done = PTHREAD_COND_INITIALIZER;
+static char decoding_stop = 0;
+static pthread_t decoding_threads[MAX_DECODING_THREADS];
+static int decoding_thread_count = 0;
+/// The pipe the workers write a byte to when a job is done, so that the main
+/// loop wakes up and picks up the result (see `gr_decoding_wakeup_fd`).
+static int decoding_wakeup_pipe[2] = {-1, -1};
+/// Whether some placements have `picked_up` set.
+static char picked_up_exist = 0;
+
+/// Decodes the data of the job or scales the image. Runs without holding the
+/// lock.
+static void gr_run_decoding_job(DecodingJob *job) {
+	if (job->scaled) {
+		job->method = gr_scale_pixels(job->source, &job->params,
+					      job->filter, job->scaled);
+		return;
+	}
+	FILE *file = job->data ? fmemopen(job->data, job->data_size, "rb")
+			       : fopen(job->filename, "rb");
+	if (!file)
+		return;
+	int width = 0, height = 0;
+	DATA32 *pixels =
+		gr_decode_image_file(file, job->reduction, &width, &height);
+	fclose(file);
+	if (!pixels)
+		return;
+	job->pixels = gr_pixbuf_compact(
+		gr_pixbuf_wrap(pixels, width, height, width * sizeof(DATA32)));
+	if (job->pixels)
+		job->opaque = gr_pixbuf_is_opaque(job->pixels);
+}
+
+/// The main function of decoding threads.
+static void *gr_decoding_worker(void *arg) {
+	pthread_mutex_lock(&decoding_mutex);
+	while (!decoding_stop) {
+		DecodingJob *job = decoding_jobs;
+		while (job && job->state != JOB_QUEUED)
+			job = job->next;
+		if (!job) {
+			pthread_cond_wait(&decoding_posted, &decoding_mutex);
+			continue;
+		}
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&decoding_mutex);
+		gr_run_decoding_job(job);
+		pthread_mutex_lock(&decoding_mutex);
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&decoding_done);
+		// The pipe is non-blocking. If it's full, the main loop will
+		// be woken up anyway.
+		ssize_t written = write(decoding_wakeup_pipe[1], "", 1);
+		(void)written;
+	}
+	pthread_mutex_unlock(&decoding_mutex);
+	return NULL;
+}
+
+/// Starts the decoding threads (see `graphics_decoding_threads`).
+static void gr_start_decoding_threads() {
+	decoding_stop = 0;
+	int count = MIN(graphics_decoding_threads, MAX_DECODING_THREADS);
+	if (!count)
+		return;
+	// Without the pipe everything is done on the main thread.
+	if (pipe(decoding_wakeup_pipe) != 0) {
+		fprintf(stderr, "error: could not create the decoding pipe\n");
+		decoding_wakeup_pipe[0] = decoding_wakeup_pipe[1] = -1;
+		return;
+	}
+	for (int i = 0; i < 2; ++i) {
+		fcntl(decoding_wakeup_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(decoding_wakeup_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	for (int i = 0; i < count; ++i) {
+		if (pthread_create(&decoding_threads[decoding_thread_count],
+				   NULL, gr_decoding_worker, NULL) != 0) {
+			fprintf(stderr,
+				"error: could not start a decoding thread\n");
+			break;
+		}
+		decoding_thread_count++;
+	}
+}
+
+/// Returns the size of the scaled image of a scaling job, which is counted in
+/// `images_ram_size` while the job owns it.
+static unsigned gr_scaling_job_ram_size(DecodingJob *job) {
+	return (unsigned)job->params.scaled_w * job->params.scaled_h * 4;
+}
+
+/// Removes the job from the list and frees it. Must be called with the lock.
+static void gr_free_decoding_job(DecodingJob *job) {
+	DecodingJob **link = &decoding_jobs;
+	while (*link && *link != job)
+		link = &(*link)->next;
+	if (*link)
+		*link = job->next;
+	if (job->img && job->img->decoding_job == job)
+		job->img->decoding_job = NULL;
+	if (job->scaled) {
+		if (job->img)
+			job->img->scaling_jobs--;
+		if (job->placement)
+			job->placement->scaling_job = NULL;
+		if (job->scaled_image) {
+			imlib_context_set_image(job->scaled_image);
+			imlib_image_put_back_data(job->scaled);
+			imlib_free_image();
+			images_ram_size -= gr_scaling_job_ram_size(job);
+		}
+		if (job->frame) {
+			images_ram_size -= job->frame->stride * job->frame->height;
+			gr_pixbuf_free(job->frame);
+		}
+	}
+	free(job->data);
+	gr_pixbuf_free(job->pixels);
+	free(job);
+}
+
+/// Stops the decoding threads and frees all jobs.
+static void gr_stop_decoding_threads() {
+	pthread_mutex_lock(&decoding_mutex);
+	decoding_stop = 1;
+	pthread_cond_broadcast(&decoding_posted);
+	pthread_mutex_unlock(&decoding_mutex);
+	for (int i = 0; i < decoding_thread_count; ++i)
+		pthread_join(decoding_threads[i], NULL);
+	decoding_thread_count = 0;
+	while (decoding_jobs)
+		gr_free_decoding_job(decoding_jobs);
+	for (int i = 0; i < 2; ++i) {
+		if (decoding_wakeup_pipe[i] >= 0)
+			close(decoding_wakeup_pipe[i]);
+		decoding_wakeup_pipe[i] = -1;
+	}
+}
+
+/// Appends the job to the list and wakes up a worker.
+static void gr_post_decoding_job(DecodingJob *job) {
+	pthread_mutex_lock(&decoding_mutex);
+	DecodingJob **link = &decoding_jobs;
+	while (*link)
+		link = &(*link)->next;
+	*link = job;
+	pthread_cond_signal(&decoding_posted);
+	pthread_mutex_unlock(&decoding_mutex);
+}
+
+/// Posts a job decoding the original image at 1/`reduction` of its resolution.
+/// Does nothing if there are no decoding threads, the image is not a PNG or
+/// JPEG file, or it hasn't been uploaded successfully.
+static void gr_queue_decoding(Image *img, int reduction) {
+	if (!decoding_thread_count || img->decoding_job ||
+	    img->original_image || img->frame_count > 1 ||
+	    img->status < STATUS_UPLOADING_SUCCESS ||
+	    img->status == STATUS_RAM_LOADING_ERROR || !img->disk_size ||
+	    (img->format != 100 && img->format != 0))
+		return;
+	DecodingJob *job = calloc(1, sizeof(DecodingJob));
+	if (!job)
+		return;
+	job->img = img;
+	job->reduction = reduction;
+	// Packed data may be moved by the compaction, so copy it.
+	if (img->segment) {
+		CacheSegment *seg = &cache_segments[img->segment - 1];
+		job->data = malloc(img->disk_size);
+		if (!job->data) {
+			free(job);
+			return;
+		}
+		memcpy(job->data, seg->map + img->segment_offset,
+		       img->disk_size);
+		job->data_size = img->disk_size;
+	} else {
+		gr_get_image_filename(img, job->filename, MAX_FILENAME_SIZE);
+	}
+	GR_LOG("Queueing decoding of image %u at 1/%d\n", img->image_id,
+	       reduction);
+	img->decoding_job = job;
+	gr_post_decoding_job(job);
+}
+
+/// Waits for the running scaling jobs reading the original image of `img`
+/// and frees all its scaling jobs. Must be called with the lock.
+static void gr_drop_scaling_jobs_locked(Image *img) {
+	while (img->scaling_jobs) {
+		DecodingJob *job = decoding_jobs;
+		while (job && !(job->scaled && job->img == img))
+			job = job->next;
+		if (!job)
+			break;
+		if (job->state == JOB_RUNNING)
+			pthread_cond_wait(&decoding_done, &decoding_mutex);
+		else
+			gr_free_decoding_job(job);
+	}
+}
+
+/// Makes the result of a finished job the original image of its image, unless
+/// the image has already been loaded at the same or a higher resolution. Frees
+/// the job. Returns 1 if the result was installed. Must be called with the
+/// lock.
+static int gr_install_decoding_result(DecodingJob *job) {
+	Image *img = job->img;
+	int installed =
+		img && job->pixels &&
+		(!img->original_image || img->reduction > job->reduction) &&
+		gr_check_decoded_size(img, job->reduction, job->pixels->width,
+				      job->pixels->height);
+	if (installed) {
+		// Scaling jobs reading the old original are dropped first, so
+		// that unloading doesn't take the lock again.
+		gr_drop_scaling_jobs_locked(img);
+		gr_unload_image(img);
+		img->original_image = job->pixels;
+		job->pixels = NULL;
+		img->reduction = job->reduction;
+		img->opaque = job->opaque;
+		img->status = STATUS_RAM_LOADING_SUCCESS;
+		images_ram_size += gr_image_ram_size(img);
+		ImagePlacement *placement = NULL;
+		kh_foreach_value(img->placements, placement,
+				 { placement->picked_up = 1; });
+		picked_up_exist = 1;
+		GR_LOG("Picked up image %u decoded at 1/%d as %s\n",
+		       img->image_id, job->reduction,
+		       pixel_layout_strings[img->original_image->layout]);
+	}
+	gr_free_decoding_job(job);
+	return installed;
+}
+
+/// Makes the result of a finished scaling job the scaled image of its
+/// placement, unless the placement has been deleted, or already has an exact
+/// scaled image of the same or a later frame, or the cell size has changed.
+/// Frees the job. Returns 1 if the result was installed. Must be called with
+/// the lock.
+static int gr_install_scaling_result(DecodingJob *job) {
+	ImagePlacement *placement = job->placement;
+	int installed =
+		placement && job->method && job->cw == current_cw &&
+		job->ch == current_ch &&
+		(!placement->scaled_image || placement->preview ||
+		 placement->scaled_cw != job->cw ||
+		 placement->scaled_ch != job->ch ||
+		 placement->scaled_frame_serial < job->frame_serial);
+	if (installed) {
+		gr_unload_placement(placement);
+		imlib_context_set_image(job->scaled_image);
+		imlib_image_put_back_data(job->scaled);
+		placement->scaled_image = job->scaled_image;
+		job->scaled_image = NULL;
+		images_ram_size -= gr_scaling_job_ram_size(job);
+		placement->scaled_opaque = job->params.opaque;
+		placement->scaled_cw = job->cw;
+		placement->scaled_ch = job->ch;
+		placement->scaled_frame_serial = job->frame_serial;
+		gr_bump_placement_generation(placement);
+		images_ram_size += gr_placement_ram_size(placement);
+		placement->picked_up = 1;
+		picked_up_exist = 1;
+		GR_LOG("Picked up placement %u/%u scaled with %s\n",
+		       job->img->image_id, placement->placement_id,
+		       job->method);
+	}
+	gr_free_decoding_job(job);
+	return installed;
+}
+
+/// Picks up the results of finished jobs and starts scaling the placements of
+/// newly decoded images. Returns 1 if there were any.
+static int gr_collect_decoded_images() {
+	if (!decoding_jobs)
+		return 0;
+	int collected = 0, installed = 0;
+	pthread_mutex_lock(&decoding_mutex);
+	DecodingJob *job = decoding_jobs;
+	while (job) {
+		if (job->state != JOB_DONE) {
+			job = job->next;
+			continue;
+		}
+		collected = 1;
+		if (job->scaled) {
+			installed |= gr_install_scaling_result(job);
+		} else {
+			Image *img = job->img;
+			installed |= gr_install_decoding_result(job);
+			// Posting jobs takes the lock.
+			if (img) {
+				pthread_mutex_unlock(&decoding_mutex);
+				gr_queue_image_scaling(img);
+				pthread_mutex_lock(&decoding_mutex);
+			}
+		}
+		// Installing may free other jobs, so start over.
+		job = decoding_jobs;
+	}
+	pthread_mutex_unlock(&decoding_mutex);
+	// Limits are checked without the lock, since unloading images and
+	// deleting placements take it.
+	if (installed)
+		gr_check_limits();
+	return collected;
+}
+
+/// Called before loading the original image on the main thread: waits for the
+/// job decoding it if it's running and picks up the result, or cancels the job
+/// if it hasn't started yet.
+static void gr_finish_decoding(Image *img) {
+	DecodingJob *job = img->decoding_job;
+	if (!job)
+		return;
+	pthread_mutex_lock(&decoding_mutex);
+	while (job->state == JOB_RUNNING)
+		pthread_cond_wait(&decoding_done, &decoding_mutex);
+	if (job->state == JOB_DONE)
+		gr_install_decoding_result(job);
+	else
+		gr_free_decoding_job(job);
+	pthread_mutex_unlock(&decoding_mutex);
+}
+
+/// Forgets the job decoding the image, which is being deleted.
+static void gr_cancel_decoding(Image *img) {
+	DecodingJob *job = img->decoding_job;
+	if (!job)
+		return;
+	img->decoding_job = NULL;
+	pthread_mutex_lock(&decoding_mutex);
+	// A running job will be freed when it's collected.
+	job->img = NULL;
+	if (job->state != JOB_RUNNING)
+		gr_free_decoding_job(job);
+	pthread_mutex_unlock(&decoding_mutex);
+}
+
+/// Called while drawing, before decoding the image on the main thread: picks
+/// up the result of the job decoding it if it's done. Doesn't wait for the
+/// job otherwise. Returns 1 if the job is still queued or running.
+static int gr_poll_decoding(Image *img) {
+	DecodingJob *job = img->decoding_job;
+	if (!job)
+		return 0;
+	pthread_mutex_lock(&decoding_mutex);
+	int pending = job->state != JOB_DONE;
+	if (!pending)
+		gr_install_decoding_result(job);
+	pthread_mutex_unlock(&decoding_mutex);
+	return pending;
+}
+
+/// Called while drawing, before scaling the placement on the main thread:
+/// picks up the result of its scaling job if it's done, or cancels the job if
+/// it scales for a cell size other than `cw` x `ch`. Doesn't wait for the job
+/// otherwise. Returns 1 if the job is still queued or running.
+static int gr_poll_scaling(ImagePlacement *placement, int cw, int ch) {
+	DecodingJob *job = placement->scaling_job;
+	if (!job)
+		return 0;
+	if (job->cw != cw || job->ch != ch) {
+		gr_cancel_scaling(placement);
+		return 0;
+	}
+	pthread_mutex_lock(&decoding_mutex);
+	int pending = job->state != JOB_DONE;
+	int installed = !pending && gr_install_scaling_result(job);
+	pthread_mutex_unlock(&decoding_mutex);
+	if (installed) {
+		placement->protected = 1;
+		gr_check_limits();
+		placement->protected = 0;
+	}
+	return pending;
+}
+
+/// Forgets the scaling job of the placement, which is being deleted.
+static void gr_cancel_scaling(ImagePlacement *placement) {
+	DecodingJob *job = placement->scaling_job;
+	if (!job)
+		return;
+	placement->scaling_job = NULL;
+	pthread_mutex_lock(&decoding_mutex);
+	// A running job will be freed when it's collected.
+	job->placement = NULL;
+	if (job->state != JOB_RUNNING)
+		gr_free_decoding_job(job);
+	pthread_mutex_unlock(&decoding_mutex);
+}
+
+/// Called before the original image is unloaded or replaced: waits for the
+/// scaling jobs reading it and frees them.
+static void gr_drop_scaling_jobs(Image *img) {
+	if (!img->scaling_jobs)
+		return;
+	pthread_mutex_lock(&decoding_mutex);
+	gr_drop_scaling_jobs_locked(img);
+	pthread_mutex_unlock(&decoding_mutex);
+}
+
+/// Loads the original image into RAM as a pixel buffer. PNG and JPEG
+/// images are decoded at 1/`reduction` of their resolution (a power of two),
+/// or at a smaller one if they don't fit into RAM otherwise. If the image is
+/// already loaded at the same or a higher resolution, does nothing. Loading may
+/// fail, in which case the status of the image will be set to
+/// STATUS_RAM_LOADING_ERROR.
+static void gr_load_image_reduced(Image *img, int reduction) {
+	reduction = MAX(reduction, gr_min_decode_reduction(img));
+	gr_finish_decoding(img);
+	if (img->original_image) {
+		if (MAX(img->reduction, 1) <= reduction)
+			return;
+		gr_unload_image(img);
+	}
+
+	// If the image is uninitialized or uploading has failed, or the file
+	// has been deleted, we cannot load the image.
+	if (img->status < STATUS_UPLOADING_SUCCESS)
+		return;
+	if (img->disk_size == 0) {
+		if (img->status != STATUS_RAM_LOADING_ERROR) {
+			fprintf(stderr,
+				"error: cached image was deleted: %u\n",
+				img->image_id);
+		}
+		img->status = STATUS_RAM_LOADING_ERROR;
+		return;
+	}
+
+	// Load the original image.
+	char filename[MAX_FILENAME_SIZE];
+	gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
+	GR_LOG("Loading image: %s\n", sanitized_filename(filename));
+	char raw = img->format == 24 || img->format == 32;
+	// Packed images are decoded from memory if possible, imlib can load
+	// only files.
+	if ((reduction > 1 || img->segment) && !raw) {
+		img->original_image = gr_load_image_file_reduced(img, reduction);
+		if (img->original_image && reduction > 1)
+			GR_LOG("Decoded image %u at 1/%d of its size\n",
+			       img->image_id, reduction);
+	}
+	img->reduction = img->original_image ? reduction : 1;
+	if (!img->original_image && img->segment && !raw)
+		gr_unpack_image(img);
+	// Don't decode the image with imlib if we know from its header that
+	// it's too big.
+	char too_big = (uint64_t)img->pix_width * img->pix_height * 4 >
+		       graphics_max_single_image_ram_size;
+	if (!img->original_image && !too_big &&
+	    (img->format == 100 || img->format == 0)) {
+		// Imlib is only used to decode the image, its pixels are
+		// copied to a buffer of our own.
+		Imlib_Image image = imlib_load_image(filename);
+		if (image)
+			img->original_image = gr_pixbuf_from_imlib(image);
+		if (img->original_image) {
+			// If imlib loading succeeded, set the information about
+			// the original image size.
+			img->pix_width = img->original_image->width;
+			img->pix_height = img->original_image->height;
+		}
+	}
+	if (!img->original_image &&
+	    (img->format == 32 || img->format == 24 || img->format == 0)) {
+		img->original_image = gr_load_raw_pixel_data(img, filename);
+	}
+	if (!img->original_image) {
+		if (img->status != STATUS_RAM_LOADING_ERROR) {
+			fprintf(stderr, "error: could not load image: %s\n",
+				sanitized_filename(filename));
+		}
+		img->status = STATUS_RAM_LOADING_ERROR;
+		return;
+	}
+
+	images_ram_size += gr_image_ram_size(img);
+	img->status = STATUS_RAM_LOADING_SUCCESS;
+	img->opaque = gr_pixbuf_is_opaque(img->original_image);
+	GR_LOG("Image %u is stored as %s, %u KiB\n", img->image_id,
+	       pixel_layout_strings[img->original_image->layout],
+	       gr_image_ram_size(img) / 1024);
+}
+
+/// Loads the original image at its full resolution if possible (see
+/// `gr_load_image_reduced`).
+static void gr_load_image(Image *img) { gr_load_image_reduced(img, 1); }
+
+////////////////////////////////////////////////////////////////////////////////
+// Animation frames.
+////////////////////////////////////////////////////////////////////////////////
+
+/// Returns the number of frames of the image (an image has at least one).
+static int gr_frame_count(Image *img) {
+	return img->frame_count ? img->frame_count : 1;
+}
+
+/// Returns the ram size of the pixels stored for the frame.
+static unsigned gr_frame_ram_size(ImageFrame *frame) {
+	return frame->pixels ? (unsigned)frame->width * frame->height * 4 : 0;
+}
+
+/// Returns the gap of the frame `index` (1-based).
+static int gr_frame_gap(Image *img, int index) {
+	if (!img->frames)
+		return graphics_default_frame_gap_ms;
+	return img->frames[index - 1].gap;
+}
+
+/// Frees all frames of the image and the composited frame.
+static void gr_free_frames(Image *img) {
+	for (int i = 0; i < img->frame_count; ++i) {
+		images_ram_size -= gr_frame_ram_size(&img->frames[i]);
+		free(img->frames[i].pixels);
+	}
+	free(img->frames);
+	img->frames = NULL;
+	img->frame_count = img->frame_capacity = 0;
+	if (img->frame_image) {
+		imlib_context_set_image(img->frame_image);
+		imlib_free_image();
+		images_ram_size -= gr_frame_image_ram_size(img);
+		img->frame_image = NULL;
+		img->frame_image_index = 0;
+	}
+}
+
+/// Makes sure that the array of frames contains the first frame and has room
+/// for one more frame. Returns 0 on failure.
+static int gr_reserve_frame(Image *img) {
+	if (img->frame_count + 2 > img->frame_capacity) {
+		int new_capacity = MAX(4, img->frame_capacity * 2);
+		ImageFrame *frames =
+			realloc(img->frames, new_capacity * sizeof(ImageFrame));
+		if (!frames)
+			return 0;
+		img->frames = frames;
+		img->frame_capacity = new_capacity;
+	}
+	if (img->frame_count == 0) {
+		memset(&img->frames[0], 0, sizeof(ImageFrame));
+		img->frames[0].gap = graphics_default_frame_gap_ms;
+		img->frame_count = 1;
+	}
+	return 1;
 }
 
-/// Computes the best number of rows and columns for a placement if it's not
-/// specified, and also adjusts the source rectangle size.
-static void gr_infer_placement_size_maybe(ImagePlacement *placement) {
-	// Negative values are not allowed. Quietly set them to 0.
-	if (placement->src_pix_x < 0)
-		placement->src_pix_x = 0;
-	if (placement->src_pix_y < 0)
-		placement->src_pix_y = 0;
-	if (placement->src_pix_width < 0)
-		placement->src_pix_width = 0;
-	if (placement->src_pix_height < 0)
-		placement->src_pix_height = 0;
-	// If the source rectangle is outside the image, truncate it.
-	if (placement->src_pix_x > placement->image->pix_width)
-		placement->src_pix_x = placement->image->pix_width;
-	if (placement->src_pix_y > placement->image->pix_height)
-		placement->src_pix_y = placement->image->pix_height;
-	// If the source rectangle is not specified, use the whole image. If
-	// it's partially outside the image, truncate it.
-	if (placement->src_pix_width == 0 ||
-	    placement->src_pix_x + placement->src_pix_width >
-		    placement->image->pix_width)
-		placement->src_pix_width =
-			placement->image->pix_width - placement->src_pix_x;
-	if (placement->src_pix_height == 0 ||
-	    placement->src_pix_y + placement->src_pix_height >
-		    placement->image->pix_height)
-		placement->src_pix_height =
-			placement->image->pix_height - placement->src_pix_y;
+/// Appends an empty frame to the image and returns it, or NULL on failure.
+static ImageFrame *gr_append_frame(Image *img) {
+	if (!gr_reserve_frame(img))
+		return NULL;
+	ImageFrame *frame = &img->frames[img->frame_count++];
+	memset(frame, 0, sizeof(ImageFrame));
+	animations_exist = 1;
+	return frame;
+}
 
-	if (placement->cols != 0 && placement->rows != 0)
+/// Alpha-blends the pixel `src` onto `dst` (both are non-premultiplied ARGB).
+static inline DATA32 gr_blend_pixel(DATA32 dst, DATA32 src) {
+	unsigned src_a = src >> 24;
+	if (src_a == 255)
+		return src;
+	if (src_a == 0)
+		return dst;
+	unsigned dst_a = (dst >> 24) * (255 - src_a) / 255;
+	unsigned res_a = src_a + dst_a;
+	DATA32 res = (DATA32)res_a << 24;
+	for (int shift = 0; shift < 24; shift += 8) {
+		unsigned src_c = (src >> shift) & 0xFF;
+		unsigned dst_c = (dst >> shift) & 0xFF;
+		res |= ((src_c * src_a + dst_c * dst_a) / res_a) << shift;
+	}
+	return res;
+}
+
+/// Draws the stored rectangle of the frame onto `canvas`, which has the size
+/// of the image.
+static void gr_apply_frame_delta(Image *img, ImageFrame *frame,
+				 DATA32 *canvas) {
+	for (int y = 0; y < frame->height; ++y) {
+		DATA32 *dst = canvas + (size_t)(frame->y + y) * img->pix_width +
+			      frame->x;
+		DATA32 *src = frame->pixels + (size_t)y * frame->width;
+		if (frame->overwrite) {
+			memcpy(dst, src, frame->width * sizeof(DATA32));
+			continue;
+		}
+		for (int x = 0; x < frame->width; ++x)
+			dst[x] = gr_blend_pixel(dst[x], src[x]);
+	}
+}
+
+/// Composites the frame `index` (1-based) into `canvas`, which has the size of
+/// the image. `original` are the pixels of the first frame. Frames are always
+/// based on frames with smaller numbers, so we walk down to a frame that
+/// doesn't depend on anything and apply the deltas on the way back up.
+static void gr_compose_frame(Image *img, int index, PixelBuffer *original,
+			     DATA32 *canvas) {
+	size_t total_pixels = (size_t)img->pix_width * img->pix_height;
+	int *chain = malloc(index * sizeof(int));
+	int chain_len = 0;
+	if (!chain) {
+		memset(canvas, 0, total_pixels * sizeof(DATA32));
 		return;
-	if (placement->src_pix_width == 0 || placement->src_pix_height == 0)
+	}
+	while (index > 1) {
+		chain[chain_len++] = index;
+		index = img->frames[index - 1].base;
+		if (index == 0)
+			break;
+	}
+	if (index == 1 && original->width == img->pix_width &&
+	    original->height == img->pix_height) {
+		gr_pixbuf_read_rect(original, 0, 0, img->pix_width,
+				    img->pix_height, canvas, img->pix_width);
+	} else if (index == 1) {
+		memset(canvas, 0, total_pixels * sizeof(DATA32));
+	} else {
+		DATA32 background = img->frames[chain[chain_len - 1] - 1].background;
+		for (size_t i = 0; i < total_pixels; ++i)
+			canvas[i] = background;
+	}
+	while (chain_len > 0)
+		gr_apply_frame_delta(img, &img->frames[chain[--chain_len] - 1],
+				     canvas);
+	free(chain);
+}
+
+/// Returns the composited current frame, which must not be the first one, to
+/// scale placements from. It's created if needed, the original image must be
+/// loaded. Returns NULL on failure.
+static Imlib_Image gr_get_frame_image(Image *img) {
+	if (!img->original_image || img->current_frame <= 1)
+		return NULL;
+	if (img->frame_image && img->frame_image_index == img->current_frame)
+		return img->frame_image;
+	if (!img->frame_image) {
+		img->frame_image =
+			imlib_create_image(img->pix_width, img->pix_height);
+		if (!img->frame_image)
+			return NULL;
+		imlib_context_set_image(img->frame_image);
+		imlib_image_set_has_alpha(1);
+		images_ram_size += gr_frame_image_ram_size(img);
+	}
+	imlib_context_set_image(img->frame_image);
+	DATA32 *canvas = imlib_image_get_data();
+	gr_compose_frame(img, img->current_frame, img->original_image, canvas);
+	imlib_image_put_back_data(canvas);
+	img->frame_image_index = img->current_frame;
+	GR_LOG("Composited frame %d of image %u\n", img->current_frame,
+	       img->image_id);
+	return img->frame_image;
+}
+
+/// Marks the scaled images of the placements of the image as outdated after the
+/// pixels of its current frame changed. They are shown until they are
+/// replaced, see `gr_load_placement`.
+static void gr_frame_pixels_changed(Image *img) {
+	img->frame_serial++;
+	img->frame_changed = 1;
+	animations_exist = 1;
+}
+
+/// Makes the frame `index` (1-based) current. If the new frame is based on the
+/// one that is currently composited, only its delta is applied, otherwise it
+/// will be composited from scratch when displayed. Scaled placements are
+/// rescaled on the next redraw, in the background if possible.
+static void gr_show_frame(Image *img, int index) {
+	int prev = img->current_frame ? img->current_frame : 1;
+	if (index == prev)
 		return;
-	if (current_cw == 0 || current_ch == 0)
+	img->current_frame = index;
+	gr_frame_pixels_changed(img);
+	if (index == 1)
 		return;
+	ImageFrame *frame = &img->frames[index - 1];
+	if (img->frame_image && img->frame_image_index == prev &&
+	    frame->base == prev && prev > 1) {
+		imlib_context_set_image(img->frame_image);
+		DATA32 *canvas = imlib_image_get_data();
+		gr_apply_frame_delta(img, frame, canvas);
+		imlib_image_put_back_data(canvas);
+		img->frame_image_index = index;
+	}
+}
 
-	// If no size is specified, use the image size.
-	if (placement->cols == 0 && placement->rows == 0) {
-		placement->cols =
-			ceil_div(placement->src_pix_width, current_cw);
-		placement->rows =
-			ceil_div(placement->src_pix_height, current_ch);
+/// Replaces the frame `index` (2 or more) with its fully composited version,
+/// so that it no longer depends on other frames. Returns 0 on failure.
+static int gr_materialize_frame(Image *img, int index) {
+	ImageFrame *frame = &img->frames[index - 1];
+	if (frame->base == 0 && frame->overwrite && frame->x == 0 &&
+	    frame->y == 0 && frame->width == img->pix_width &&
+	    frame->height == img->pix_height)
+		return 1;
+	gr_load_image(img);
+	if (!img->original_image)
+		return 0;
+	DATA32 *pixels =
+		malloc((size_t)img->pix_width * img->pix_height * sizeof(DATA32));
+	if (!pixels)
+		return 0;
+	gr_compose_frame(img, index, img->original_image, pixels);
+	images_ram_size -= gr_frame_ram_size(frame);
+	free(frame->pixels);
+	frame->pixels = pixels;
+	frame->base = 0;
+	frame->overwrite = 1;
+	frame->x = frame->y = 0;
+	frame->width = img->pix_width;
+	frame->height = img->pix_height;
+	images_ram_size += gr_frame_ram_size(frame);
+	return 1;
+}
+
+/// Returns 2 (redraw without erasing) for cells of images whose frame has
+/// changed. Used with `gr_for_each_image_cell`.
+static int gr_redraw_animated_cell(void *data, uint32_t image_id,
+				   uint32_t placement_id, int col, int row,
+				   char is_classic) {
+	Image *img = gr_find_image(image_id);
+	if (!img)
+		return 0;
+	if (img->frame_changed)
+		return 2;
+	// Images under a non-opaque placement may be animated too.
+	ImagePlacement *placement = gr_find_placement(img, placement_id);
+	if (!placement || gr_placement_is_opaque(placement))
+		return 0;
+	for (int i = 0; i < placement->underlay_count; ++i) {
+		ImagePlacement *under =
+			gr_underlay_placement(&placement->underlays[i]);
+		if (under && under->image->frame_changed)
+			return 2;
+	}
+	return 0;
+}
+
+/// Advances the animations whose next frame is due and marks the lines showing
+/// them as dirty. Returns the number of milliseconds until the next frame of
+/// any animation, or -1 if no animation is running.
+double gr_update_animations() {
+	if (!animations_exist)
+		return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double timeout = -1;
+	char changed = 0, running = 0;
+	Image *img = NULL;
+	kh_foreach_value(images, img, {
+		// The frame may also be changed by a command.
+		changed |= img->frame_changed;
+		if (img->frame_count < 2 ||
+		    (img->animation_state != ANIMATION_RUNNING &&
+		     img->animation_state != ANIMATION_LOADING))
+			continue;
+		// Animations without placements are checked again when they
+		// get one.
+		if (kh_size(img->placements) == 0)
+			continue;
+		running = 1;
+		double wait = -gr_ms_since(&now, &img->next_frame_time);
+		if (wait <= 0) {
+			int frame = img->current_frame ? img->current_frame : 1;
+			// Find the next frame, skipping gapless ones.
+			int next = frame;
+			for (int i = 0; i < img->frame_count; ++i) {
+				next = next % img->frame_count + 1;
+				if (gr_frame_gap(img, next) >= 0)
+					break;
+			}
+			if (next <= frame) {
+				// Wrapping around to the beginning.
+				if (img->animation_state == ANIMATION_LOADING)
+					continue;
+				img->loops_done++;
+				if (img->max_loops > 1 &&
+				    img->loops_done >= img->max_loops - 1) {
+					img->animation_state = ANIMATION_STOPPED;
+					continue;
+				}
+			}
+			gr_show_frame(img, next);
+			changed |= img->frame_changed;
+			int gap = MAX(gr_frame_gap(img, next), 1);
+			gr_add_ms(&img->next_frame_time, gap);
+			wait = -gr_ms_since(&now, &img->next_frame_time);
+			if (wait <= 0) {
+				// We are late by more than a frame, don't try
+				// to catch up.
+				img->next_frame_time = now;
+				gr_add_ms(&img->next_frame_time, gap);
+				wait = gap;
+			}
+		}
+		if (timeout < 0 || wait < timeout)
+			timeout = wait;
+	});
+	if (changed) {
+		gr_for_each_image_cell(gr_redraw_animated_cell, NULL);
+		kh_foreach_value(images, img, { img->frame_changed = 0; });
+	}
+	animations_exist = running;
+	return timeout;
+}
+
+/// Counts cells of placements shown as previews in `((int *)data)[0]`. Those
+/// replaced by the main thread, not by a scaling job, are also counted in
+/// `((int *)data)[1]` and 2 (redraw without erasing) is returned for them.
+/// Used with `gr_for_each_image_cell`.
+static int gr_redraw_preview_cell(void *data, uint32_t image_id,
+				  uint32_t placement_id, int col, int row,
+				  char is_classic) {
+	ImagePlacement *placement =
+		gr_find_image_and_placement(image_id, placement_id);
+	if (!placement || !placement->preview)
+		return 0;
+	((int *)data)[0]++;
+	if (placement->scaling_job)
+		return 0;
+	((int *)data)[1]++;
+	return 2;
+}
+
+/// Marks the lines showing placement previews as dirty, so that the previews
+/// are replaced with exact scaled images during the next redraws, as much as
+/// the rescaling budget allows. Previews replaced by scaling jobs are redrawn
+/// by `gr_update_decoded_images` instead. Returns 0 if previews that the main
+/// thread must replace are on screen (the terminal should redraw as soon as
+/// possible), or -1 otherwise.
+double gr_update_previews() {
+	if (!previews_exist)
+		return -1;
+	char found = 0;
+	Image *img = NULL;
+	ImagePlacement *placement = NULL;
+	kh_foreach_value(images, img, {
+		kh_foreach_value(img->placements, placement,
+				 { found |= placement->preview; });
+	});
+	previews_exist = found;
+	if (!found)
+		return -1;
+	int cells[2] = {0, 0};
+	gr_for_each_image_cell(gr_redraw_preview_cell, cells);
+	if (cells[1])
+		return 0;
+	if (cells[0])
+		return -1;
+	// The remaining previews are off screen and can only be replaced when
+	// they are drawn, so unload them instead of waiting for that.
+	kh_foreach_value(images, img, {
+		kh_foreach_value(img->placements, placement, {
+			if (placement->preview)
+				gr_unload_placement(placement);
+		});
+	});
+	previews_exist = 0;
+	return -1;
+}
+
+/// Returns 2 (redraw without erasing) for cells of placements that have been
+/// made ready to be drawn by background jobs, or that cover such placements.
+/// Placements still waiting for a scaling job are skipped, they are redrawn
+/// when it's done. Used with `gr_for_each_image_cell`.
+static int gr_redraw_picked_up_cell(void *data, uint32_t image_id,
+				    uint32_t placement_id, int col, int row,
+				    char is_classic) {
+	ImagePlacement *placement =
+		gr_find_image_and_placement(image_id, placement_id);
+	if (!placement)
+		return 0;
+	if (placement->picked_up && !placement->scaling_job)
+		return 2;
+	for (int i = 0; i < placement->underlay_count; ++i) {
+		ImagePlacement *under =
+			gr_underlay_placement(&placement->underlays[i]);
+		if (under && under->picked_up && !under->scaling_job)
+			return 2;
+	}
+	return 0;
+}
+
+int gr_decoding_wakeup_fd() { return decoding_wakeup_pipe[0]; }
+
+/// Picks up the results of background jobs and marks the lines showing the
+/// placements they concern as dirty.
+void gr_update_decoded_images() {
+	if (decoding_wakeup_pipe[0] < 0)
 		return;
+	char buf[64];
+	while (read(decoding_wakeup_pipe[0], buf, sizeof(buf)) > 0)
+		;
+	gr_collect_decoded_images();
+	if (!picked_up_exist)
+		return;
+	gr_for_each_image_cell(gr_redraw_picked_up_cell, NULL);
+	Image *img = NULL;
+	ImagePlacement *placement = NULL;
+	kh_foreach_value(images, img, {
+		kh_foreach_value(img->placements, placement,
+				 { placement->picked_up = 0; });
+	});
+	picked_up_exist = 0;
+}
+
+/// The result of probing an image file without decoding it.
+enum ProbeResult {
+	/// The file is not recognized, it must be decoded to be validated.
+	PROBE_UNKNOWN = 0,
+	/// The header is valid, the image size is known.
+	PROBE_OK = 1,
+	/// The file is definitely broken.
+	PROBE_INVALID = 2,
+};
+
+/// Reads a big-endian number of `bytes` bytes from `buf`.
+static uint32_t gr_read_be(const unsigned char *buf, int bytes) {
+	uint32_t res = 0;
+	for (int i = 0; i < bytes; ++i)
+		res = (res << 8) | buf[i];
+	return res;
+}
+
+/// Probes a PNG file by reading its signature and the IHDR chunk.
+static int gr_probe_png(FILE *file, int *width, int *height) {
+	static const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+						   '\r', '\n', 0x1A, '\n'};
+	unsigned char header[24];
+	size_t len = fread(header, 1, sizeof(header), file);
+	if (len < sizeof(signature) ||
+	    memcmp(header, signature, sizeof(signature)) != 0)
+		return PROBE_UNKNOWN;
+	if (len < sizeof(header) || memcmp(header + 12, "IHDR", 4) != 0)
+		return PROBE_INVALID;
+	*width = gr_read_be(header + 16, 4);
+	*height = gr_read_be(header + 20, 4);
+	return PROBE_OK;
+}
+
+/// Probes a JPEG file by skipping segments until a start-of-frame marker.
+static int gr_probe_jpeg(FILE *file, int *width, int *height) {
+	unsigned char buf[8];
+	if (fread(buf, 1, 2, file) != 2 || buf[0] != 0xFF || buf[1] != 0xD8)
+		return PROBE_UNKNOWN;
+	while (1) {
+		// Find the next marker, skipping fill bytes.
+		int c = fgetc(file);
+		if (c != 0xFF)
+			return PROBE_INVALID;
+		while ((c = fgetc(file)) == 0xFF)
+			;
+		if (c == EOF || c == 0xD9 || c == 0xDA)
+			return PROBE_INVALID;
+		// Standalone markers have no length.
+		if (c == 0x01 || (c >= 0xD0 && c <= 0xD8))
+			continue;
+		if (fread(buf, 1, 2, file) != 2)
+			return PROBE_INVALID;
+		uint32_t seg_len = gr_read_be(buf, 2);
+		if (seg_len < 2)
+			return PROBE_INVALID;
+		// SOF0..SOF15, except DHT, JPG and DAC.
+		if (c >= 0xC0 && c <= 0xCF && c != 0xC4 && c != 0xC8 &&
+		    c != 0xCC) {
+			if (fread(buf, 1, 5, file) != 5)
+				return PROBE_INVALID;
+			*height = gr_read_be(buf + 1, 2);
+			*width = gr_read_be(buf + 3, 2);
+			return PROBE_OK;
+		}
+		if (fseek(file, seg_len - 2, SEEK_CUR) != 0)
+			return PROBE_INVALID;
 	}
+}
 
-	// It doesn't seem to be documented anywhere, but some applications
-	// specify only one of the dimensions.
-	if (placement->scale_mode == SCALE_MODE_CONTAIN) {
-		// If we preserve aspect ratio and fit to width/height, the most
-		// logical thing is to find the minimum size of the
-		// non-specified dimension that allows the image to fit the
-		// specified dimension.
-		if (placement->cols == 0) {
-			placement->cols = ceil_div(
-				placement->src_pix_width * placement->rows *
-					current_ch,
-				placement->src_pix_height * current_cw);
-			return;
+/// Checks whether the uploaded image looks valid without decoding it. Sets the
+/// image size if it can be determined. Returns one of `ProbeResult`, and an
+/// error message through `error` if the result is `PROBE_INVALID`.
+static int gr_probe_image(Image *img, const char **error) {
+	if (img->status < STATUS_UPLOADING_SUCCESS || img->disk_size == 0) {
+		*error = "EBADF: could not load image";
+		return PROBE_INVALID;
+	}
+
+	FILE *file = gr_open_image_data(img);
+	if (!file) {
+		*error = "EBADF: could not open the cached image file";
+		return PROBE_INVALID;
+	}
+
+	int width = 0, height = 0;
+	int res = PROBE_UNKNOWN;
+	if (img->format == 100 || img->format == 0) {
+		res = gr_probe_png(file, &width, &height);
+		if (res == PROBE_UNKNOWN) {
+			rewind(file);
+			res = gr_probe_jpeg(file, &width, &height);
 		}
-		if (placement->rows == 0) {
-			placement->rows =
-				ceil_div(placement->src_pix_height *
-						 placement->cols * current_cw,
-					 placement->src_pix_width * current_ch);
-			return;
+		if (res == PROBE_INVALID)
+			*error = "EBADF: corrupted image header";
+	} else if (img->format == 24 || img->format == 32) {
+		// Raw pixels: the size must be specified, and if the data is
+		// not compressed, we can check that there is enough of it.
+		width = img->pix_width;
+		height = img->pix_height;
+		size_t pixel_size = img->format == 24 ? 3 : 4;
+		if (width <= 0 || height <= 0) {
+			*error = "EINVAL: the image size must be specified "
+				 "with s= and v=";
+			res = PROBE_INVALID;
+		} else if (!img->compression &&
+			   (img->cache_compressed ? img->uploaded_size
+						  : img->disk_size) <
+				   (size_t)width * height * pixel_size) {
+			*error = "ENODATA: insufficient image data";
+			res = PROBE_INVALID;
+		} else {
+			res = PROBE_OK;
+		}
+	}
+	fclose(file);
+
+	if (res != PROBE_OK)
+		return res;
+	if (width <= 0 || height <= 0) {
+		*error = "EBADF: invalid image size";
+		return PROBE_INVALID;
+	}
+	img->pix_width = width;
+	img->pix_height = height;
+	// PNG and JPEG images that are too big may still be decoded at a
+	// reduced resolution.
+	int reduction = gr_min_decode_reduction(img);
+	if ((uint64_t)gr_reduced_size(width, reduction) *
+		    gr_reduced_size(height, reduction) * 4 >
+	    graphics_max_single_image_ram_size) {
+		*error = "EFBIG: the image is too big to load";
+		return PROBE_INVALID;
+	}
+	return PROBE_OK;
+}
+
+/// Computes the rectangle of the scaled image of size `scaled_w` x `scaled_h`
+/// that the source rectangle of the placement is fit into according to the
+/// scale mode.
+static void gr_get_scaled_dest_rect(ImagePlacement *placement, int scaled_w,
+				    int scaled_h, int *dest_x, int *dest_y,
+				    int *dest_w, int *dest_h) {
+	int src_w = placement->src_pix_width;
+	int src_h = placement->src_pix_height;
+	// Whether the box is too small to use the true size of the image.
+	char box_too_small = scaled_w < src_w || scaled_h < src_h;
+	char mode = placement->scale_mode;
+
+	*dest_x = *dest_y = 0;
+	if (mode == SCALE_MODE_FILL) {
+		*dest_w = scaled_w;
+		*dest_h = scaled_h;
+	} else if (mode == SCALE_MODE_NONE ||
+		   (mode == SCALE_MODE_NONE_OR_CONTAIN && !box_too_small)) {
+		*dest_w = src_w;
+		*dest_h = src_h;
+	} else {
+		if (mode != SCALE_MODE_CONTAIN &&
+		    mode != SCALE_MODE_NONE_OR_CONTAIN) {
+			fprintf(stderr,
+				"warning: unknown scale mode %u, using "
+				"'contain' instead\n",
+				mode);
+		}
+		if (scaled_w * src_h > src_w * scaled_h) {
+			// If the box is wider than the original image, fit to
+			// height.
+			*dest_h = scaled_h;
+			*dest_w = src_w * scaled_h / src_h;
+			*dest_x = (scaled_w - *dest_w) / 2;
+		} else {
+			// Otherwise, fit to width.
+			*dest_w = scaled_w;
+			*dest_h = src_h * scaled_w / src_w;
+			*dest_y = (scaled_h - *dest_h) / 2;
+		}
+	}
+}
+
+/// Returns the largest reduction (a power of two) at which the original image
+/// can be decoded without losing detail in any of its placements, assuming the
+/// cell size `cw` x `ch`.
+static int gr_decode_reduction(Image *img, int cw, int ch) {
+	if ((img->format != 100 && img->format != 0) || img->frame_count > 1 ||
+	    img->pix_width <= 0 || img->pix_height <= 0)
+		return 1;
+	// The smallest size of the whole image that is enough for all
+	// placements.
+	uint64_t need_w = 0, need_h = 0;
+	int dest_x, dest_y, dest_w, dest_h;
+	ImagePlacement *placement = NULL;
+	kh_foreach_value(img->placements, placement, {
+		gr_infer_placement_size_maybe(placement);
+		if (placement->src_pix_width <= 0 ||
+		    placement->src_pix_height <= 0)
+			continue;
+		gr_get_scaled_dest_rect(placement, placement->cols * cw,
+					placement->rows * ch, &dest_x, &dest_y,
+					&dest_w, &dest_h);
+		need_w = MAX(need_w, (uint64_t)dest_w * img->pix_width /
+					     placement->src_pix_width);
+		need_h = MAX(need_h, (uint64_t)dest_h * img->pix_height /
+					     placement->src_pix_height);
+	});
+	int reduction = 1;
+	while (reduction < MAX_DECODE_REDUCTION &&
+	       gr_reduced_size(img->pix_width, reduction * 2) >= need_w &&
+	       gr_reduced_size(img->pix_height, reduction * 2) >= need_h)
+		reduction *= 2;
+	return reduction;
+}
+
+/// Posts a job decoding the image at the resolution its placements need with
+/// the current cell size, or at the highest allowed one if it's unknown.
+static void gr_queue_decoding_for_placements(Image *img) {
+	int reduction = gr_min_decode_reduction(img);
+	if (kh_size(img->placements) && current_cw && current_ch)
+		reduction = MAX(reduction, gr_decode_reduction(img, current_cw,
+							       current_ch));
+	gr_queue_decoding(img, reduction);
+}
+
+/// Computes how `pixels`, the loaded pixels of the image of the placement
+/// decoded at 1/`reduction` of its resolution, are fit into the scaled image
+/// of the placement with the cell size `cw` x `ch` according to the scale mode.
+static void gr_get_scaling_params(ImagePlacement *placement,
+				  PixelBuffer *pixels, int reduction,
+				  char source_opaque, int cw, int ch,
+				  ScalingParams *p) {
+	memset(p, 0, sizeof(*p));
+	p->scaled_w = (int)placement->cols * cw;
+	p->scaled_h = (int)placement->rows * ch;
+	if (placement->src_pix_width <= 0 || placement->src_pix_height <= 0) {
+		fprintf(stderr, "warning: image of zero size\n");
+		return;
+	}
+	gr_get_scaled_dest_rect(placement, p->scaled_w, p->scaled_h,
+				&p->dest_x, &p->dest_y, &p->dest_w, &p->dest_h);
+	// If the original is opaque and covers the whole scaled image, the
+	// scaled image is opaque too, and doesn't need to be cleared or
+	// premultiplied.
+	p->source_opaque = source_opaque;
+	p->opaque = source_opaque && p->dest_x <= 0 && p->dest_y <= 0 &&
+		    p->dest_x + p->dest_w >= p->scaled_w &&
+		    p->dest_y + p->dest_h >= p->scaled_h;
+
+	// The source rectangle is in the coordinates of the full-size image,
+	// the original may be decoded at a reduced resolution.
+	int r = reduction;
+	int src_x = placement->src_pix_x;
+	int src_y = placement->src_pix_y;
+	int src_w = placement->src_pix_width;
+	int src_h = placement->src_pix_height;
+	if (r > 1) {
+		src_w = MAX(gr_reduced_size(src_x + src_w, r) - src_x / r, 1);
+		src_h = MAX(gr_reduced_size(src_y + src_h, r) - src_y / r, 1);
+		src_x /= r;
+		src_y /= r;
+	}
+	p->src_x = src_x;
+	p->src_y = src_y;
+	p->src_w = MIN(src_w, pixels->width - src_x);
+	p->src_h = MIN(src_h, pixels->height - src_y);
+}
+
+/// Creates an uninitialized imlib image of the scaled size from `p`. Returns
+/// NULL if it's too big or on failure.
+static Imlib_Image gr_create_blank_scaled_image(ImagePlacement *placement,
+						const ScalingParams *p) {
+	if (p->scaled_w * p->scaled_h * 4 >
+	    graphics_max_single_image_ram_size) {
+		fprintf(stderr,
+			"error: placement %u/%u would be too big to load: %d x "
+			"%d x 4 > %u\n",
+			placement->image->image_id, placement->placement_id,
+			p->scaled_w, p->scaled_h,
+			graphics_max_single_image_ram_size);
+		return NULL;
+	}
+	Imlib_Image scaled_image = imlib_create_image(p->scaled_w, p->scaled_h);
+	if (!scaled_image) {
+		fprintf(stderr,
+			"error: imlib_create_image(%d, %d) returned "
+			"null\n",
+			p->scaled_w, p->scaled_h);
+		return NULL;
+	}
+	imlib_context_set_image(scaled_image);
+	imlib_image_set_has_alpha(1);
+	return scaled_image;
+}
+
+/// Creates an image of the size of the placement with the cell size `cw` x
+/// `ch` and fits the original image (which must be loaded) into it according to
+/// the scale mode. Returns NULL on failure.
+static Imlib_Image gr_create_scaled_image(ImagePlacement *placement, int cw,
+					  int ch) {
+	Image *img = placement->image;
+	if (!img->original_image)
+		return NULL;
+	// Frames other than the first one are composited into an imlib image,
+	// which the resampler reads without copying it.
+	Imlib_Image frame = NULL;
+	if (img->current_frame > 1 && !(frame = gr_get_frame_image(img)))
+		return NULL;
+	PixelBuffer frame_pixels = {0};
+	PixelBuffer *pixels = img->original_image;
+	if (frame) {
+		imlib_context_set_image(frame);
+		frame_pixels.layout = PIXEL_BGRA;
+		frame_pixels.width = img->pix_width;
+		frame_pixels.height = img->pix_height;
+		frame_pixels.stride = img->pix_width * sizeof(DATA32);
+		frame_pixels.data =
+			(unsigned char *)imlib_image_get_data_for_reading_only();
+		pixels = &frame_pixels;
+	}
+
+	ScalingParams p;
+	gr_get_scaling_params(placement, pixels, frame ? 1 : img->reduction,
+			      !frame && img->opaque, cw, ch, &p);
+	Imlib_Image scaled_image = gr_create_blank_scaled_image(placement, &p);
+	if (!scaled_image)
+		return NULL;
+	placement->scaled_opaque = p.opaque;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int filter = MIN(graphics_scaling_filter, SCALING_FILTER_LANCZOS);
+	DATA32 *data = imlib_image_get_data();
+	const char *method = gr_scale_pixels(pixels, &p, filter, data);
+	imlib_image_put_back_data(data);
+
+	if (!method) {
+		method = scaling_filter_strings[SCALING_FILTER_IMLIB];
+		// Only the source rectangle of the original is converted to
+		// ARGB.
+		int src_x = p.src_x, src_y = p.src_y;
+		Imlib_Image source = frame;
+		if (!frame) {
+			source = gr_pixbuf_to_imlib(pixels, src_x, src_y,
+						    p.src_w, p.src_h);
+			src_x = src_y = 0;
+		}
+		imlib_context_set_image(scaled_image);
+		// Opaque pixels can be copied instead of blended.
+		imlib_context_set_blend(!p.opaque);
+		imlib_context_set_anti_alias(1);
+		if (source) {
+			imlib_blend_image_onto_image(source, 1, src_x, src_y,
+						     p.src_w, p.src_h, p.dest_x,
+						     p.dest_y, p.dest_w,
+						     p.dest_h);
+		}
+		imlib_context_set_blend(1);
+		if (source && !frame) {
+			imlib_context_set_image(source);
+			imlib_free_image();
+			imlib_context_set_image(scaled_image);
+		}
+		if (!p.opaque) {
+			data = imlib_image_get_data();
+			gr_premultiply(data, (size_t)p.scaled_w * p.scaled_h);
+			imlib_image_put_back_data(data);
 		}
-	} else {
-		// Otherwise we stretch the image or preserve the original size.
-		// In both cases we compute the best number of columns from the
-		// pixel size and cell size to be compatible with kitty.
-		if (!placement->cols)
-			placement->cols =
-				ceil_div(placement->src_pix_width, current_cw);
-		if (!placement->rows)
-			placement->rows =
-				ceil_div(placement->src_pix_height, current_ch);
 	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	GR_LOG("Scaled %dx%d to %dx%d with %s in %.2f ms\n", p.src_w, p.src_h,
+	       p.dest_w, p.dest_h, method, gr_ms_since(&end, &start));
+
+	return scaled_image;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Image loading.
-////////////////////////////////////////////////////////////////////////////////
+/// Assigns a new generation to the placement after its scaled image changed.
+static void gr_bump_placement_generation(ImagePlacement *placement) {
+	// Zero means "unknown", skip it on wraparound.
+	if (++placement_generation_counter == 0)
+		++placement_generation_counter;
+	placement->generation = placement_generation_counter;
+}
 
-/// Copies `num_pixels` pixels (not bytes!) from a buffer `from` to an imlib2
-/// image data `to`. The format may be 24 (RGBA) or 32 (RGB), and it's converted
-/// to imlib2's representation, which depends on the endianness, and on
-/// little-endian architectures the memory layout is actually BGRA.
-static inline void gr_copy_pixels(DATA32 *to, unsigned char *from, int format,
-				  size_t num_pixels) {
-	size_t pixel_size = format == 24 ? 3 : 4;
-	if (format == 32) {
-		for (unsigned i = 0; i < num_pixels; ++i) {
-			unsigned byte_i = i * pixel_size;
-			to[i] = ((DATA32)from[byte_i + 2]) |
-				((DATA32)from[byte_i + 1]) << 8 |
-				((DATA32)from[byte_i]) << 16 |
-				((DATA32)from[byte_i + 3]) << 24;
-		}
-	} else {
-		for (unsigned i = 0; i < num_pixels; ++i) {
-			unsigned byte_i = i * pixel_size;
-			to[i] = ((DATA32)from[byte_i + 2]) |
-				((DATA32)from[byte_i + 1]) << 8 |
-				((DATA32)from[byte_i]) << 16 | 0xFF000000;
+/// Posts a job creating the scaled image of the placement for the cell size
+/// `cw` x `ch` from the current frame, so that the frame showing the placement
+/// doesn't have to. Does nothing if the placement is already scaled, or the
+/// original image is not loaded at a sufficient resolution. Progressively
+/// uploaded images and the imlib filter are left to `gr_rescale_placement`.
+static void gr_queue_scaling(ImagePlacement *placement, int cw, int ch) {
+	Image *img = placement->image;
+	if (!decoding_thread_count || placement->scaling_job || !cw || !ch ||
+	    graphics_scaling_filter == SCALING_FILTER_IMLIB ||
+	    !img->original_image || img->progressive)
+		return;
+	if (placement->scaled_image && !placement->preview &&
+	    placement->scaled_cw == cw && placement->scaled_ch == ch &&
+	    placement->scaled_frame_serial == img->frame_serial)
+		return;
+	gr_infer_placement_size_maybe(placement);
+	// The original must not need to be reloaded at a higher resolution.
+	int reduction = MAX(gr_decode_reduction(img, cw, ch),
+			    gr_min_decode_reduction(img));
+	if (MAX(img->reduction, 1) > reduction)
+		return;
+	// Other frames are composited by the main thread, the job gets a copy.
+	uint64_t frame_size = 0;
+	Imlib_Image frame_image = NULL;
+	if (img->current_frame > 1) {
+		if (!(frame_image = gr_get_frame_image(img)))
+			return;
+		frame_size = (uint64_t)img->pix_width * img->pix_height * 4;
+	}
+	ScalingParams params;
+	PixelBuffer frame_pixels = {.layout = PIXEL_BGRA,
+				    .width = img->pix_width,
+				    .height = img->pix_height};
+	gr_get_scaling_params(placement,
+			      frame_image ? &frame_pixels : img->original_image,
+			      frame_image ? 1 : img->reduction,
+			      !frame_image && img->opaque, cw, ch, &params);
+	// Pre-scaling is speculative, so it must not push anything else out of
+	// RAM. The scaled image is counted from the moment it's allocated.
+	uint64_t size = (uint64_t)params.scaled_w * params.scaled_h * 4;
+	if (params.scaled_w <= 0 || params.scaled_h <= 0 ||
+	    size > graphics_max_single_image_ram_size ||
+	    images_ram_size + size + frame_size > graphics_max_total_ram_size)
+		return;
+	DecodingJob *job = calloc(1, sizeof(DecodingJob));
+	if (!job)
+		return;
+	job->scaled_image = gr_create_blank_scaled_image(placement, &params);
+	DATA32 *frame_copy = frame_image ? malloc(frame_size) : NULL;
+	if (frame_copy) {
+		imlib_context_set_image(frame_image);
+		memcpy(frame_copy, imlib_image_get_data_for_reading_only(),
+		       frame_size);
+		job->frame = gr_pixbuf_wrap(frame_copy, img->pix_width,
+					    img->pix_height,
+					    img->pix_width * sizeof(DATA32));
+	}
+	if (!job->scaled_image || (frame_image && !job->frame)) {
+		if (job->scaled_image) {
+			imlib_context_set_image(job->scaled_image);
+			imlib_free_image();
 		}
+		gr_pixbuf_free(job->frame);
+		free(job);
+		return;
 	}
+	images_ram_size += frame_size;
+	imlib_context_set_image(job->scaled_image);
+	// The pixels are put back when the job is picked up or freed.
+	job->scaled = imlib_image_get_data();
+	images_ram_size += size;
+	job->img = img;
+	job->placement = placement;
+	job->source = job->frame ? job->frame : img->original_image;
+	job->frame_serial = img->frame_serial;
+	job->params = params;
+	job->filter = MIN(graphics_scaling_filter, SCALING_FILTER_LANCZOS);
+	job->cw = cw;
+	job->ch = ch;
+	GR_LOG("Queueing scaling of placement %u/%u to %dx%d\n",
+	       img->image_id, placement->placement_id, params.scaled_w,
+	       params.scaled_h);
+	placement->scaling_job = job;
+	img->scaling_jobs++;
+	gr_post_decoding_job(job);
 }
 
-/// Loads uncompressed RGB or RGBA image data from a file.
-static void gr_load_raw_pixel_data_uncompressed(DATA32 *data, FILE *file,
-						int format,
-						size_t total_pixels) {
-	unsigned char chunk[BUFSIZ];
-	size_t pixel_size = format == 24 ? 3 : 4;
-	size_t chunk_size_pix = BUFSIZ / 4;
-	size_t chunk_size_bytes = chunk_size_pix * pixel_size;
-	size_t bytes = total_pixels * pixel_size;
-	for (size_t chunk_start_pix = 0; chunk_start_pix < total_pixels;
-	     chunk_start_pix += chunk_size_pix) {
-		size_t read_size = fread(chunk, 1, chunk_size_bytes, file);
-		size_t read_pixels = read_size / pixel_size;
-		if (chunk_start_pix + read_pixels > total_pixels)
-			read_pixels = total_pixels - chunk_start_pix;
-		gr_copy_pixels(data + chunk_start_pix, chunk, format,
-			       read_pixels);
+/// Posts scaling jobs for all placements of the image for the current cell
+/// size.
+static void gr_queue_image_scaling(Image *img) {
+	ImagePlacement *placement = NULL;
+	kh_foreach_value(img->placements, placement, {
+		gr_queue_scaling(placement, current_cw, current_ch);
+	});
+}
+
+/// Creates the scaled image of the placement for the cell size `cw` x `ch`,
+/// replacing the current one.
+static void gr_rescale_placement(ImagePlacement *placement, int cw, int ch) {
+	// Unload the placement first.
+	gr_unload_placement(placement);
+
+	Image *img = placement->image;
+	GR_LOG("Loading placement: %u/%u\n", img->image_id,
+	       placement->placement_id);
+
+	// If the image size is known, we can infer the placement size and
+	// reuse the scaled image of an identical deleted placement without
+	// even loading the original image.
+	if (img->pix_width && img->pix_height && img->frame_count <= 1) {
+		gr_infer_placement_size_maybe(placement);
+		placement->scaled_image =
+			gr_dig_up_scaled_image(placement, cw, ch);
+	}
+
+	if (!placement->scaled_image) {
+		// Don't wait for the image being decoded in the background,
+		// the placement is drawn when it's picked up.
+		if (gr_poll_decoding(img))
+			return;
+		// Load the original image, at a reduced resolution if all
+		// placements are much smaller than the image.
+		gr_load_image_reduced(img, gr_decode_reduction(img, cw, ch));
+		if (!img->original_image)
+			return;
+
+		// Infer the placement size if needed.
+		gr_infer_placement_size_maybe(placement);
+
+		// Create the scaled image.
+		placement->scaled_image =
+			gr_create_scaled_image(placement, cw, ch);
+		if (!placement->scaled_image)
+			return;
 	}
+
+	// Mark the placement as loaded.
+	placement->scaled_ch = ch;
+	placement->scaled_cw = cw;
+	placement->scaled_frame_serial = img->frame_serial;
+	gr_bump_placement_generation(placement);
+	images_ram_size += gr_placement_ram_size(placement);
+
+	// Free up ram if needed, but keep the placement we've loaded no matter
+	// what.
+	placement->protected = 1;
+	gr_check_limits();
+	placement->protected = 0;
 }
 
-#define COMPRESSED_CHUNK_SIZE BUFSIZ
-#define DECOMPRESSED_CHUNK_SIZE (BUFSIZ * 4)
+/// Returns 1 if there is time left in the current frame to load placements
+/// (see `graphics_rescale_budget_ms`).
+static int gr_rescale_budget_left() {
+	return !graphics_rescale_budget_ms ||
+	       rescale_ms_spent < graphics_rescale_budget_ms;
+}
 
-/// Loads compressed RGB or RGBA image data from a file.
-static int gr_load_raw_pixel_data_compressed(DATA32 *data, FILE *file,
-					     int format, size_t total_pixels) {
-	size_t pixel_size = format == 24 ? 3 : 4;
-	unsigned char compressed_chunk[COMPRESSED_CHUNK_SIZE];
-	unsigned char decompressed_chunk[DECOMPRESSED_CHUNK_SIZE];
+/// Stretches the current scaled image of the placement to the cell size `cw` x
+/// `ch` without antialiasing, which is much faster than scaling the original.
+/// Returns 0 on failure.
+static int gr_preview_placement(ImagePlacement *placement, int cw, int ch) {
+	int w = (int)placement->cols * cw;
+	int h = (int)placement->rows * ch;
+	if ((uint64_t)w * h * 4 > graphics_max_single_image_ram_size)
+		return 0;
+	imlib_context_set_image(placement->scaled_image);
+	imlib_context_set_anti_alias(0);
+	Imlib_Image preview = imlib_create_cropped_scaled_image(
+		0, 0, imlib_image_get_width(), imlib_image_get_height(), w, h);
+	imlib_context_set_anti_alias(1);
+	if (!preview)
+		return 0;
+	gr_unload_placement(placement);
+	placement->scaled_image = preview;
+	placement->scaled_cw = cw;
+	placement->scaled_ch = ch;
+	placement->preview = 1;
+	previews_exist = 1;
+	gr_bump_placement_generation(placement);
+	images_ram_size += gr_placement_ram_size(placement);
+	GR_LOG("Showing a preview of placement %u/%u\n",
+	       placement->image->image_id, placement->placement_id);
+	return 1;
+}
 
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.next_out = decompressed_chunk;
-	strm.avail_out = DECOMPRESSED_CHUNK_SIZE;
-	strm.avail_in = 0;
-	strm.next_in = Z_NULL;
-	int ret = inflateInit(&strm);
-	if (ret != Z_OK)
-	    return 1;
+/// Loads the image placement into RAM by creating an imlib object. The in-ram
+/// image is correctly fit to the box defined by the number of rows/columns of
+/// the image placement and the provided cell dimensions in pixels. If the
+/// placement is already loaded, it will be reloaded only if the cell dimensions
+/// or the current frame have changed. Until the new scaled image is created by
+/// a scaling job, or in one of the next frames if it can't be created in the
+/// background and the rescaling budget of the frame is spent, the old one is
+/// shown, stretched as a preview if the cell size changed. Background jobs are not waited for: the
+/// placement stays unloaded or shown as a preview until their results are
+/// picked up.
+static void gr_load_placement(ImagePlacement *placement, int cw, int ch) {
+	// Update the atime uncoditionally.
+	gr_touch_placement(placement);
+	int pending = gr_poll_scaling(placement, cw, ch);
+
+	char stale = placement->scaled_image &&
+		     (placement->scaled_ch != ch || placement->scaled_cw != cw);
+	char old_frame = placement->scaled_image &&
+			 placement->scaled_frame_serial !=
+				 placement->image->frame_serial;
+	// After a cell size or frame change, the exact image is created in
+	// the background if possible. Until then the old one is shown,
+	// stretched if needed.
+	if ((stale || old_frame) && !pending) {
+		gr_queue_scaling(placement, cw, ch);
+		pending = placement->scaling_job != NULL;
+	}
+	if (pending) {
+		if (stale && !gr_preview_placement(placement, cw, ch))
+			gr_unload_placement(placement);
+		return;
+	}
 
-	int error = 0;
-	int progress = 0;
-	size_t total_copied_pixels = 0;
-	while (1) {
-		// If we don't have enough data in the input buffer, try to read
-		// from the file.
-		if (strm.avail_in <= COMPRESSED_CHUNK_SIZE / 4) {
-			// Move the existing data to the beginning.
-			memmove(compressed_chunk, strm.next_in, strm.avail_in);
-			strm.next_in = compressed_chunk;
-			// Read more data.
-			size_t bytes_read = fread(
-				compressed_chunk + strm.avail_in, 1,
-				COMPRESSED_CHUNK_SIZE - strm.avail_in, file);
-			strm.avail_in += bytes_read;
-			if (bytes_read != 0)
-				progress = 1;
-		}
+	// If it's already loaded with the same cw and ch, do nothing, unless
+	// it's a preview and we have time to replace it.
+	if (placement->scaled_image && !stale && !old_frame &&
+	    (!placement->preview || !gr_rescale_budget_left()))
+		return;
+	if (stale && !gr_rescale_budget_left() &&
+	    gr_preview_placement(placement, cw, ch))
+		return;
+	// An outdated frame is shown until there is time to replace it.
+	if (old_frame && !stale && !gr_rescale_budget_left())
+		return;
 
-		// Try to inflate the data.
-		int ret = inflate(&strm, Z_SYNC_FLUSH);
-		if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
-			error = 1;
-			fprintf(stderr,
-				"error: could not decompress the image, error "
-				"%s\n",
-				ret == Z_MEM_ERROR ? "Z_MEM_ERROR"
-						   : "Z_DATA_ERROR");
-			break;
-		}
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	gr_rescale_placement(placement, cw, ch);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	rescale_ms_spent += gr_ms_since(&end, &start);
+}
 
-		// Copy the data from the output buffer to the image.
-		size_t full_pixels =
-			(DECOMPRESSED_CHUNK_SIZE - strm.avail_out) / pixel_size;
-		// Make sure we don't overflow the image.
-		if (full_pixels > total_pixels - total_copied_pixels)
-			full_pixels = total_pixels - total_copied_pixels;
-		if (full_pixels > 0) {
-			// Copy pixels.
-			gr_copy_pixels(data, decompressed_chunk, format,
-				       full_pixels);
-			data += full_pixels;
-			total_copied_pixels += full_pixels;
-			if (total_copied_pixels >= total_pixels) {
-				// We filled the whole image, there may be some
-				// data left, but we just truncate it.
-				break;
-			}
-			// Move the remaining data to the beginning.
-			size_t copied_bytes = full_pixels * pixel_size;
-			size_t leftover =
-				(DECOMPRESSED_CHUNK_SIZE - strm.avail_out) -
-				copied_bytes;
-			memmove(decompressed_chunk,
-				decompressed_chunk + copied_bytes, leftover);
-			strm.next_out -= copied_bytes;
-			strm.avail_out += copied_bytes;
-			progress = 1;
+/// Creates the inverted copy of the scaled image of the placement, which must
+/// already be loaded. The copy is kept until the placement is unloaded, so
+/// drawing reverse cells costs the same as drawing normal ones.
+static void gr_load_placement_reverse(ImagePlacement *placement) {
+	if (!placement->scaled_image || placement->scaled_image_reverse)
+		return;
+	imlib_context_set_image(placement->scaled_image);
+	Imlib_Image reverse = imlib_clone_image();
+	if (!reverse) {
+		fprintf(stderr, "error: could not clone placement %u/%u\n",
+			placement->image->image_id, placement->placement_id);
+		return;
+	}
+	imlib_context_set_image(reverse);
+	int w = imlib_image_get_width();
+	int h = imlib_image_get_height();
+	DATA32 *data = imlib_image_get_data();
+	// Invert the color channels, leave alpha alone. Premultiplied channels
+	// are inverted relative to the alpha. These loops are trivially
+	// vectorized by the compiler.
+	size_t num_pixels = (size_t)w * h;
+	if (placement->scaled_opaque) {
+		for (size_t i = 0; i < num_pixels; ++i)
+			data[i] ^= 0x00FFFFFF;
+	} else {
+		for (size_t i = 0; i < num_pixels; ++i) {
+			DATA32 p = data[i];
+			data[i] = (p & 0xFF000000) |
+				  ((p >> 24) * 0x010101 - (p & 0x00FFFFFF));
 		}
-
-		// If we haven't made any progress, then we have reached the end
-		// of both the file and the inflated data.
-		if (!progress)
-			break;
-		progress = 0;
 	}
+	imlib_image_put_back_data(data);
 
-	inflateEnd(&strm);
-	return error;
+	placement->scaled_image_reverse = reverse;
+	images_ram_size += gr_scaled_image_ram_size(placement);
+
+	// Free up ram if needed, but keep this placement.
+	placement->protected = 1;
+	gr_check_limits();
+	placement->protected = 0;
 }
 
-#undef COMPRESSED_CHUNK_SIZE
-#undef DECOMPRESSED_CHUNK_SIZE
+////////////////////////////////////////////////////////////////////////////////
+// Progressive display of images that are being uploaded.
+////////////////////////////////////////////////////////////////////////////////
 
-/// Load the image from a file containing raw pixel data (RGB or RGBA), the data
-/// may be compressed.
-static Imlib_Image gr_load_raw_pixel_data(Image *img,
-					  const char *filename) {
-	size_t total_pixels = img->pix_width * img->pix_height;
-	if (total_pixels * 4 > graphics_max_single_image_ram_size) {
-		fprintf(stderr,
-			"error: image %u is too big too load: %zu > %u\n",
-			img->image_id, total_pixels * 4,
-			graphics_max_single_image_ram_size);
-		return NULL;
+/// Starts decoding the pixels of a direct upload as they arrive if the image is
+/// uncompressed raw pixel data of known size. Other formats are displayed only
+/// when the upload is finished.
+static void gr_progressive_start(Image *img) {
+	if (!graphics_progressive_redraw_interval_ms || img->query_id ||
+	    img->compression || (img->format != 24 && img->format != 32) ||
+	    img->pix_width <= 0 || img->pix_height <= 0 ||
+	    (uint64_t)img->pix_width * img->pix_height * 4 >
+		    graphics_max_single_image_ram_size)
+		return;
+	// The rows that haven't arrived yet are transparent. The pixels are
+	// compacted when the upload is finished.
+	img->original_image =
+		gr_pixbuf_new(PIXEL_BGRA, img->pix_width, img->pix_height,
+			      img->pix_width * sizeof(DATA32));
+	if (!img->original_image)
+		return;
+	img->opaque = 0;
+	images_ram_size += gr_image_ram_size(img);
+
+	img->progressive = 1;
+	img->progressive_pixels = 0;
+	img->progressive_partial_size = 0;
+	img->progressive_rows_shown = 0;
+	clock_gettime(CLOCK_MONOTONIC, &img->progressive_refresh_time);
+	GR_LOG("Image %u will be displayed progressively\n", img->image_id);
+}
+
+/// Decodes a chunk of raw pixel data of a progressively uploaded image into
+/// `original_image`. A pixel may be split between two chunks.
+static void gr_progressive_append(Image *img, unsigned char *data,
+				  size_t size) {
+	if (!img->progressive)
+		return;
+	size_t total_pixels = (size_t)img->pix_width * img->pix_height;
+	size_t pixel_size = img->format == 24 ? 3 : 4;
+	DATA32 *pixels = (DATA32 *)img->original_image->data;
+
+	// Complete the pixel left over from the previous chunk.
+	if (img->progressive_partial_size) {
+		size_t missing = pixel_size - img->progressive_partial_size;
+		size_t n = MIN(missing, size);
+		memcpy(img->progressive_partial + img->progressive_partial_size,
+		       data, n);
+		img->progressive_partial_size += n;
+		data += n;
+		size -= n;
+		if (n < missing)
+			return;
+		if (img->progressive_pixels < total_pixels)
+			gr_copy_pixels(pixels + img->progressive_pixels++,
+				       img->progressive_partial, img->format, 1);
+		img->progressive_partial_size = 0;
 	}
 
-	FILE* file = fopen(filename, "rb");
-	if (!file) {
-		fprintf(stderr,
-			"error: could not open image file: %s\n",
-			sanitized_filename(filename));
-		return NULL;
+	// Copy whole pixels, ignoring anything beyond the end of the image.
+	size_t num_pixels = MIN(size / pixel_size,
+				total_pixels - img->progressive_pixels);
+	gr_copy_pixels(pixels + img->progressive_pixels, data, img->format,
+		       num_pixels);
+	img->progressive_pixels += num_pixels;
+	size_t rest = size - num_pixels * pixel_size;
+	if (rest < pixel_size) {
+		memcpy(img->progressive_partial, data + num_pixels * pixel_size,
+		       rest);
+		img->progressive_partial_size = rest;
 	}
+}
 
-	Imlib_Image image = imlib_create_image(img->pix_width, img->pix_height);
-	if (!image) {
-		fprintf(stderr,
-			"error: could not create an image of size %d x %d\n",
-			img->pix_width, img->pix_height);
-		fclose(file);
-		return NULL;
+/// Redraws the part of the scaled image of the placement corresponding to the
+/// source rows from `row_start` to `row_end` (exclusive).
+static void gr_progressive_update_placement(ImagePlacement *placement,
+					    int row_start, int row_end) {
+	int src_y = placement->src_pix_y;
+	int src_h = placement->src_pix_height;
+	if (!placement->scaled_image || src_h <= 0 ||
+	    placement->src_pix_width <= 0)
+		return;
+	// Redraw one more row above, otherwise the scaler would leave a seam
+	// between the bands.
+	row_start = MAX(row_start - 1, src_y);
+	row_end = MIN(row_end, src_y + src_h);
+	if (row_start >= row_end)
+		return;
+
+	int scaled_w = (int)placement->cols * placement->scaled_cw;
+	int scaled_h = (int)placement->rows * placement->scaled_ch;
+	int dest_x, dest_y, dest_w, dest_h;
+	gr_get_scaled_dest_rect(placement, scaled_w, scaled_h, &dest_x, &dest_y,
+				&dest_w, &dest_h);
+	int band_start =
+		dest_y + (int64_t)(row_start - src_y) * dest_h / src_h;
+	int band_end = dest_y + ((int64_t)(row_end - src_y) * dest_h +
+				 src_h - 1) / src_h;
+	if (band_start >= band_end)
+		return;
+
+	// The inverted copy, the pictures and the atlas copy are outdated now.
+	gr_drop_scaled_image_copies(placement);
+
+	// The rows are still in the BGRA layout, so they are not copied.
+	PixelBuffer *original = placement->image->original_image;
+	Imlib_Image rows = gr_pixbuf_to_imlib(original, 0, row_start,
+					      original->width,
+					      row_end - row_start);
+	if (!rows)
+		return;
+	imlib_context_set_image(placement->scaled_image);
+	imlib_context_set_blend(0);
+	imlib_context_set_color(0, 0, 0, 0);
+	imlib_image_fill_rectangle(dest_x, band_start, dest_w,
+				   band_end - band_start);
+	imlib_context_set_anti_alias(1);
+	imlib_context_set_blend(1);
+	imlib_blend_image_onto_image(rows, 1, placement->src_pix_x, 0,
+				     placement->src_pix_width,
+				     row_end - row_start, dest_x, band_start,
+				     dest_w, band_end - band_start);
+	imlib_context_set_image(rows);
+	imlib_free_image();
+	// Imlib produces straight alpha, but scaled images are premultiplied.
+	imlib_context_set_image(placement->scaled_image);
+	DATA32 *data = imlib_image_get_data();
+	for (int y = MAX(band_start, 0); y < MIN(band_end, scaled_h); ++y) {
+		int x0 = MAX(dest_x, 0);
+		int x1 = MIN(dest_x + dest_w, scaled_w);
+		if (x0 < x1)
+			gr_premultiply(data + (size_t)y * scaled_w + x0,
+				       x1 - x0);
 	}
+	imlib_image_put_back_data(data);
+	gr_bump_placement_generation(placement);
+}
 
-	imlib_context_set_image(image);
-	imlib_image_set_has_alpha(1);
-	DATA32* data = imlib_image_get_data();
+/// Propagates the rows decoded since the last call to the loaded placements of
+/// the image and requests a redraw. Does nothing if the previous update was
+/// less than `graphics_progressive_redraw_interval_ms` ago, so that a fast
+/// upload doesn't cause a redraw per chunk.
+static void gr_progressive_refresh(Image *img) {
+	if (!img->progressive)
+		return;
+	int rows = img->progressive_pixels / img->pix_width;
+	if (rows <= img->progressive_rows_shown)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (gr_ms_since(&now, &img->progressive_refresh_time) <
+	    graphics_progressive_redraw_interval_ms)
+		return;
+	ImagePlacement *placement = NULL;
+	kh_foreach_value(img->placements, placement, {
+		gr_progressive_update_placement(
+			placement, img->progressive_rows_shown, rows);
+	});
+	GR_LOG("Image %u: rows %d-%d have arrived\n", img->image_id,
+	       img->progressive_rows_shown, rows);
+	img->progressive_rows_shown = rows;
+	img->progressive_refresh_time = now;
+	graphics_command_result.redraw = 1;
+}
 
-	if (img->compression == 0) {
-		gr_load_raw_pixel_data_uncompressed(data, file, img->format,
-						    total_pixels);
-	} else {
-		int ret = gr_load_raw_pixel_data_compressed(
-			data, file, img->format, total_pixels);
-		if (ret != 0) {
-			imlib_image_put_back_data(data);
-			imlib_free_image();
-			fclose(file);
-			return NULL;
-		}
+/// Ends progressive decoding of the image. If all pixels have arrived and the
+/// upload succeeded, the decoded image is kept as the loaded original,
+/// otherwise it's discarded. In both cases placements are rescaled from
+/// scratch on the next redraw.
+static void gr_progressive_finish(Image *img) {
+	if (!img->progressive)
+		return;
+	img->progressive = 0;
+	if (img->status == STATUS_UPLOADING_SUCCESS &&
+	    img->progressive_pixels ==
+		    (size_t)img->pix_width * img->pix_height) {
+		img->status = STATUS_RAM_LOADING_SUCCESS;
+		images_ram_size -= gr_image_ram_size(img);
+		img->original_image = gr_pixbuf_compact(img->original_image);
+		images_ram_size += gr_image_ram_size(img);
+		img->opaque = gr_pixbuf_is_opaque(img->original_image);
+	} else {
+		gr_unload_image(img);
 	}
+	ImagePlacement *placement = NULL;
+	kh_foreach_value(img->placements, placement, {
+		gr_unload_placement(placement);
+	});
+	graphics_command_result.redraw = 1;
+}
 
-	fclose(file);
-	imlib_image_put_back_data(data);
-	return image;
+////////////////////////////////////////////////////////////////////////////////
+// Sprite atlases.
+//
+// Small opaque placements are copied to shared server-side pixmaps once, and
+// then drawn with `XCopyArea`, which doesn't transfer any pixels over the
+// connection. Space is allocated with a simple shelf packer.
+////////////////////////////////////////////////////////////////////////////////
+
+/// Returns whether `placement` is small enough to be put into an atlas.
+static int gr_atlas_fits(ImagePlacement *placement) {
+	int w = placement->cols * placement->scaled_cw;
+	int h = placement->rows * placement->scaled_ch;
+	return w > 0 && h > 0 && w <= graphics_atlas_max_item_size &&
+	       h <= graphics_atlas_max_item_size && w <= ATLAS_SIZE &&
+	       h <= ATLAS_SIZE;
 }
 
-/// Loads the original image into RAM by creating an imlib object. If the
-/// placement is already loaded,  does nothing. Loading may fail, in which case
-/// the status of the image will be set to STATUS_RAM_LOADING_ERROR.
-static void gr_load_image(Image *img) {
-	if (img->original_image)
+/// Removes the placement from its atlas (the space is not reused until the
+/// atlas becomes empty or is evicted).
+static void gr_atlas_release(ImagePlacement *placement) {
+	if (!placement->atlas)
 		return;
+	Atlas *atlas = &atlases[placement->atlas - 1];
+	// Move the last item to the place of the released one.
+	ImagePlacement *last = atlas->items[atlas->item_count - 1];
+	atlas->items[placement->atlas_item] = last;
+	last->atlas_item = placement->atlas_item;
+	atlas->item_count--;
+	placement->atlas = 0;
+	// If the atlas is empty, all its space can be reused.
+	if (atlas->item_count == 0) {
+		atlas->shelf_count = 0;
+		atlas->next_shelf_y = 0;
+	}
+}
 
-	// If the image is uninitialized or uploading has failed, or the file
-	// has been deleted, we cannot load the image.
-	if (img->status < STATUS_UPLOADING_SUCCESS)
-		return;
-	if (img->disk_size == 0) {
-		if (img->status != STATUS_RAM_LOADING_ERROR) {
-			fprintf(stderr,
-				"error: cached image was deleted: %u\n",
-				img->image_id);
+/// Evicts all placements from the atlas and resets it.
+static void gr_atlas_clear(Atlas *atlas) {
+	while (atlas->item_count)
+		gr_atlas_release(atlas->items[atlas->item_count - 1]);
+}
+
+/// Tries to allocate a `w` x `h` rectangle in the atlas. Returns 1 on success.
+static int gr_atlas_alloc(Atlas *atlas, int w, int h, int *x, int *y) {
+	// Find the shelf with the least height that fits the rectangle, but
+	// don't put the rectangle on a shelf that's much higher than it.
+	AtlasShelf *best = NULL;
+	for (int i = 0; i < atlas->shelf_count; ++i) {
+		AtlasShelf *shelf = &atlas->shelves[i];
+		if (shelf->height < h || shelf->height > h + h / 2 ||
+		    shelf->used_width + w > ATLAS_SIZE)
+			continue;
+		if (!best || shelf->height < best->height)
+			best = shelf;
+	}
+	// Otherwise start a new shelf.
+	if (!best) {
+		if (atlas->next_shelf_y + h > ATLAS_SIZE)
+			return 0;
+		if (atlas->shelf_count == atlas->shelf_capacity) {
+			atlas->shelf_capacity = atlas->shelf_capacity
+							? atlas->shelf_capacity * 2
+							: 16;
+			atlas->shelves =
+				realloc(atlas->shelves,
+					atlas->shelf_capacity * sizeof(AtlasShelf));
 		}
-		img->status = STATUS_RAM_LOADING_ERROR;
-		return;
+		best = &atlas->shelves[atlas->shelf_count++];
+		best->y = atlas->next_shelf_y;
+		best->height = h;
+		best->used_width = 0;
+		atlas->next_shelf_y += h;
+	}
+	*x = best->used_width;
+	*y = best->y;
+	best->used_width += w;
+	return 1;
+}
+
+/// Tries to put the loaded placement into an atlas. Returns 1 if the placement
+/// is in an atlas after this call.
+static int gr_atlas_add(Drawable buf, ImagePlacement *placement) {
+	if (placement->atlas)
+		return 1;
+	if (placement->atlas_ineligible || !graphics_atlas_max_item_size ||
+	    !placement->scaled_image)
+		return 0;
+	// Placements with transparent pixels can't be drawn with `XCopyArea`.
+	if (!gr_atlas_fits(placement) || !placement->scaled_opaque) {
+		placement->atlas_ineligible = 1;
+		return 0;
 	}
+	int w = placement->cols * placement->scaled_cw;
+	int h = placement->rows * placement->scaled_ch;
+	Display *disp = imlib_context_get_display();
 
-	// Load the original image.
-	char filename[MAX_FILENAME_SIZE];
-	gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
-	GR_LOG("Loading image: %s\n", sanitized_filename(filename));
-	if (img->format == 100 || img->format == 0) {
-		img->original_image = imlib_load_image(filename);
-		if (img->original_image) {
-			// If imlib loading succeeded, set the information about
-			// the original image size.
-			imlib_context_set_image(img->original_image);
-			img->pix_width = imlib_image_get_width();
-			img->pix_height = imlib_image_get_height();
+	// Try the existing atlases, creating new ones if needed. If all atlases
+	// are full, evict the one with the fewest items.
+	Atlas *atlas = NULL;
+	int x, y;
+	for (int i = 0; i < MAX_ATLASES && !atlas; ++i) {
+		if (!atlases[i].pixmap) {
+			atlases[i].pixmap = XCreatePixmap(
+				disp, buf, ATLAS_SIZE, ATLAS_SIZE,
+				DefaultDepth(disp, DefaultScreen(disp)));
+			GR_LOG("Created atlas %d\n", i);
 		}
+		if (gr_atlas_alloc(&atlases[i], w, h, &x, &y))
+			atlas = &atlases[i];
 	}
-	if (img->format == 32 || img->format == 24 ||
-	    (!img->original_image && img->format == 0)) {
-		img->original_image = gr_load_raw_pixel_data(img, filename);
-	}
-	if (!img->original_image) {
-		if (img->status != STATUS_RAM_LOADING_ERROR) {
-			fprintf(stderr, "error: could not load image: %s\n",
-				sanitized_filename(filename));
+	if (!atlas) {
+		Atlas *victim = &atlases[0];
+		for (int i = 1; i < MAX_ATLASES; ++i) {
+			if (atlases[i].item_count < victim->item_count)
+				victim = &atlases[i];
 		}
-		img->status = STATUS_RAM_LOADING_ERROR;
-		return;
+		GR_LOG("Evicting %d placements from atlas %ld\n",
+		       victim->item_count, victim - atlases);
+		gr_atlas_clear(victim);
+		if (!gr_atlas_alloc(victim, w, h, &x, &y))
+			return 0;
+		atlas = victim;
 	}
 
-	images_ram_size += gr_image_ram_size(img);
-	img->status = STATUS_RAM_LOADING_SUCCESS;
-}
+	// Copy the pixels to the atlas.
+	imlib_context_set_anti_alias(0);
+	imlib_context_set_blend(0);
+	imlib_context_set_image(placement->scaled_image);
+	imlib_context_set_drawable(atlas->pixmap);
+	imlib_render_image_on_drawable(x, y);
+	imlib_context_set_blend(1);
 
-/// Loads the image placement into RAM by creating an imlib object. The in-ram
-/// image is correctly fit to the box defined by the number of rows/columns of
-/// the image placement and the provided cell dimensions in pixels. If the
-/// placement is already loaded, it will be reloaded only if the cell dimensions
-/// have changed.
-static void gr_load_placement(ImagePlacement *placement, int cw, int ch) {
-	// Update the atime uncoditionally.
-	gr_touch_placement(placement);
+	// Register the item.
+	if (atlas->item_count == atlas->item_capacity) {
+		atlas->item_capacity =
+			atlas->item_capacity ? atlas->item_capacity * 2 : 64;
+		atlas->items = realloc(atlas->items, atlas->item_capacity *
+							     sizeof(ImagePlacement *));
+	}
+	placement->atlas_item = atlas->item_count;
+	atlas->items[atlas->item_count++] = placement;
+	placement->atlas = atlas - atlases + 1;
+	placement->atlas_x = x;
+	placement->atlas_y = y;
+	return 1;
+}
 
-	// If it's already loaded with the same cw and ch, do nothing.
-	if (placement->scaled_image && placement->scaled_ch == ch &&
-	    placement->scaled_cw == cw)
-		return;
+/// Draws the part of the placement described by `rect` from its atlas. Returns
+/// 0 if the placement is not in an atlas and can't be put there.
+static int gr_atlas_drawimagerect(Drawable buf, ImagePlacement *placement,
+				  ImageRect *rect) {
+	if (rect->reverse || !gr_atlas_add(buf, placement))
+		return 0;
+	Display *disp = imlib_context_get_display();
+	Atlas *atlas = &atlases[placement->atlas - 1];
+	if (!atlas_gc)
+		atlas_gc = XCreateGC(disp, buf, 0, NULL);
+	int w_pix = (rect->end_col - rect->start_col) * rect->cw;
+	int h_pix = (rect->end_row - rect->start_row) * rect->ch;
+	XCopyArea(disp, atlas->pixmap, buf, atlas_gc,
+		  placement->atlas_x + rect->start_col * rect->cw,
+		  placement->atlas_y + rect->start_row * rect->ch, w_pix,
+		  h_pix, rect->x_pix, rect->y_pix);
+	return 1;
+}
 
-	// Unload the placement first.
-	gr_unload_placement(placement);
+/// Frees all atlases.
+static void gr_atlas_deinit(Display *disp) {
+	for (int i = 0; i < MAX_ATLASES; ++i) {
+		Atlas *atlas = &atlases[i];
+		gr_atlas_clear(atlas);
+		if (atlas->pixmap)
+			XFreePixmap(disp, atlas->pixmap);
+		free(atlas->shelves);
+		free(atlas->items);
+		memset(atlas, 0, sizeof(Atlas));
+	}
+	if (atlas_gc) {
+		XFreeGC(disp, atlas_gc);
+		atlas_gc = NULL;
+	}
+}
 
-	Image *img = placement->image;
-	GR_LOG("Loading placement: %u/%u\n", img->image_id,
-	       placement->placement_id);
+////////////////////////////////////////////////////////////////////////////////
+// XRender compositing.
+//
+// Translucent placements are uploaded once to 32-bit pixmaps. Their pixels are
+// already premultiplied, which is what XRender expects, so they are blended by
+// the server with `PictOpOver` without converting or sending them again.
+////////////////////////////////////////////////////////////////////////////////
 
-	// Load the original image.
-	gr_load_image(img);
-	if (!img->original_image)
+/// Checks whether XRender can be used to draw onto windows with the visual.
+static void gr_render_init(Display *disp, Visual *vis) {
+	int event_base, error_base;
+	render_available = 0;
+	if (!XRenderQueryExtension(disp, &event_base, &error_base)) {
+		GR_LOG("XRender extension is not available\n");
 		return;
+	}
+	render_argb_format = XRenderFindStandardFormat(disp, PictStandardARGB32);
+	render_dest_format = XRenderFindVisualFormat(disp, vis);
+	render_available = render_argb_format && render_dest_format;
+}
 
-	// Infer the placement size if needed.
-	gr_infer_placement_size_maybe(placement);
-
-	// Create the scaled image.
-	int scaled_w = (int)placement->cols * cw;
-	int scaled_h = (int)placement->rows * ch;
-	if (scaled_w * scaled_h * 4 > graphics_max_single_image_ram_size) {
-		fprintf(stderr,
-			"error: placement %u/%u would be too big to load: %d x "
-			"%d x 4 > %u\n",
-			img->image_id, placement->placement_id, scaled_w,
-			scaled_h, graphics_max_single_image_ram_size);
-		return;
+/// Frees the XRender pictures of the placement.
+static void gr_render_release(ImagePlacement *placement) {
+	Display *disp = imlib_context_get_display();
+	if (placement->picture) {
+		XRenderFreePicture(disp, placement->picture);
+		images_ram_size -= gr_scaled_image_ram_size(placement);
+		placement->picture = None;
 	}
-	placement->scaled_image = imlib_create_image(scaled_w, scaled_h);
-	if (!placement->scaled_image) {
-		fprintf(stderr,
-			"error: imlib_create_image(%d, %d) returned "
-			"null\n",
-			scaled_w, scaled_h);
-		return;
+	if (placement->picture_reverse) {
+		XRenderFreePicture(disp, placement->picture_reverse);
+		images_ram_size -= gr_scaled_image_ram_size(placement);
+		placement->picture_reverse = None;
 	}
-	imlib_context_set_image(placement->scaled_image);
-	imlib_image_set_has_alpha(1);
-
-	// First fill the scaled image with the transparent color.
-	imlib_context_set_blend(0);
-	imlib_context_set_color(0, 0, 0, 0);
-	imlib_image_fill_rectangle(0, 0, (int)placement->cols * cw,
-				   (int)placement->rows * ch);
-	imlib_context_set_anti_alias(1);
-	imlib_context_set_blend(1);
+}
 
-	// The source rectangle.
-	int src_x = placement->src_pix_x;
-	int src_y = placement->src_pix_y;
-	int src_w = placement->src_pix_width;
-	int src_h = placement->src_pix_height;
-	// Whether the box is too small to use the true size of the image.
-	char box_too_small = scaled_w < src_w || scaled_h < src_h;
-	char mode = placement->scale_mode;
+/// Uploads the (possibly inverted) scaled image of the placement to a new
+/// picture. Returns None on failure.
+static Picture gr_render_create_picture(Drawable buf,
+					ImagePlacement *placement,
+					int reverse) {
+	Display *disp = imlib_context_get_display();
+	imlib_context_set_image(reverse ? placement->scaled_image_reverse
+					: placement->scaled_image);
+	int w = imlib_image_get_width();
+	int h = imlib_image_get_height();
+	// This is the limit of the protocol.
+	if (w > 32767 || h > 32767)
+		return None;
+	DATA32 *data = imlib_image_get_data_for_reading_only();
+	XImage *ximage = XCreateImage(disp, NULL, 32, ZPixmap, 0, (char *)data,
+				      w, h, 32, w * sizeof(DATA32));
+	if (!ximage)
+		return None;
+	// The pixels are in the host byte order, Xlib swaps them if the server
+	// uses the other one.
+	const uint32_t one = 1;
+	ximage->byte_order = *(const char *)&one ? LSBFirst : MSBFirst;
+	Pixmap pixmap = XCreatePixmap(disp, buf, w, h, 32);
+	if (!render_gc)
+		render_gc = XCreateGC(disp, pixmap, 0, NULL);
+	XPutImage(disp, pixmap, render_gc, ximage, 0, 0, 0, 0, w, h);
+	ximage->data = NULL;
+	XDestroyImage(ximage);
+	// The picture keeps the pixmap alive.
+	Picture picture =
+		XRenderCreatePicture(disp, pixmap, render_argb_format, 0, NULL);
+	XFreePixmap(disp, pixmap);
+	return picture;
+}
 
-	// Then blend the original image onto the transparent background.
-	if (src_w <= 0 || src_h <= 0) {
-		fprintf(stderr, "warning: image of zero size\n");
-	} else if (mode == SCALE_MODE_FILL) {
-		imlib_blend_image_onto_image(img->original_image, 1, src_x,
-					     src_y, src_w, src_h, 0, 0,
-					     scaled_w, scaled_h);
-	} else if (mode == SCALE_MODE_NONE ||
-		   (mode == SCALE_MODE_NONE_OR_CONTAIN && !box_too_small)) {
-		imlib_blend_image_onto_image(img->original_image, 1, src_x,
-					     src_y, src_w, src_h, 0, 0, src_w,
-					     src_h);
-	} else {
-		if (mode != SCALE_MODE_CONTAIN &&
-		    mode != SCALE_MODE_NONE_OR_CONTAIN) {
-			fprintf(stderr,
-				"warning: unknown scale mode %u, using "
-				"'contain' instead\n",
-				mode);
-		}
-		int dest_x, dest_y;
-		int dest_w, dest_h;
-		if (scaled_w * src_h > src_w * scaled_h) {
-			// If the box is wider than the original image, fit to
-			// height.
-			dest_h = scaled_h;
-			dest_y = 0;
-			dest_w = src_w * scaled_h / src_h;
-			dest_x = (scaled_w - dest_w) / 2;
-		} else {
-			// Otherwise, fit to width.
-			dest_w = scaled_w;
-			dest_x = 0;
-			dest_h = src_h * scaled_w / src_w;
-			dest_y = (scaled_h - dest_h) / 2;
-		}
-		imlib_blend_image_onto_image(img->original_image, 1, src_x,
-					     src_y, src_w, src_h, dest_x,
-					     dest_y, dest_w, dest_h);
+/// Composites the part of the translucent placement described by `rect` with
+/// XRender. Returns 0 if XRender can't be used, in which case the caller should
+/// fall back to imlib rendering.
+static int gr_render_drawimagerect(Drawable buf, ImagePlacement *placement,
+				   ImageRect *rect) {
+	if (!render_available || placement->scaled_opaque)
+		return 0;
+	Display *disp = imlib_context_get_display();
+	Picture *picture = rect->reverse ? &placement->picture_reverse
+					 : &placement->picture;
+	if (!*picture) {
+		*picture =
+			gr_render_create_picture(buf, placement, rect->reverse);
+		if (!*picture)
+			return 0;
+		images_ram_size += gr_scaled_image_ram_size(placement);
+		// Free up ram if needed, but keep this placement.
+		char was_protected = placement->protected;
+		placement->protected = 1;
+		gr_check_limits();
+		placement->protected = was_protected;
 	}
+	if (!render_dest)
+		render_dest = XRenderCreatePicture(disp, buf,
+						   render_dest_format, 0, NULL);
+	int w_pix = (rect->end_col - rect->start_col) * rect->cw;
+	int h_pix = (rect->end_row - rect->start_row) * rect->ch;
+	XRenderComposite(disp, PictOpOver, *picture, None, render_dest,
+			 rect->start_col * rect->cw, rect->start_row * rect->ch,
+			 0, 0, rect->x_pix, rect->y_pix, w_pix, h_pix);
+	return 1;
+}
 
-	// Mark the placement as loaded.
-	placement->scaled_ch = ch;
-	placement->scaled_cw = cw;
-	images_ram_size += gr_placement_ram_size(placement);
+/// Frees the picture of the drawable at the end of a frame.
+static void gr_render_finish_drawing() {
+	if (!render_dest)
+		return;
+	XRenderFreePicture(imlib_context_get_display(), render_dest);
+	render_dest = None;
+}
 
-	// Free up ram if needed, but keep the placement we've loaded no matter
-	// what.
-	placement->protected = 1;
-	gr_check_limits();
-	placement->protected = 0;
+/// Frees the objects used for XRender compositing. The pictures of placements
+/// must be freed before.
+static void gr_render_deinit(Display *disp) {
+	gr_render_finish_drawing();
+	if (render_gc) {
+		XFreeGC(disp, render_gc);
+		render_gc = NULL;
+	}
+	render_available = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1218,12 +5269,18 @@ void gr_init(Display *disp, Visual *vis, Colormap cm) {
 	// for us since we reuse file names. Disable caching.
 	imlib_set_cache_size(0);
 
-	// Prepare for color inversion.
-	for (size_t i = 0; i < 256; ++i)
-		reverse_table[i] = 255 - i;
+	// Check whether translucent images can be blended by the server.
+	gr_render_init(disp, vis);
 
 	// Create data structures.
 	images = kh_init(id2image);
+	image_rect_buckets = kh_init(rectbucket);
+
+	// The kernels are chosen before the decoding threads may use them.
+	const char *kernels = gr_resample_init_kernels();
+	GR_LOG("Scaling kernels: %s\n", kernels);
+
+	gr_start_decoding_threads();
 
 	atexit(gr_deinit);
 }
@@ -1232,13 +5289,24 @@ void gr_init(Display *disp, Visual *vis, Colormap cm) {
 void gr_deinit() {
 	if (!images)
 		return;
-	// Delete all images.
+	// Stop the decoding threads before deleting the images they decode.
+	gr_stop_decoding_threads();
+	// Delete all images and the segments of the disk cache.
 	gr_delete_all_images();
+	gr_delete_all_segments();
+	// Release the atlases and the XRender objects.
+	gr_atlas_deinit(imlib_context_get_display());
+	gr_render_deinit(imlib_context_get_display());
 	// Remove the cache dir.
 	remove(cache_dir);
 	// Destroy the data structures.
 	kh_destroy(id2image, images);
 	images = NULL;
+	kh_destroy(rectbucket, image_rect_buckets);
+	image_rect_buckets = NULL;
+	free(image_rects);
+	image_rects = NULL;
+	image_rects_count = image_rects_capacity = 0;
 }
 
 /// Executes `command` with the name of the file corresponding to `image_id` as
@@ -1250,7 +5318,7 @@ void gr_preview_image(uint32_t image_id, const char *exec) {
 	if (img) {
 		char filename[MAX_FILENAME_SIZE];
 		gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
-		if (img->disk_size == 0) {
+		if (img->disk_size == 0 || !gr_unpack_image(img)) {
 			len = snprintf(command, 255,
 				       "xmessage 'Image with id=%u is not "
 				       "fully copied to %s'",
@@ -1337,6 +5405,25 @@ void gr_dump_state() {
 		images_ram_size / 1024);
 	fprintf(stderr, "Estimated Disk usage: %ld KiB\n",
 		images_disk_size / 1024);
+	int job_count = 0, scaling_job_count = 0;
+	pthread_mutex_lock(&decoding_mutex);
+	for (DecodingJob *job = decoding_jobs; job; job = job->next) {
+		job_count++;
+		scaling_job_count += job->scaled != NULL;
+	}
+	pthread_mutex_unlock(&decoding_mutex);
+	fprintf(stderr, "Decoding jobs: %d (scaling: %d), threads: %d\n",
+		job_count, scaling_job_count, decoding_thread_count);
+	int64_t cache_dead_size_computed = 0;
+	for (int i = 0; i < MAX_CACHE_SEGMENTS; ++i) {
+		CacheSegment *seg = &cache_segments[i];
+		if (!seg->map)
+			continue;
+		fprintf(stderr, "Cache segment %d%s: %u KiB used, %u KiB dead\n",
+			i, i == active_cache_segment ? " (active)" : "",
+			seg->used / 1024, seg->dead / 1024);
+		cache_dead_size_computed += seg->dead;
+	}
 
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
@@ -1364,7 +5451,10 @@ void gr_dump_state() {
 			img->pix_height);
 		char filename[MAX_FILENAME_SIZE];
 		gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
-		if (access(filename, F_OK) != -1)
+		if (img->segment)
+			fprintf(stderr, "    packed into segment %d at %u\n",
+				img->segment - 1, img->segment_offset);
+		else if (access(filename, F_OK) != -1)
 			fprintf(stderr, "    file: %s\n",
 				sanitized_filename(filename));
 		else
@@ -1374,12 +5464,32 @@ void gr_dump_state() {
 		images_disk_size_computed += img->disk_size;
 		if (img->original_image) {
 			unsigned ram_size = gr_image_ram_size(img);
-			fprintf(stderr, "    loaded into ram, size: %d KiB\n",
+			fprintf(stderr,
+				"    loaded into ram as %s, size: %d KiB\n",
+				pixel_layout_strings[img->original_image->layout],
 				ram_size / 1024);
+			if (img->reduction > 1)
+				fprintf(stderr, "    decoded at 1/%d of its size\n",
+					img->reduction);
 			images_ram_size_computed += ram_size;
 		} else {
 			fprintf(stderr, "    not loaded into ram\n");
 		}
+		if (img->frame_count > 1) {
+			unsigned frames_ram_size = 0;
+			for (int i = 0; i < img->frame_count; ++i)
+				frames_ram_size +=
+					gr_frame_ram_size(&img->frames[i]);
+			fprintf(stderr,
+				"    frames: %d, current %d, state %d, "
+				"size: %u KiB\n",
+				img->frame_count, img->current_frame,
+				img->animation_state, frames_ram_size / 1024);
+			images_ram_size_computed += frames_ram_size;
+		}
+		if (img->frame_image)
+			images_ram_size_computed +=
+				gr_frame_image_ram_size(img);
 		fprintf(stderr, "    default_placement = %u\n",
 			img->default_placement);
 		kh_foreach_value(img->placements, placement, {
@@ -1406,12 +5516,31 @@ void gr_dump_state() {
 				fprintf(stderr, "        cell size: %ux%u\n",
 					placement->scaled_cw,
 					placement->scaled_ch);
+				if (placement->scaled_image_reverse)
+					fprintf(stderr,
+						"        inverted copy loaded\n");
+				if (placement->atlas)
+					fprintf(stderr,
+						"        in atlas %d at %d, %d\n",
+						placement->atlas - 1,
+						placement->atlas_x,
+						placement->atlas_y);
 			} else {
 				fprintf(stderr,
 					"        not loaded into ram\n");
 			}
 		});
 	});
+	int tombstone_count = 0;
+	for (int i = 0; i < MAX_TOMBSTONES; ++i) {
+		if (tombstones[i].image_id) {
+			tombstone_count++;
+			images_ram_size_computed += tombstones[i].ram_size;
+		}
+	}
+	fprintf(stderr, "----------------\n");
+	fprintf(stderr, "Scaled images of deleted placements: %d\n",
+		tombstone_count);
 	if (images_ram_size != images_ram_size_computed) {
 		fprintf(stderr,
 			"WARNING: images_ram_size is %ld, but computed value "
@@ -1424,6 +5553,12 @@ void gr_dump_state() {
 			"is %ld\n",
 			images_disk_size, images_disk_size_computed);
 	}
+	if (cache_dead_size != cache_dead_size_computed) {
+		fprintf(stderr,
+			"WARNING: cache_dead_size is %ld, but computed value "
+			"is %ld\n",
+			cache_dead_size, cache_dead_size_computed);
+	}
 	fprintf(stderr, "============================================\n");
 }
 
@@ -1467,6 +5602,83 @@ static void gr_showrect(Drawable buf, ImageRect *rect) {
 	XFreeGC(disp, gc);
 }
 
+/// Draws the given part of a loaded placement using imlib (pixels are sent
+/// through the X connection).
+static void gr_imlib_drawimagerect(Drawable buf, ImagePlacement *placement,
+				   ImageRect *rect) {
+	imlib_context_set_anti_alias(0);
+	imlib_context_set_image(rect->reverse ? placement->scaled_image_reverse
+					      : placement->scaled_image);
+	imlib_context_set_drawable(buf);
+	int w_pix = (rect->end_col - rect->start_col) * rect->cw;
+	int h_pix = (rect->end_row - rect->start_row) * rect->ch;
+	if (placement->scaled_opaque) {
+		// Opaque pixels are the same premultiplied, copy them.
+		imlib_context_set_blend(0);
+		imlib_render_image_part_on_drawable_at_size(
+			rect->start_col * rect->cw, rect->start_row * rect->ch,
+			w_pix, h_pix, rect->x_pix, rect->y_pix, w_pix, h_pix);
+		imlib_context_set_blend(1);
+		return;
+	}
+	// Imlib blends straight alpha, so convert a copy of the drawn part.
+	Imlib_Image part = imlib_create_cropped_image(
+		rect->start_col * rect->cw, rect->start_row * rect->ch, w_pix,
+		h_pix);
+	if (!part)
+		return;
+	imlib_context_set_image(part);
+	DATA32 *data = imlib_image_get_data();
+	gr_unpremultiply(data, (size_t)imlib_image_get_width() *
+				       imlib_image_get_height());
+	imlib_image_put_back_data(data);
+	imlib_render_image_on_drawable(rect->x_pix, rect->y_pix);
+	imlib_free_image();
+}
+
+static void gr_drawimagerect(Drawable buf, ImageRect *rect);
+
+/// Draws the parts of the placements covered by `placement` that are visible
+/// through the cells of `rect`, lowest z-index first. Nothing is drawn (or
+/// even loaded) if `placement` is opaque.
+static void gr_draw_underlays(Drawable buf, ImagePlacement *placement,
+			      ImageRect *rect) {
+	static int depth = 0;
+	if (!placement->underlay_count || depth >= MAX_UNDERLAY_DEPTH ||
+	    gr_placement_is_opaque(placement))
+		return;
+	depth++;
+	for (int i = 0; i < placement->underlay_count; ++i) {
+		Underlay *underlay = &placement->underlays[i];
+		ImagePlacement *under = gr_underlay_placement(underlay);
+		if (!under)
+			continue;
+		// Intersect the rect (in the cells of the covered placement)
+		// with the covered placement.
+		int start_col = MAX(rect->start_col + underlay->dcol, 0);
+		int end_col = MIN(rect->end_col + underlay->dcol,
+				  (int)under->cols);
+		int start_row = MAX(rect->start_row + underlay->drow, 0);
+		int end_row = MIN(rect->end_row + underlay->drow,
+				  (int)under->rows);
+		if (start_col >= end_col || start_row >= end_row)
+			continue;
+		ImageRect under_rect = *rect;
+		under_rect.image_id = underlay->image_id;
+		under_rect.placement_id = underlay->placement_id;
+		under_rect.start_col = start_col;
+		under_rect.end_col = end_col;
+		under_rect.start_row = start_row;
+		under_rect.end_row = end_row;
+		under_rect.x_pix = rect->x_pix + (start_col - underlay->dcol -
+						  rect->start_col) * rect->cw;
+		under_rect.y_pix = rect->y_pix + (start_row - underlay->drow -
+						  rect->start_row) * rect->ch;
+		gr_drawimagerect(buf, &under_rect);
+	}
+	depth--;
+}
+
 /// Draws the given part of an image.
 static void gr_drawimagerect(Drawable buf, ImageRect *rect) {
 	ImagePlacement *placement =
@@ -1483,34 +5695,42 @@ static void gr_drawimagerect(Drawable buf, ImageRect *rect) {
 	// Load the image.
 	gr_load_placement(placement, rect->cw, rect->ch);
 
-	// If the image couldn't be loaded, display the bounding box.
+	// If the image couldn't be loaded, display the bounding box. If it's
+	// still being decoded or scaled in the background, leave the cells empty
+	// until the result is picked up.
 	if (!placement->scaled_image) {
-		gr_showrect(buf, rect);
+		char pending =
+			placement->scaling_job || placement->image->decoding_job;
+		if (!pending ||
+		    graphics_debug_mode == GRAPHICS_DEBUG_LOG_AND_BOXES)
+			gr_showrect(buf, rect);
 		if (graphics_debug_mode == GRAPHICS_DEBUG_LOG_AND_BOXES)
 			gr_displayinfo(buf, rect, 0x000000, 0xFFFFFF, "");
 		return;
 	}
 
-	// Display the image.
-	imlib_context_set_anti_alias(0);
-	imlib_context_set_image(placement->scaled_image);
-	imlib_context_set_drawable(buf);
-	if (rect->reverse) {
-		Imlib_Color_Modifier cm = imlib_create_color_modifier();
-		imlib_context_set_color_modifier(cm);
-		imlib_set_color_modifier_tables(reverse_table, reverse_table,
-						reverse_table, NULL);
-	}
-	int w_pix = (rect->end_col - rect->start_col) * rect->cw;
-	int h_pix = (rect->end_row - rect->start_row) * rect->ch;
-	imlib_render_image_part_on_drawable_at_size(
-		rect->start_col * rect->cw, rect->start_row * rect->ch, w_pix,
-		h_pix, rect->x_pix, rect->y_pix, w_pix, h_pix);
+	// Reverse cells are drawn from a cached inverted copy. If it can't be
+	// created, draw the normal image.
 	if (rect->reverse) {
-		imlib_free_color_modifier();
-		imlib_context_set_color_modifier(NULL);
+		gr_load_placement_reverse(placement);
+		if (!placement->scaled_image_reverse)
+			rect->reverse = 0;
 	}
 
+	// Draw the placements this one covers, if they can be seen through it.
+	// Loading them may free up RAM, but not at the expense of this one.
+	char was_protected = placement->protected;
+	placement->protected = 1;
+	gr_draw_underlays(buf, placement, rect);
+	placement->protected = was_protected;
+
+	// Display the image. Small opaque placements are copied from atlases,
+	// translucent ones are composited with XRender if possible, and the rest
+	// are rendered with imlib.
+	if (!gr_atlas_drawimagerect(buf, placement, rect) &&
+	    !gr_render_drawimagerect(buf, placement, rect))
+		gr_imlib_drawimagerect(buf, placement, rect);
+
 	// In debug mode always draw bounding boxes and print info.
 	if (graphics_debug_mode == GRAPHICS_DEBUG_LOG_AND_BOXES) {
 		gr_showrect(buf, rect);
@@ -1518,12 +5738,237 @@ static void gr_drawimagerect(Drawable buf, ImageRect *rect) {
 	}
 }
 
-/// Removes the given image rectangle.
-static void gr_freerect(ImageRect *rect) { memset(rect, 0, sizeof(ImageRect)); }
+/// Returns true if the two rects belong to the same placement, use the same
+/// cell size and inversion mode, and are positioned consistently, i.e. they
+/// are parts of the same on-screen copy of the placement and could be drawn
+/// as a single rect if they were adjacent.
+static int gr_rects_compatible(ImageRect *a, ImageRect *b) {
+	return a->image_id == b->image_id &&
+	       a->placement_id == b->placement_id && a->cw == b->cw &&
+	       a->ch == b->ch && a->reverse == b->reverse &&
+	       a->x_pix - a->start_col * a->cw ==
+		       b->x_pix - b->start_col * b->cw &&
+	       a->y_pix - a->start_row * a->ch ==
+		       b->y_pix - b->start_row * b->ch;
+}
+
+/// Returns the key of the bucket containing compatible rects whose last row
+/// (exclusive) is `end_row`. Collisions are possible, they are resolved by
+/// checking the rects themselves.
+static uint64_t gr_rect_bucket_key(ImageRect *rect, int end_row) {
+	uint64_t key = rect->image_id;
+	int64_t fields[] = {rect->placement_id,
+			    rect->cw,
+			    rect->ch,
+			    rect->reverse,
+			    rect->x_pix - rect->start_col * rect->cw,
+			    rect->y_pix - rect->start_row * rect->ch,
+			    end_row};
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+		key = (key ^ (uint64_t)fields[i]) * 0x100000001B3ull;
+	return key;
+}
+
+/// Adds the rect with the index `idx` to the bucket corresponding to its
+/// current `end_row`.
+static void gr_rect_bucket_insert(int idx) {
+	ImageRect *rect = &image_rects[idx];
+	int ret;
+	khiter_t k = kh_put(rectbucket, image_rect_buckets,
+			    gr_rect_bucket_key(rect, rect->end_row), &ret);
+	rect->next_in_bucket = ret == 0 ? kh_value(image_rect_buckets, k) : -1;
+	kh_value(image_rect_buckets, k) = idx;
+}
+
+/// Removes the rect with the index `idx` from the bucket corresponding to its
+/// current `end_row`.
+static void gr_rect_bucket_remove(int idx) {
+	ImageRect *rect = &image_rects[idx];
+	khiter_t k = kh_get(rectbucket, image_rect_buckets,
+			    gr_rect_bucket_key(rect, rect->end_row));
+	if (k == kh_end(image_rect_buckets))
+		return;
+	int *link = &kh_value(image_rect_buckets, k);
+	while (*link != -1 && *link != idx)
+		link = &image_rects[*link].next_in_bucket;
+	if (*link == idx)
+		*link = rect->next_in_bucket;
+	if (kh_value(image_rect_buckets, k) == -1)
+		kh_del(rectbucket, image_rect_buckets, k);
+}
+
+/// Appends a rect to `image_rects` without trying to merge it. Returns its
+/// index.
+static int gr_push_rect(ImageRect *new_rect) {
+	if (image_rects_count == image_rects_capacity) {
+		image_rects_capacity =
+			image_rects_capacity ? image_rects_capacity * 2 : 64;
+		image_rects = realloc(image_rects, image_rects_capacity *
+							   sizeof(ImageRect));
+	}
+	int idx = image_rects_count++;
+	image_rects[idx] = *new_rect;
+	gr_rect_bucket_insert(idx);
+	return idx;
+}
+
+/// Finds a compatible rect that ends right above `rect` and has exactly the
+/// same columns, and merges `rect` into it. `rect` must be a single-row rect
+/// that was appended last. Used after extending a stripe horizontally.
+static void gr_try_merge_up(int idx) {
+	ImageRect *rect = &image_rects[idx];
+	khiter_t k = kh_get(rectbucket, image_rect_buckets,
+			    gr_rect_bucket_key(rect, rect->start_row));
+	if (k == kh_end(image_rect_buckets))
+		return;
+	for (int i = kh_value(image_rect_buckets, k); i != -1;
+	     i = image_rects[i].next_in_bucket) {
+		ImageRect *above = &image_rects[i];
+		if (i == idx || above->end_row != rect->start_row ||
+		    above->start_col != rect->start_col ||
+		    above->end_col != rect->end_col ||
+		    !gr_rects_compatible(above, rect))
+			continue;
+		gr_rect_bucket_remove(i);
+		above->end_row = rect->end_row;
+		gr_rect_bucket_insert(i);
+		gr_rect_bucket_remove(idx);
+		image_rects_count--;
+		return;
+	}
+}
+
+/// Adds a rect to the list of rects to draw, merging it with the existing
+/// rects when possible:
+/// - if there is a compatible rect ending right above the new one whose
+///   columns are within the new one, that rect is extended down, and the
+///   parts of the new rect to the left and to the right of it are added
+///   recursively;
+/// - if the last added rect is a compatible rect on the same rows ending right
+///   to the left of the new one, it is extended to the right.
+static void gr_add_rect(ImageRect *new_rect) {
+	if (new_rect->end_col <= new_rect->start_col)
+		return;
+	khiter_t k = kh_get(rectbucket, image_rect_buckets,
+			    gr_rect_bucket_key(new_rect, new_rect->start_row));
+	if (k != kh_end(image_rect_buckets)) {
+		for (int i = kh_value(image_rect_buckets, k); i != -1;
+		     i = image_rects[i].next_in_bucket) {
+			ImageRect *above = &image_rects[i];
+			if (above->end_row != new_rect->start_row ||
+			    above->start_col < new_rect->start_col ||
+			    above->end_col > new_rect->end_col ||
+			    !gr_rects_compatible(above, new_rect))
+				continue;
+			// Split the new rect into the left part, the middle
+			// part (merged into `above`) and the right part.
+			ImageRect left = *new_rect;
+			ImageRect right = *new_rect;
+			left.end_col = above->start_col;
+			right.start_col = above->end_col;
+			right.x_pix = new_rect->x_pix +
+				      (right.start_col - new_rect->start_col) *
+					      new_rect->cw;
+			gr_rect_bucket_remove(i);
+			above->end_row = new_rect->end_row;
+			gr_rect_bucket_insert(i);
+			gr_add_rect(&left);
+			gr_add_rect(&right);
+			return;
+		}
+	}
+	if (image_rects_count > 0) {
+		int last_idx = image_rects_count - 1;
+		ImageRect *last = &image_rects[last_idx];
+		if (last->start_row == new_rect->start_row &&
+		    last->end_row == new_rect->end_row &&
+		    last->end_col == new_rect->start_col &&
+		    gr_rects_compatible(last, new_rect)) {
+			last->end_col = new_rect->end_col;
+			gr_try_merge_up(last_idx);
+			return;
+		}
+	}
+	gr_push_rect(new_rect);
+}
+
+/// Forgets all the rects (after they have been drawn).
+static void gr_clear_rects() {
+	image_rects_count = 0;
+	kh_clear(rectbucket, image_rect_buckets);
+}
+
+/// Returns a number identifying the pixels that will be drawn for the given
+/// placement, or 0 if the cells must be redrawn unconditionally.
+uint32_t gr_get_placement_generation(uint32_t image_id, uint32_t placement_id,
+				     int cw, int ch) {
+	if (graphics_debug_mode || !graphics_display_images)
+		return 0;
+	ImagePlacement *placement =
+		gr_find_image_and_placement(image_id, placement_id);
+	if (!placement || !placement->scaled_image || placement->preview ||
+	    placement->scaled_cw != cw || placement->scaled_ch != ch ||
+	    placement->scaled_frame_serial != placement->image->frame_serial)
+		return 0;
+	if (!placement->underlay_count || gr_placement_is_opaque(placement))
+		return placement->generation;
+	// The pixels also depend on the placements under this one.
+	uint32_t generation = placement->generation;
+	for (int i = 0; i < placement->underlay_count; ++i) {
+		ImagePlacement *under =
+			gr_underlay_placement(&placement->underlays[i]);
+		if (!under)
+			continue;
+		if (!under->scaled_image || under->preview ||
+		    under->scaled_cw != cw || under->scaled_ch != ch ||
+		    under->scaled_frame_serial != under->image->frame_serial)
+			return 0;
+		generation = generation * 31 + under->generation;
+	}
+	return generation ? generation : 1;
+}
 
-/// Returns the bottom coordinate of the rect.
-static int gr_getrectbottom(ImageRect *rect) {
-	return rect->y_pix + (rect->end_row - rect->start_row) * rect->ch;
+int gr_stack_placements(uint32_t image_id, uint32_t placement_id,
+			uint32_t under_image_id, uint32_t under_placement_id,
+			int dcol, int drow) {
+	ImagePlacement *top = gr_find_image_and_placement(image_id,
+							  placement_id);
+	ImagePlacement *bottom = gr_find_image_and_placement(
+		under_image_id, under_placement_id);
+	if (!top || !bottom)
+		return 1;
+	// The new placement goes under the old one only if its z-index is
+	// lower.
+	int new_on_top = top->z_index >= bottom->z_index;
+	if (!new_on_top) {
+		ImagePlacement *tmp = top;
+		top = bottom;
+		bottom = tmp;
+		dcol = -dcol;
+		drow = -drow;
+	}
+	Underlay underlay = {bottom->image->image_id, bottom->placement_id,
+			     bottom->serial, dcol, drow, bottom->z_index};
+	// Find the position keeping the underlays sorted by z-index, unless
+	// the underlay is already known.
+	int pos = top->underlay_count;
+	for (int i = 0; i < top->underlay_count; ++i) {
+		Underlay *u = &top->underlays[i];
+		if (u->image_id == underlay.image_id &&
+		    u->placement_id == underlay.placement_id &&
+		    u->serial == underlay.serial && u->dcol == dcol &&
+		    u->drow == drow)
+			return new_on_top;
+		if (pos == top->underlay_count && u->z_index > underlay.z_index)
+			pos = i;
+	}
+	top->underlays = realloc(top->underlays, (top->underlay_count + 1) *
+							 sizeof(Underlay));
+	memmove(top->underlays + pos + 1, top->underlays + pos,
+		(top->underlay_count - pos) * sizeof(Underlay));
+	top->underlays[pos] = underlay;
+	top->underlay_count++;
+	return new_on_top;
 }
 
 /// Prepare for image drawing. `cw` and `ch` are dimensions of the cell.
@@ -1531,19 +5976,20 @@ void gr_start_drawing(Drawable buf, int cw, int ch) {
 	current_cw = cw;
 	current_ch = ch;
 	drawing_start_time = clock();
+	rescale_ms_spent = 0;
+	gr_collect_decoded_images();
+	gr_clear_rects();
 }
 
 /// Finish image drawing. This functions will draw all the rectangles left to
 /// draw.
 void gr_finish_drawing(Drawable buf) {
 	// Draw and then delete all known image rectangles.
-	for (size_t i = 0; i < MAX_IMAGE_RECTS; ++i) {
-		ImageRect *rect = &image_rects[i];
-		if (!rect->image_id)
-			continue;
-		gr_drawimagerect(buf, rect);
-		gr_freerect(rect);
-	}
+	int rect_count = image_rects_count;
+	for (int i = 0; i < image_rects_count; ++i)
+		gr_drawimagerect(buf, &image_rects[i]);
+	gr_clear_rects();
+	gr_render_finish_drawing();
 
 	// In debug mode display additional info.
 	if (graphics_debug_mode) {
@@ -1557,18 +6003,21 @@ void gr_finish_drawing(Drawable buf) {
 		char info[MAX_INFO_LEN];
 		snprintf(info, MAX_INFO_LEN,
 			 "Frame rendering time: %d ms  Image storage ram: %ld "
-			 "KiB disk: %ld KiB  count: %d   cell %dx%d",
+			 "KiB disk: %ld KiB  count: %d   cell %dx%d  rects: %d",
 			 milliseconds, images_ram_size / 1024,
 			 images_disk_size / 1024, kh_size(images),
-			 current_cw, current_ch);
+			 current_cw, current_ch, rect_count);
 		XSetForeground(disp, gc, 0x000000);
-		XFillRectangle(disp, buf, gc, 0, 0, 600, 16);
+		XFillRectangle(disp, buf, gc, 0, 0, 700, 16);
 		XSetForeground(disp, gc, 0xFFFFFF);
 		XDrawString(disp, buf, gc, 0, 14, info, strlen(info));
 		XFreeGC(disp, gc);
 	}
 
-	// Check the limits in case we have used too much ram for placements.
+	// Drop old scaled images of deleted and off-screen placements and
+	// check the limits in case we have used too much ram for placements.
+	gr_free_expired_tombstones();
+	gr_unload_offscreen_placements();
 	gr_check_limits();
 }
 
@@ -1600,46 +6049,8 @@ void gr_append_imagerect(Drawable buf, uint32_t image_id, uint32_t placement_id,
 	// nothing.
 	if (image_id == 0 || end_col - start_col <= 0 ||
 	    end_row - start_row <= 0)
-		return;
-	// Try to find a rect to merge with.
-	ImageRect *free_rect = NULL;
-	for (size_t i = 0; i < MAX_IMAGE_RECTS; ++i) {
-		ImageRect *rect = &image_rects[i];
-		if (rect->image_id == 0) {
-			if (!free_rect)
-				free_rect = rect;
-			continue;
-		}
-		if (rect->image_id != image_id ||
-		    rect->placement_id != placement_id || rect->cw != cw ||
-		    rect->ch != ch || rect->reverse != reverse)
-			continue;
-		// We only support the case when the new stripe is added to the
-		// bottom of an existing rectangle and they are perfectly
-		// aligned.
-		if (rect->end_row == start_row &&
-		    gr_getrectbottom(rect) == y_pix) {
-			if (rect->start_col == start_col &&
-			    rect->end_col == end_col && rect->x_pix == x_pix) {
-				rect->end_row = end_row;
-				return;
-			}
-		}
-	}
-	// If we haven't merged the new rect with any existing rect, and there
-	// is no free rect, we have to render one of the existing rects.
-	if (!free_rect) {
-		for (size_t i = 0; i < MAX_IMAGE_RECTS; ++i) {
-			ImageRect *rect = &image_rects[i];
-			if (!free_rect || gr_getrectbottom(free_rect) >
-						  gr_getrectbottom(rect))
-				free_rect = rect;
-		}
-		gr_drawimagerect(buf, free_rect);
-		gr_freerect(free_rect);
-	}
-	// Start a new rectangle in `free_rect`.
-	*free_rect = new_rect;
+		return;
+	gr_add_rect(&new_rect);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1652,7 +6063,7 @@ typedef struct {
 	char *command;
 	/// The payload (after ';').
 	char *payload;
-	/// 'a=', may be 't', 'T', 'p', 'd'.
+	/// 'a=', may be 't', 'T', 'q', 'p', 'd', 'f', 'a'.
 	char action;
 	/// 'q=', 1 to suppress OK response, 2 to suppress errors too.
 	int quiet;
@@ -1660,11 +6071,13 @@ typedef struct {
 	/// imlib2. If 'f=0', will try to load with imlib2, then fallback to
 	/// 32-bit pixel data.
 	int format;
-	/// 'o=', may be 'z' for RFC 1950 ZLIB.
+	/// 'o=', may be 'z' for RFC 1950 ZLIB, and, if compiled in, 's' for a
+	/// zstd stream or 'l' for an LZ4 frame.
 	int compression;
 	/// 't=', may be 'f' or 'd'.
 	char transmission_medium;
-	/// 'd=', may be only 'I' if specified.
+	/// 'd=', one of 'a', 'i', 'n', 'c', 'p', 'q', 'x', 'y', 'z', 'r', or
+	/// their uppercase versions.
 	char delete_specifier;
 	/// 's=', 'v=', used only when 'f=24' or 'f=32'.
 	int pix_width, pix_height;
@@ -1695,6 +6108,14 @@ typedef struct {
 	/// 'C=', if true, do not move the cursor when displaying this placement
 	/// (non-virtual placements only).
 	char do_not_move_cursor;
+	/// 'z=', the gap of a frame in milliseconds ('a=f' and 'a=a'), or the
+	/// z-index of a placement ('a=p', 'a=T' and 'a=d').
+	int z;
+	/// 'X=', if 1, frame data replaces the base frame instead of being
+	/// blended onto it.
+	int compose_mode;
+	/// 'Y=', the background color of a frame that has no base, 0xRRGGBBAA.
+	uint32_t background_color;
 } GraphicsCommand;
 
 /// Replaces all non-printed characters in `str` with '?' and truncates the
@@ -1772,9 +6193,18 @@ static void gr_reportsuccess_cmd(GraphicsCommand *cmd) {
 				  cmd->placement_id, "OK");
 }
 
+/// Returns the image id that responses concerning `img` should mention.
+static uint32_t gr_response_image_id(Image *img) {
+	if (img->query_id)
+		return img->query_id;
+	if (img->frame_of)
+		return img->frame_of;
+	return img->image_id;
+}
+
 /// Creates the 'OK' response to the current command (unless suppressed).
 static void gr_reportsuccess_img(Image *img) {
-	uint32_t id = img->query_id ? img->query_id : img->image_id;
+	uint32_t id = gr_response_image_id(img);
 	if (img->quiet < 1)
 		gr_createresponse(id, img->image_number,
 				  img->initial_placement_id, "OK");
@@ -1808,7 +6238,7 @@ static void gr_reporterror_img(Image *img, const char *format, ...) {
 		fprintf(stderr, "%s\n", errmsg);
 		gr_createresponse(0, 0, 0, errmsg);
 	} else {
-		uint32_t id = img->query_id ? img->query_id : img->image_id;
+		uint32_t id = gr_response_image_id(img);
 		fprintf(stderr, "%s  id=%u\n", errmsg, id);
 		if (img->quiet < 2)
 			gr_createresponse(id, img->image_number,
@@ -1816,15 +6246,142 @@ static void gr_reporterror_img(Image *img, const char *format, ...) {
 	}
 }
 
-/// Loads an image and creates a success/failure response. Returns `img`, or
-/// NULL if it's a query action and the image was deleted.
-static Image *gr_loadimage_and_report(Image *img) {
+/// Adds the frame data uploaded to the image `upload` as a new frame of `img`
+/// or draws it onto an existing frame. Returns an error message on failure.
+static const char *gr_add_frame(Image *img, Image *upload) {
+	if (!img)
+		return "ENOENT: the image of the frame doesn't exist anymore";
 	gr_load_image(img);
-	if (!img->original_image) {
-		gr_reporterror_img(img, "EBADF: could not load image");
+	if (!img->original_image)
+		return "ENODATA: could not load the image of the frame";
+	if (img->reduction > 1)
+		return "EFBIG: the image is too big to be animated";
+	int count = gr_frame_count(img);
+	int edit = upload->frame_edit;
+	if (upload->frame_base < 0 || upload->frame_base > count)
+		return "ENOENT: the base frame doesn't exist";
+	if (edit < 0 || edit > count)
+		return "ENOENT: the frame to edit doesn't exist";
+	if (edit == 1)
+		return "EINVAL: editing the first frame is not supported";
+	gr_load_image(upload);
+	if (!upload->original_image)
+		return "EBADF: could not load the frame data";
+
+	// Only the part of the frame data inside the image is stored.
+	ImageFrame delta = {0};
+	delta.x = MAX(upload->frame_x, 0);
+	delta.y = MAX(upload->frame_y, 0);
+	delta.width = MIN(upload->frame_x + upload->pix_width, img->pix_width) -
+		      delta.x;
+	delta.height =
+		MIN(upload->frame_y + upload->pix_height, img->pix_height) -
+		delta.y;
+	delta.width = MAX(delta.width, 0);
+	delta.height = MAX(delta.height, 0);
+	delta.overwrite = upload->frame_overwrite;
+	if (delta.width && delta.height) {
+		delta.pixels = malloc((size_t)delta.width * delta.height *
+				      sizeof(DATA32));
+		if (!delta.pixels)
+			return "ENOMEM: could not allocate the frame";
+		gr_pixbuf_read_rect(upload->original_image,
+				    delta.x - upload->frame_x,
+				    delta.y - upload->frame_y, delta.width,
+				    delta.height, delta.pixels, delta.width);
 	} else {
-		gr_reportsuccess_img(img);
+		delta.width = delta.height = 0;
+	}
+
+	if (!edit) {
+		ImageFrame *frame = gr_append_frame(img);
+		if (!frame) {
+			free(delta.pixels);
+			return "ENOMEM: could not allocate the frame";
+		}
+		*frame = delta;
+		frame->base = upload->frame_base;
+		DATA32 bg = upload->frame_background;
+		frame->background = (bg & 0xFF) << 24 | bg >> 8;
+		frame->gap = upload->frame_gap ? upload->frame_gap
+					       : graphics_default_frame_gap_ms;
+		images_ram_size += gr_frame_ram_size(frame);
+		GR_LOG("Added frame %d to image %u, %dx%d at %d,%d\n",
+		       img->frame_count, img->image_id, frame->width,
+		       frame->height, frame->x, frame->y);
+		return NULL;
+	}
+
+	// When editing a frame, frames based on it must keep their look, so
+	// they are composited first. The edited frame is composited too, and
+	// then the new data is drawn onto it.
+	for (int i = edit + 1; i <= count; ++i) {
+		if (img->frames[i - 1].base == edit &&
+		    !gr_materialize_frame(img, i)) {
+			free(delta.pixels);
+			return "ENOMEM: could not composite dependent frames";
+		}
+	}
+	if (!gr_materialize_frame(img, edit)) {
+		free(delta.pixels);
+		return "ENOMEM: could not composite the frame";
+	}
+	ImageFrame *frame = &img->frames[edit - 1];
+	if (delta.pixels)
+		gr_apply_frame_delta(img, &delta, frame->pixels);
+	free(delta.pixels);
+	if (upload->frame_gap)
+		frame->gap = upload->frame_gap;
+	if (img->frame_image_index == edit)
+		img->frame_image_index = 0;
+	if (img->current_frame == edit)
+		gr_frame_pixels_changed(img);
+	GR_LOG("Edited frame %d of image %u\n", edit, img->image_id);
+	return NULL;
+}
+
+/// Turns the uploaded frame data into a frame of the image it belongs to,
+/// reports the result and deletes the temporary image holding the data.
+static void gr_add_uploaded_frame(Image *upload) {
+	const char *error = gr_add_frame(gr_find_image(upload->frame_of), upload);
+	if (error)
+		gr_reporterror_img(upload, "%s", error);
+	else
+		gr_reportsuccess_img(upload);
+	gr_delete_image(upload);
+}
+
+/// Checks that an uploaded image is valid and creates a success/failure
+/// response. If possible, only the header of the image is examined, and
+/// decoding is deferred until the image is displayed. Returns `img`, or NULL if
+/// it's a query action or frame data and the image was deleted.
+static Image *gr_checkimage_and_report(Image *img) {
+	if (img->frame_of) {
+		gr_add_uploaded_frame(img);
+		return NULL;
+	}
+	const char *error = NULL;
+	int probe = gr_probe_image(img, &error);
+	if (probe == PROBE_UNKNOWN) {
+		// We don't know this format, decode it to check.
+		gr_load_image(img);
+		if (!img->original_image)
+			error = "EBADF: could not load image";
+	} else if (probe == PROBE_INVALID) {
+		img->status = STATUS_RAM_LOADING_ERROR;
+	} else {
+		GR_LOG("Image %u is %dx%d, decoding is deferred\n",
+		       img->image_id, img->pix_width, img->pix_height);
+		// Start decoding in the background unless it's a query. If the
+		// image has no placements yet, we don't know how much we can
+		// reduce it, so decoding is started by the put command.
+		if (!img->query_id && kh_size(img->placements))
+			gr_queue_decoding_for_placements(img);
 	}
+	if (error)
+		gr_reporterror_img(img, "%s", error);
+	else
+		gr_reportsuccess_img(img);
 	// If it was a query action, discard the image.
 	if (img->query_id) {
 		gr_delete_image(img);
@@ -1864,7 +6421,13 @@ static void gr_reportuploaderror(Image *img) {
 static void gr_display_nonvirtual_placement(ImagePlacement *placement) {
 	if (placement->virtual)
 		return;
-	if (placement->image->status < STATUS_RAM_LOADING_SUCCESS)
+	if (placement->placeholder_requested)
+		return;
+	// The image must be successfully uploaded and valid, but it may be not
+	// decoded yet. Images displayed progressively are shown right away.
+	if (!placement->image->progressive &&
+	    (placement->image->status < STATUS_UPLOADING_SUCCESS ||
+	     placement->image->status == STATUS_RAM_LOADING_ERROR))
 		return;
 	// Infer the placement size if needed.
 	gr_infer_placement_size_maybe(placement);
@@ -1877,11 +6440,94 @@ static void gr_display_nonvirtual_placement(ImagePlacement *placement) {
 	graphics_command_result.placeholder.rows = placement->rows;
 	graphics_command_result.placeholder.do_not_move_cursor =
 		placement->do_not_move_cursor;
+	placement->placeholder_requested = 1;
 	GR_LOG("Creating a placeholder for %u/%u  %d x %d\n",
 	       placement->image->image_id, placement->placement_id,
 	       placement->cols, placement->rows);
 }
 
+/// Writes a piece of the data of a direct upload to the disk cache. Small
+/// uploads are accumulated in memory to be packed into a segment when complete,
+/// larger ones are written to their own file. Returns 0 on failure.
+static int gr_write_upload_data(Image *img, const char *data, unsigned size) {
+	char pending = !img->open_file &&
+		       (img->disk_size == 0 || img->pending_data) &&
+		       gr_pack_accepts(img->disk_size + size) &&
+		       (img->cache_deflate ||
+			gr_pack_accepts(img->expected_size));
+	FILE *file = img->open_file;
+	// If there is no open file corresponding to the image, create it.
+	if (!pending && !file) {
+		gr_make_sure_tmpdir_exists();
+		char filename[MAX_FILENAME_SIZE];
+		gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
+		file = fopen(filename,
+			     img->disk_size && !img->pending_data ? "a" : "w");
+		// Move the data accumulated in memory to the file.
+		if (file && img->pending_data) {
+			fwrite(img->pending_data, 1, img->disk_size, file);
+			free(img->pending_data);
+			img->pending_data = NULL;
+			img->pending_capacity = 0;
+		}
+		img->open_file = file;
+	}
+	if (pending ? !gr_append_pending_data(img, data, size) : !file)
+		return 0;
+	if (file)
+		fwrite(data, 1, size, file);
+	img->disk_size += size;
+	images_disk_size += size;
+	return 1;
+}
+
+/// Starts compressing the raw pixels of a direct upload for the disk cache if
+/// they are sent without compression.
+static void gr_start_cache_compression(Image *img) {
+	if (!graphics_cache_compress_raw || img->compression ||
+	    (img->format != 24 && img->format != 32) || img->cache_deflate)
+		return;
+	z_stream *strm = calloc(1, sizeof(z_stream));
+	if (!strm)
+		return;
+	if (deflateInit(strm, Z_BEST_SPEED) != Z_OK) {
+		free(strm);
+		return;
+	}
+	img->cache_deflate = strm;
+}
+
+/// Compresses a piece of raw pixel data of a direct upload and writes the
+/// result to the disk cache. If `finish` is set, the compressed stream is
+/// completed. Returns 0 on failure.
+static int gr_write_upload_data_compressed(Image *img, const char *data,
+					   unsigned size, char finish) {
+	unsigned char out[BUFSIZ * 4];
+	z_stream *strm = img->cache_deflate;
+	strm->next_in = (unsigned char *)data;
+	strm->avail_in = size;
+	do {
+		strm->next_out = out;
+		strm->avail_out = sizeof(out);
+		if (deflate(strm, finish ? Z_FINISH : Z_NO_FLUSH) ==
+		    Z_STREAM_ERROR)
+			return 0;
+		unsigned produced = sizeof(out) - strm->avail_out;
+		if (produced &&
+		    !gr_write_upload_data(img, (char *)out, produced))
+			return 0;
+	} while (strm->avail_out == 0);
+	if (finish) {
+		deflateEnd(strm);
+		free(strm);
+		img->cache_deflate = NULL;
+		img->cache_compressed = 1;
+		GR_LOG("Compressed image %u in the disk cache: %u -> %u bytes\n",
+		       img->image_id, img->uploaded_size, img->disk_size);
+	}
+	return 1;
+}
+
 /// Appends data from `payload` to the image `img` when using direct
 /// transmission. Note that we report errors only for the final command
 /// (`!more`) to avoid spamming the client.
@@ -1910,45 +6556,48 @@ static void gr_append_data(Image *img, const char *payload, int more) {
 	size_t data_size = 0;
 	char *data = gr_base64dec(payload, &data_size);
 
-	GR_LOG("appending %u + %zu = %zu bytes\n", img->disk_size, data_size,
-	       img->disk_size + data_size);
+	GR_LOG("appending %u + %zu = %zu bytes\n", img->uploaded_size,
+	       data_size, img->uploaded_size + data_size);
 
 	// Do not append this data if the image exceeds the size limit.
-	if (img->disk_size + data_size > graphics_max_single_image_file_size ||
+	if (img->uploaded_size + data_size >
+		    graphics_max_single_image_file_size ||
 	    img->expected_size > graphics_max_single_image_file_size) {
 		free(data);
 		gr_delete_imagefile(img);
+		gr_progressive_finish(img);
 		img->uploading_failure = ERROR_OVER_SIZE_LIMIT;
 		if (!more)
 			gr_reportuploaderror(img);
 		return;
 	}
 
-	// If there is no open file corresponding to the image, create it.
-	if (!img->open_file) {
-		gr_make_sure_tmpdir_exists();
-		char filename[MAX_FILENAME_SIZE];
-		gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
-		FILE *file = fopen(filename, img->disk_size ? "a" : "w");
-		if (!file) {
-			img->status = STATUS_UPLOADING_ERROR;
-			img->uploading_failure = ERROR_CANNOT_OPEN_CACHED_FILE;
-			if (!more)
-				gr_reportuploaderror(img);
-			return;
-		}
-		img->open_file = file;
+	// Raw pixels sent without compression are compressed for the disk
+	// cache as they arrive.
+	if (img->uploaded_size == 0)
+		gr_start_cache_compression(img);
+	int stored = img->cache_deflate
+			     ? gr_write_upload_data_compressed(img, data,
+							       data_size, !more)
+			     : gr_write_upload_data(img, data, data_size);
+	if (!stored) {
+		free(data);
+		img->status = STATUS_UPLOADING_ERROR;
+		img->uploading_failure = ERROR_CANNOT_OPEN_CACHED_FILE;
+		gr_progressive_finish(img);
+		if (!more)
+			gr_reportuploaderror(img);
+		return;
 	}
 
-	// Write date to the file and update disk size variables.
-	fwrite(data, 1, data_size, img->open_file);
+	gr_progressive_append(img, (unsigned char *)data, data_size);
 	free(data);
-	img->disk_size += data_size;
-	images_disk_size += data_size;
+	img->uploaded_size += data_size;
 	gr_touch_image(img);
 
 	if (more) {
 		current_upload_image_id = img->image_id;
+		gr_progressive_refresh(img);
 	} else {
 		current_upload_image_id = 0;
 		// Close the file.
@@ -1958,16 +6607,26 @@ static void gr_append_data(Image *img, const char *payload, int more) {
 		}
 		img->status = STATUS_UPLOADING_SUCCESS;
 		uint32_t placement_id = img->default_placement;
-		if (img->expected_size &&
-		    img->expected_size != img->disk_size) {
+		if (img->pending_data && !gr_store_pending_data(img)) {
+			// Could not store the data accumulated in memory.
+			img->status = STATUS_UPLOADING_ERROR;
+			img->uploading_failure = ERROR_CANNOT_OPEN_CACHED_FILE;
+			gr_progressive_finish(img);
+			gr_reportuploaderror(img);
+		} else if (img->expected_size &&
+			   img->expected_size != img->uploaded_size) {
 			// Report failure if the uploaded image size doesn't
 			// match the expected size.
 			img->status = STATUS_UPLOADING_ERROR;
 			img->uploading_failure = ERROR_UNEXPECTED_SIZE;
+			gr_progressive_finish(img);
 			gr_reportuploaderror(img);
 		} else {
+			// Keep the progressively decoded pixels if they are
+			// complete.
+			gr_progressive_finish(img);
 			// Try to load the image into ram and report the result.
-			img = gr_loadimage_and_report(img);
+			img = gr_checkimage_and_report(img);
 			if (img) {
 				// If there is a non-virtual image placement, we
 				// may need to display it.
@@ -2008,18 +6667,30 @@ static Image *gr_new_image_from_command(GraphicsCommand *cmd) {
 					"for raw pixel data (f=32 or f=24)");
 		// Even though we report an error, we still create an image.
 	}
-	// Create an image object. If the action is `q`, we'll use random id
-	// instead of the one specified in the command.
-	uint32_t image_id = cmd->action == 'q' ? 0 : cmd->image_id;
+	// Create an image object. If the action is `q` or `f`, we'll use random
+	// id instead of the one specified in the command.
+	uint32_t image_id =
+		cmd->action == 'q' || cmd->action == 'f' ? 0 : cmd->image_id;
 	Image *img = gr_new_image(image_id);
 	if (!img)
 		return NULL;
-	if (cmd->action == 'q')
+	if (cmd->action == 'q') {
 		img->query_id = cmd->image_id;
-	else if (!cmd->image_id)
+	} else if (cmd->action == 'f') {
+		img->frame_of = cmd->image_id;
+		img->frame_x = cmd->src_pix_x;
+		img->frame_y = cmd->src_pix_y;
+		img->frame_base = cmd->columns;
+		img->frame_edit = cmd->rows;
+		img->frame_gap = cmd->z;
+		img->frame_overwrite = cmd->compose_mode == 1;
+		img->frame_background = cmd->background_color;
+	} else if (!cmd->image_id) {
 		cmd->image_id = img->image_id;
-	// Set the image number.
-	img->image_number = cmd->image_number;
+	}
+	// Set the image number. Frame data must not be found by it.
+	if (!img->frame_of)
+		img->image_number = cmd->image_number;
 	// Set parameters.
 	img->expected_size = cmd->size;
 	img->format = cmd->format;
@@ -2061,6 +6732,20 @@ static Image *gr_handle_transmit_command(GraphicsCommand *cmd) {
 		       cmd->image_id);
 	}
 
+	// Frame data is uploaded to a temporary image, which becomes a frame of
+	// the target image when the upload is finished.
+	Image *frame_upload = NULL;
+	if (cmd->action == 'f') {
+		Image *target = gr_find_image_for_command(cmd);
+		if (!target) {
+			gr_reporterror_cmd(cmd, "ENOENT: image not found");
+			return NULL;
+		}
+		frame_upload = gr_find_image(current_upload_image_id);
+		if (frame_upload && frame_upload->frame_of != target->image_id)
+			frame_upload = NULL;
+	}
+
 	Image *img = NULL;
 	if (cmd->transmission_medium == 'f' ||
 	    cmd->transmission_medium == 't') {
@@ -2069,7 +6754,8 @@ static Image *gr_handle_transmit_command(GraphicsCommand *cmd) {
 		img = gr_new_image_from_command(cmd);
 		if (!img)
 			return NULL;
-		last_image_id = img->image_id;
+		if (!img->frame_of)
+			last_image_id = img->image_id;
 		// Decode the filename.
 		char *original_filename = gr_base64dec(cmd->payload, NULL);
 		GR_LOG("Copying image %s\n",
@@ -2140,7 +6826,7 @@ static Image *gr_handle_transmit_command(GraphicsCommand *cmd) {
 					gr_reportuploaderror(img);
 				} else {
 					// Everything seems fine, try to load.
-					img = gr_loadimage_and_report(img);
+					img = gr_checkimage_and_report(img);
 				}
 			}
 			// Delete the symlink.
@@ -2153,7 +6839,8 @@ static Image *gr_handle_transmit_command(GraphicsCommand *cmd) {
 		gr_check_limits();
 	} else if (cmd->transmission_medium == 'd') {
 		// Direct transmission (default if 't' is not specified).
-		img = gr_find_image_for_command(cmd);
+		img = cmd->action == 'f' ? frame_upload
+					 : gr_find_image_for_command(cmd);
 		if (img && img->status == STATUS_UPLOADING) {
 			// This is a continuation of the previous transmission.
 			cmd->is_direct_transmission_continuation = 1;
@@ -2169,8 +6856,10 @@ static Image *gr_handle_transmit_command(GraphicsCommand *cmd) {
 		img = gr_new_image_from_command(cmd);
 		if (!img)
 			return NULL;
-		last_image_id = img->image_id;
+		if (!img->frame_of)
+			last_image_id = img->image_id;
 		img->status = STATUS_UPLOADING;
+		gr_progressive_start(img);
 		// Start appending data.
 		gr_append_data(img, cmd->payload, cmd->more);
 	} else {
@@ -2211,6 +6900,7 @@ static void gr_handle_put_command(GraphicsCommand *cmd) {
 	placement->cols = cmd->columns;
 	placement->rows = cmd->rows;
 	placement->do_not_move_cursor = cmd->do_not_move_cursor;
+	placement->z_index = cmd->z;
 
 	if (placement->virtual)
 		placement->scale_mode = SCALE_MODE_CONTAIN;
@@ -2222,18 +6912,137 @@ static void gr_handle_put_command(GraphicsCommand *cmd) {
 	// Display the placement unless it's virtual.
 	gr_display_nonvirtual_placement(placement);
 
+	// Decode the image in the background if it's not loaded, or scale the
+	// placement if it is.
+	gr_queue_decoding_for_placements(img);
+	gr_queue_scaling(placement, current_cw, current_ch);
+
 	// Report success.
 	gr_reportsuccess_cmd(cmd);
 }
 
+/// Handles the animation control command (`a=a`).
+static void gr_handle_animation_command(GraphicsCommand *cmd) {
+	Image *img = gr_find_image_for_command(cmd);
+	if (!img) {
+		gr_reporterror_cmd(cmd, "ENOENT: image not found");
+		return;
+	}
+	int count = gr_frame_count(img);
+	if (cmd->rows < 0 || cmd->rows > count || cmd->columns < 0 ||
+	    cmd->columns > count) {
+		gr_reporterror_cmd(cmd, "ENOENT: frame not found");
+		return;
+	}
+	// 'r=' and 'z=' change the gap of a frame.
+	if (cmd->rows && cmd->z) {
+		if (!gr_reserve_frame(img)) {
+			gr_reporterror_cmd(cmd, "ENOMEM: could not allocate "
+						"the frame");
+			return;
+		}
+		img->frames[cmd->rows - 1].gap = cmd->z;
+	}
+	// 'c=' switches to the given frame.
+	if (cmd->columns)
+		gr_show_frame(img, cmd->columns);
+	// 'v=' is the number of loops plus one, 1 means infinite.
+	if (cmd->pix_height) {
+		img->max_loops = cmd->pix_height;
+		img->loops_done = 0;
+	}
+	// 's=' sets the state of the animation.
+	if (cmd->pix_width) {
+		if (cmd->pix_width < ANIMATION_STOPPED ||
+		    cmd->pix_width > ANIMATION_RUNNING) {
+			gr_reporterror_cmd(cmd, "EINVAL: unknown animation "
+						"state: %d",
+					   cmd->pix_width);
+			return;
+		}
+		if (img->animation_state != ANIMATION_RUNNING &&
+		    img->animation_state != ANIMATION_LOADING) {
+			clock_gettime(CLOCK_MONOTONIC, &img->next_frame_time);
+			int current = img->current_frame ? img->current_frame : 1;
+			gr_add_ms(&img->next_frame_time,
+				  MAX(gr_frame_gap(img, current), 0));
+		}
+		img->animation_state = cmd->pix_width;
+		animations_exist = 1;
+	}
+	gr_reportsuccess_cmd(cmd);
+}
+
+/// A placement found at a position, identified by the ids stored in the cells.
+typedef struct PlacementRef {
+	uint32_t image_id;
+	uint32_t placement_id;
+} PlacementRef;
+
 /// Information about what to delete.
 typedef struct DeletionData {
 	uint32_t image_id;
 	uint32_t placement_id;
+	/// If `max_image_id` is nonzero, delete placements of images with ids
+	/// from `image_id` to `max_image_id` ('d=r').
+	uint32_t max_image_id;
+	/// If true, delete only placements with the z-index `z_index`.
+	char match_z_index;
+	int32_t z_index;
+	/// If not NULL, delete only these placements (collected from the cells
+	/// at the requested position by `gr_collect_placements_callback`).
+	PlacementRef *targets;
+	int targets_count, targets_capacity;
 	/// If true, delete the image object if there are no more placements.
 	char delete_image_if_no_ref;
 } DeletionData;
 
+/// Returns 1 if the placement with the given ids is in `del_data->targets`.
+static int gr_is_deletion_target(DeletionData *del_data, uint32_t image_id,
+				 uint32_t placement_id) {
+	for (int i = 0; i < del_data->targets_count; ++i) {
+		if (del_data->targets[i].image_id == image_id &&
+		    del_data->targets[i].placement_id == placement_id)
+			return 1;
+	}
+	return 0;
+}
+
+/// Returns 1 if the z-index of the placement matches the deletion request.
+static int gr_deletion_z_index_matches(DeletionData *del_data,
+				       uint32_t image_id,
+				       uint32_t placement_id) {
+	if (!del_data->match_z_index)
+		return 1;
+	ImagePlacement *placement =
+		gr_find_placement(gr_find_image(image_id), placement_id);
+	return placement && placement->z_index == del_data->z_index;
+}
+
+/// The callback collecting the placements whose classic placeholders occupy
+/// the visited cells into `del_data->targets`. Doesn't modify the cells.
+static int gr_collect_placements_callback(void *data, uint32_t image_id,
+					  uint32_t placement_id, int col,
+					  int row, char is_classic) {
+	DeletionData *del_data = data;
+	if (!is_classic || !placement_id)
+		return 0;
+	if (gr_is_deletion_target(del_data, image_id, placement_id))
+		return 0;
+	if (!gr_deletion_z_index_matches(del_data, image_id, placement_id))
+		return 0;
+	if (del_data->targets_count == del_data->targets_capacity) {
+		del_data->targets_capacity =
+			MAX(8, del_data->targets_capacity * 2);
+		del_data->targets = realloc(
+			del_data->targets,
+			del_data->targets_capacity * sizeof(PlacementRef));
+	}
+	del_data->targets[del_data->targets_count++] =
+		(PlacementRef){image_id, placement_id};
+	return 0;
+}
+
 /// The callback called for each cell to perform deletion.
 static int gr_deletion_callback(void *data, uint32_t image_id,
 					    uint32_t placement_id, int col,
@@ -2242,10 +7051,23 @@ static int gr_deletion_callback(void *data, uint32_t image_id,
 	// Leave unicode placeholders alone.
 	if (!is_classic)
 		return 0;
-	if (del_data->image_id && del_data->image_id != image_id)
-		return 0;
-	if (del_data->placement_id && del_data->placement_id != placement_id)
-		return 0;
+	if (del_data->targets) {
+		if (!gr_is_deletion_target(del_data, image_id, placement_id))
+			return 0;
+	} else if (del_data->max_image_id) {
+		if (image_id < del_data->image_id ||
+		    image_id > del_data->max_image_id)
+			return 0;
+	} else {
+		if (del_data->image_id && del_data->image_id != image_id)
+			return 0;
+		if (del_data->placement_id &&
+		    del_data->placement_id != placement_id)
+			return 0;
+		if (!gr_deletion_z_index_matches(del_data, image_id,
+						 placement_id))
+			return 0;
+	}
 	Image *img = gr_find_image(image_id);
 	// If the image is already deleted, just erase the placeholder.
 	if (!img)
@@ -2260,11 +7082,29 @@ static int gr_deletion_callback(void *data, uint32_t image_id,
 	return 1;
 }
 
+/// Deletes the placements having classic placeholders in the rectangle from
+/// (`x1`, `y1`) to (`x2`, `y2`) (0-based, inclusive). The placements are found
+/// by looking only at the cells of the rectangle, then their placeholders are
+/// erased from the whole screen.
+static void gr_delete_placements_in(DeletionData *del_data, int x1, int y1,
+				    int x2, int y2) {
+	gr_for_each_image_cell_in(x1, y1, x2, y2,
+				  gr_collect_placements_callback, del_data);
+	if (del_data->targets_count)
+		gr_for_each_image_cell(gr_deletion_callback, del_data);
+	free(del_data->targets);
+	del_data->targets = NULL;
+	del_data->targets_count = del_data->targets_capacity = 0;
+}
+
 /// Handles the delete command.
 static void gr_handle_delete_command(GraphicsCommand *cmd) {
 	DeletionData del_data = {0};
 	del_data.delete_image_if_no_ref = isupper(cmd->delete_specifier) != 0;
 	char d = tolower(cmd->delete_specifier);
+	// Position-based specifiers use 1-based 'x=' and 'y='.
+	int x = cmd->src_pix_x - 1;
+	int y = cmd->src_pix_y - 1;
 
 	if (d == 'n') {
 		d = 'i';
@@ -2296,6 +7136,58 @@ static void gr_handle_delete_command(GraphicsCommand *cmd) {
 		if (!del_data.placement_id && del_data.delete_image_if_no_ref)
 			gr_delete_image(gr_find_image(cmd->image_id));
 		gr_for_each_image_cell(gr_deletion_callback, &del_data);
+	} else if (d == 'c') {
+		// Delete placements intersecting the cursor.
+		gr_get_cursor_position(&x, &y);
+		gr_delete_placements_in(&del_data, x, y, x, y);
+	} else if (d == 'p' || d == 'q') {
+		// Delete placements intersecting the cell, and for 'q' also
+		// having the specified z-index.
+		if (x < 0 || y < 0)
+			return;
+		del_data.match_z_index = d == 'q';
+		del_data.z_index = cmd->z;
+		gr_delete_placements_in(&del_data, x, y, x, y);
+	} else if (d == 'x') {
+		// Delete placements intersecting the column.
+		if (x < 0)
+			return;
+		gr_delete_placements_in(&del_data, x, 0, x, INT_MAX);
+	} else if (d == 'y') {
+		// Delete placements intersecting the row.
+		if (y < 0)
+			return;
+		gr_delete_placements_in(&del_data, 0, y, INT_MAX, y);
+	} else if (d == 'z') {
+		// Delete visible placements with the specified z-index.
+		del_data.match_z_index = 1;
+		del_data.z_index = cmd->z;
+		gr_for_each_image_cell(gr_deletion_callback, &del_data);
+	} else if (d == 'r') {
+		// Delete placements of images with ids in the range from 'x='
+		// to 'y='. Like with 'I', the images themselves are deleted
+		// even if they have no visible placements.
+		uint32_t min_id = cmd->src_pix_x, max_id = cmd->src_pix_y;
+		if (!min_id || min_id > max_id) {
+			gr_reporterror_cmd(cmd,
+					   "EINVAL: invalid image id range: "
+					   "%u-%u",
+					   min_id, max_id);
+			return;
+		}
+		del_data.image_id = min_id;
+		del_data.max_image_id = max_id;
+		if (del_data.delete_image_if_no_ref) {
+			// Removing the current element while iterating over a
+			// khash table is safe.
+			Image *img = NULL;
+			kh_foreach_value(images, img, {
+				if (img->image_id >= min_id &&
+				    img->image_id <= max_id)
+					gr_delete_image(img);
+			});
+		}
+		gr_for_each_image_cell(gr_deletion_callback, &del_data);
 	} else {
 		fprintf(stderr,
 			"WARNING: unsupported value of the d key: '%c'. The "
@@ -2344,6 +7236,14 @@ static void gr_handle_command(GraphicsCommand *cmd) {
 	case 'd':
 		gr_handle_delete_command(cmd);
 		break;
+	case 'f':
+		// Transmit an animation frame.
+		gr_handle_transmit_command(cmd);
+		break;
+	case 'a':
+		// Control the animation.
+		gr_handle_animation_command(cmd);
+		break;
 	default:
 		gr_reporterror_cmd(cmd, "EINVAL: unsupported action: %c",
 				   cmd->action);
@@ -2408,7 +7308,7 @@ static void gr_set_keyvalue(GraphicsCommand *cmd, char *key_start,
 		break;
 	case 'o':
 		cmd->compression = *value_start;
-		if (cmd->compression != 'z') {
+		if (!gr_compression_supported(cmd->compression)) {
 			gr_reporterror_cmd(cmd,
 					   "EINVAL: unsupported compression "
 					   "specification: %s",
@@ -2458,12 +7358,14 @@ static void gr_set_keyvalue(GraphicsCommand *cmd, char *key_start,
 	case 'U':
 		cmd->virtual = num;
 		break;
+	case 'z':
+		cmd->z = num;
+		break;
 	case 'X':
+		cmd->compose_mode = num;
+		break;
 	case 'Y':
-	case 'z':
-		fprintf(stderr,
-			"WARNING: the key '%c' is not supported and will be ignored\n",
-			*key_start);
+		cmd->background_color = num;
 		break;
 	case 'C':
 		cmd->do_not_move_cursor = num;
@@ -2486,6 +7388,10 @@ int gr_parse_command(char *buf, size_t len) {
 	global_command_counter++;
 	GR_LOG("### Command %lu: %.80s\n", global_command_counter, buf);
 
+	// Pick up the images decoded since the last command, so that their
+	// placements start scaling before the next frame.
+	gr_collect_decoded_images();
+
 	// Eat the 'G'.
 	++buf;
 	--len;
@@ -2573,6 +7479,479 @@ int gr_parse_command(char *buf, size_t len) {
 	return 1;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Sixel images.
+//
+// Sixel data is decoded into a buffer in imlib2's pixel format and then stored
+// as a regular image with a non-virtual placement, so it's cached, evicted and
+// drawn exactly like images uploaded with the graphics protocol.
+////////////////////////////////////////////////////////////////////////////////
+
+/// The number of sixel color registers.
+#define SIXEL_PALETTE_SIZE 256
+
+/// The default colors of the VT340 in percents.
+static const unsigned char sixel_default_palette[16][3] = {
+	{0, 0, 0},    {20, 20, 80}, {80, 13, 13}, {20, 80, 20},
+	{80, 20, 80}, {20, 80, 80}, {80, 80, 20}, {53, 53, 53},
+	{26, 26, 26}, {33, 33, 60}, {60, 26, 26}, {33, 60, 33},
+	{60, 33, 60}, {33, 60, 60}, {60, 60, 33}, {80, 80, 80},
+};
+
+/// The number of rows touched by a sixel, i.e. the position of the highest
+/// bit plus one.
+static const unsigned char sixel_height[64] = {
+	0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4,
+	5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+};
+
+/// A growable buffer sixel data is decoded into.
+typedef struct {
+	DATA32 *pixels;
+	/// The allocated size.
+	int width, height;
+	/// The size of the image: the area covered by sixels or specified by
+	/// raster attributes.
+	int used_width, used_height;
+} SixelCanvas;
+
+/// Converts a color specified in percents to imlib2's ARGB.
+static DATA32 gr_sixel_rgb(int r, int g, int b) {
+	r = MIN(MAX(r, 0), 100) * 255 / 100;
+	g = MIN(MAX(g, 0), 100) * 255 / 100;
+	b = MIN(MAX(b, 0), 100) * 255 / 100;
+	return 0xFF000000 | r << 16 | g << 8 | b;
+}
+
+/// Converts a color in DEC's HLS model (hue in degrees, lightness and
+/// saturation in percents) to imlib2's ARGB. Unlike the usual HSL, the hue of
+/// blue is 0.
+static DATA32 gr_sixel_hls(int h, int l, int s) {
+	h = ((h % 360 + 360) % 360 + 240) % 360;
+	l = MIN(MAX(l, 0), 100);
+	s = MIN(MAX(s, 0), 100);
+	int chroma = (100 - abs(2 * l - 100)) * s / 100;
+	int x = chroma * (60 - abs(h % 120 - 60)) / 60;
+	int m = l - chroma / 2;
+	int r = 0, g = 0, b = 0;
+	switch (h / 60) {
+	case 0: r = chroma; g = x; break;
+	case 1: r = x; g = chroma; break;
+	case 2: g = chroma; b = x; break;
+	case 3: g = x; b = chroma; break;
+	case 4: r = x; b = chroma; break;
+	default: r = chroma; b = x; break;
+	}
+	return gr_sixel_rgb(r + m, g + m, b + m);
+}
+
+/// Parses up to `max_count` numeric parameters separated by ';' starting at
+/// `*p` and advances `*p`. Missing parameters are set to 0. Since st splits
+/// string arguments in place, '\0' is treated like ';'. Returns the number of
+/// parameters.
+static int gr_sixel_params(const char **p, const char *end, int *params,
+			   int max_count) {
+	int count = 0;
+	while (*p < end) {
+		int value = 0;
+		while (*p < end && isdigit((unsigned char)**p)) {
+			// Large values are useless anyway, just avoid overflow.
+			if (value < 10000000)
+				value = value * 10 + (**p - '0');
+			++*p;
+		}
+		if (count < max_count)
+			params[count] = value;
+		++count;
+		if (*p >= end || (**p != ';' && **p != '\0'))
+			break;
+		++*p;
+	}
+	for (int i = count; i < max_count; ++i)
+		params[i] = 0;
+	return count;
+}
+
+/// Makes sure the canvas can hold a `width` x `height` image, growing it
+/// geometrically. Returns 0 if the size is over the ram limit for one image or
+/// the memory couldn't be allocated.
+static int gr_sixel_reserve(SixelCanvas *canvas, int width, int height) {
+	if (width <= canvas->width && height <= canvas->height)
+		return 1;
+	uint64_t max_pixels = graphics_max_single_image_ram_size / 4;
+	if ((uint64_t)width * height > max_pixels)
+		return 0;
+	int new_width = canvas->width, new_height = canvas->height;
+	if (width > canvas->width)
+		new_width = MAX(width, canvas->width * 2);
+	if (height > canvas->height)
+		new_height = MAX(height, canvas->height * 2);
+	if ((uint64_t)new_width * new_height > max_pixels) {
+		new_width = MAX(width, canvas->width);
+		new_height = MAX(height, canvas->height);
+	}
+	DATA32 *pixels = calloc((size_t)new_width * new_height, sizeof(DATA32));
+	if (!pixels)
+		return 0;
+	for (int y = 0; y < canvas->height; ++y)
+		memcpy(pixels + (size_t)y * new_width,
+		       canvas->pixels + (size_t)y * canvas->width,
+		       canvas->width * sizeof(DATA32));
+	free(canvas->pixels);
+	canvas->pixels = pixels;
+	canvas->width = new_width;
+	canvas->height = new_height;
+	return 1;
+}
+
+/// Decodes sixel data (everything after the 'q') into the canvas. Returns 0 if
+/// the image is too big.
+static int gr_sixel_decode(const char *p, const char *end,
+			   SixelCanvas *canvas) {
+	DATA32 palette[SIXEL_PALETTE_SIZE];
+	for (int i = 0; i < SIXEL_PALETTE_SIZE; ++i) {
+		const unsigned char *rgb = sixel_default_palette[i % 16];
+		palette[i] = gr_sixel_rgb(rgb[0], rgb[1], rgb[2]);
+	}
+	DATA32 color = palette[0];
+	int x = 0, y = 0, repeat = 1;
+	int params[5];
+
+	while (p < end) {
+		unsigned char c = *p++;
+		if (c >= '?' && c <= '~') {
+			unsigned bits = c - '?';
+			int count = repeat;
+			repeat = 1;
+			if (!gr_sixel_reserve(canvas, x + count, y + 6))
+				return 0;
+			if (bits) {
+				// Write the six rows of the sixel (repeated
+				// `count` times) straight into the canvas.
+				DATA32 *dst = canvas->pixels +
+					      (size_t)y * canvas->width + x;
+				for (int k = 0; k < 6;
+				     ++k, dst += canvas->width) {
+					if (!(bits & (1 << k)))
+						continue;
+					for (int i = 0; i < count; ++i)
+						dst[i] = color;
+				}
+				canvas->used_height =
+					MAX(canvas->used_height,
+					    y + sixel_height[bits]);
+			}
+			x += count;
+			canvas->used_width = MAX(canvas->used_width, x);
+			continue;
+		}
+		switch (c) {
+		case '!':
+			// Repeat introducer.
+			gr_sixel_params(&p, end, params, 1);
+			repeat = MAX(params[0], 1);
+			break;
+		case '#':
+			// Color introducer, maybe with a color definition.
+			if (gr_sixel_params(&p, end, params, 5) >= 5) {
+				DATA32 *reg = &palette[params[0] %
+						       SIXEL_PALETTE_SIZE];
+				if (params[1] == 1)
+					*reg = gr_sixel_hls(params[2], params[3],
+							    params[4]);
+				else if (params[1] == 2)
+					*reg = gr_sixel_rgb(params[2], params[3],
+							    params[4]);
+			}
+			color = palette[params[0] % SIXEL_PALETTE_SIZE];
+			break;
+		case '"':
+			// Raster attributes: aspect ratio and the image size.
+			if (gr_sixel_params(&p, end, params, 4) >= 4 &&
+			    params[2] > 0 && params[3] > 0) {
+				if (!gr_sixel_reserve(canvas, params[2],
+						      params[3]))
+					return 0;
+				canvas->used_width =
+					MAX(canvas->used_width, params[2]);
+				canvas->used_height =
+					MAX(canvas->used_height, params[3]);
+			}
+			break;
+		case '$':
+			// Graphics carriage return.
+			x = 0;
+			break;
+		case '-':
+			// Graphics new line.
+			x = 0;
+			y += 6;
+			break;
+		default:
+			// Whitespace and unknown characters are ignored.
+			break;
+		}
+	}
+	return 1;
+}
+
+/// Writes the decoded image to the on-disk cache as raw RGBA pixel data (like
+/// `f=32`), so that it can be reloaded after being unloaded from ram. Returns 0
+/// on failure.
+static int gr_sixel_save(Image *img, SixelCanvas *canvas) {
+	unsigned size = (unsigned)img->pix_width * img->pix_height * 4;
+	if (size > graphics_max_single_image_file_size)
+		return 0;
+	gr_make_sure_tmpdir_exists();
+	char filename[MAX_FILENAME_SIZE];
+	gr_get_image_filename(img, filename, MAX_FILENAME_SIZE);
+	FILE *file = fopen(filename, "wb");
+	if (!file)
+		return 0;
+	unsigned char *row = malloc(img->pix_width * 4);
+	if (!row) {
+		fclose(file);
+		unlink(filename);
+		return 0;
+	}
+	for (int y = 0; y < img->pix_height; ++y) {
+		const DATA32 *src = canvas->pixels + (size_t)y * canvas->width;
+		for (int x = 0; x < img->pix_width; ++x) {
+			row[x * 4] = (src[x] >> 16) & 0xFF;
+			row[x * 4 + 1] = (src[x] >> 8) & 0xFF;
+			row[x * 4 + 2] = src[x] & 0xFF;
+			row[x * 4 + 3] = src[x] >> 24;
+		}
+		fwrite(row, 1, img->pix_width * 4, file);
+	}
+	free(row);
+	fclose(file);
+	img->disk_size = size;
+	images_disk_size += size;
+	return 1;
+}
+
+int gr_parse_sixel(char *buf, size_t len) {
+	// The parameters before 'q' select the aspect ratio and the background
+	// mode. We ignore them: pixels are square, and pixels not covered by
+	// sixels are transparent, showing the cell background.
+	const char *p = buf, *end = buf + len;
+	while (p < end && (isdigit((unsigned char)*p) || *p == ';' || *p == '\0'))
+		++p;
+	if (p == end || *p != 'q')
+		return 0;
+	++p;
+
+	memset(&graphics_command_result, 0, sizeof(GraphicsCommandResult));
+	global_command_counter++;
+	GR_LOG("### Sixel image, %zu bytes\n", len);
+
+	SixelCanvas canvas = {0};
+	if (!gr_sixel_decode(p, end, &canvas)) {
+		fprintf(stderr, "error: sixel image is too big to load\n");
+		free(canvas.pixels);
+		return 1;
+	}
+	if (!canvas.used_width || !canvas.used_height) {
+		free(canvas.pixels);
+		return 1;
+	}
+
+	Image *img = gr_new_image(0);
+	if (!img) {
+		free(canvas.pixels);
+		return 1;
+	}
+	img->format = 32;
+	img->pix_width = canvas.used_width;
+	img->pix_height = canvas.used_height;
+	// Nobody expects responses to sixel images.
+	img->quiet = 2;
+	if (!gr_sixel_save(img, &canvas)) {
+		fprintf(stderr, "error: could not save sixel image %u\n",
+			img->image_id);
+		gr_delete_image(img);
+		free(canvas.pixels);
+		return 1;
+	}
+	img->status = STATUS_UPLOADING_SUCCESS;
+
+	// We already have the pixels, so load the image right away. Sixel
+	// images have few colors, so they are almost always paletted.
+	img->original_image = gr_pixbuf_compact(
+		gr_pixbuf_wrap(canvas.pixels, img->pix_width, img->pix_height,
+			       canvas.width * sizeof(DATA32)));
+	if (img->original_image) {
+		images_ram_size += gr_image_ram_size(img);
+		img->opaque = gr_pixbuf_is_opaque(img->original_image);
+		img->status = STATUS_RAM_LOADING_SUCCESS;
+	}
+
+	ImagePlacement *placement = gr_new_placement(img, 0);
+	placement->scale_mode = SCALE_MODE_NONE;
+	gr_display_nonvirtual_placement(placement);
+	GR_LOG("Sixel image %u is %dx%d\n", img->image_id, img->pix_width,
+	       img->pix_height);
+
+	gr_check_limits();
+	return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// iTerm2 inline images.
+//
+// The base64 body of `OSC 1337;File=...:<base64>` is streamed by the terminal
+// in pieces, which are fed to the same code as direct kitty uploads, so that
+// the whole file never has to be kept in memory.
+////////////////////////////////////////////////////////////////////////////////
+
+/// The image being uploaded with the iTerm2 protocol, 0 if none.
+static uint32_t iterm2_upload_image_id = 0;
+/// Base64 characters left over from the previous piece, since we can decode
+/// only groups of four.
+static char iterm2_carry[4];
+static int iterm2_carry_len = 0;
+
+/// Converts an iTerm2 dimension (`N` cells, `Npx` pixels, `N%` of the
+/// terminal size or `auto`) to cells. `cell_size` is the size of a cell in
+/// pixels and `term_size` is the size of the terminal in cells. Returns 0 for
+/// `auto` or invalid values.
+static int gr_iterm2_dimension(const char *value, const char *end,
+			       int cell_size, int term_size) {
+	char *num_end = NULL;
+	long num = strtol(value, &num_end, 10);
+	if (num_end == value || num <= 0)
+		return 0;
+	size_t suffix_len = end - num_end;
+	if (suffix_len == 0)
+		return MIN(num, 0xFFFF);
+	if (suffix_len == 2 && !strncmp(num_end, "px", 2))
+		return cell_size ? ceil_div(MIN(num, 0xFFFFFF), cell_size) : 0;
+	if (suffix_len == 1 && *num_end == '%')
+		return MAX(MIN(num, 100) * term_size / 100, 1);
+	return 0;
+}
+
+/// Feeds the base64 characters of `data` to the image being uploaded (if it's
+/// not NULL), keeping the incomplete group of four for later. If `more` is 0,
+/// everything is flushed and the upload is finished.
+static void gr_iterm2_feed(Image *img, const char *data, size_t len,
+			   int more) {
+	char *payload = malloc(iterm2_carry_len + len + 1);
+	if (!payload)
+		return;
+	size_t payload_len = 0;
+	memcpy(payload, iterm2_carry, iterm2_carry_len);
+	payload_len += iterm2_carry_len;
+	for (size_t i = 0; i < len; ++i) {
+		if (isprint((unsigned char)data[i]))
+			payload[payload_len++] = data[i];
+	}
+	iterm2_carry_len = more ? payload_len % 4 : 0;
+	payload_len -= iterm2_carry_len;
+	memcpy(iterm2_carry, payload + payload_len, iterm2_carry_len);
+	payload[payload_len] = '\0';
+	if (img && (payload_len || !more)) {
+		// The upload must not be confused with a kitty one.
+		uint32_t kitty_upload_image_id = current_upload_image_id;
+		gr_append_data(img, payload, more);
+		current_upload_image_id = kitty_upload_image_id;
+	}
+	free(payload);
+}
+
+void gr_iterm2_start(const char *args, size_t len, int cols, int rows) {
+	// Finish the previous upload if it was interrupted.
+	if (iterm2_upload_image_id)
+		gr_iterm2_finish();
+
+	GR_LOG("### iTerm2 image: %.*s\n", (int)MIN(len, 80), args);
+	int width = 0, height = 0, preserve_aspect_ratio = 1, is_inline = 0;
+	unsigned size = 0;
+	const char *end = args + len;
+	const char *key = args;
+	while (key < end) {
+		const char *key_end = memchr(key, '=', end - key);
+		if (!key_end)
+			break;
+		const char *value = key_end + 1;
+		const char *value_end = memchr(value, ';', end - value);
+		if (!value_end)
+			value_end = end;
+		size_t key_len = key_end - key;
+#define GR_KEY_IS(name) \
+	(key_len == sizeof(name) - 1 && !strncmp(key, name, key_len))
+		if (GR_KEY_IS("width"))
+			width = gr_iterm2_dimension(value, value_end,
+						    current_cw, cols);
+		else if (GR_KEY_IS("height"))
+			height = gr_iterm2_dimension(value, value_end,
+						     current_ch, rows);
+		else if (GR_KEY_IS("preserveAspectRatio"))
+			preserve_aspect_ratio = atoi(value);
+		else if (GR_KEY_IS("inline"))
+			is_inline = atoi(value);
+		else if (GR_KEY_IS("size"))
+			size = strtoul(value, NULL, 10);
+#undef GR_KEY_IS
+		key = value_end + 1;
+	}
+	// Files that are not inline are meant to be downloaded, which we don't
+	// support, so we just consume them.
+	iterm2_carry_len = 0;
+	if (!is_inline)
+		return;
+
+	Image *img = gr_new_image(0);
+	if (!img)
+		return;
+	// Nobody expects responses.
+	img->quiet = 2;
+	img->expected_size = size;
+	img->status = STATUS_UPLOADING;
+	iterm2_upload_image_id = img->image_id;
+
+	ImagePlacement *placement = gr_new_placement(img, 0);
+	placement->cols = width;
+	placement->rows = height;
+	if (!width && !height)
+		placement->scale_mode = SCALE_MODE_NONE;
+	else if (preserve_aspect_ratio)
+		placement->scale_mode = SCALE_MODE_CONTAIN;
+	else
+		placement->scale_mode = SCALE_MODE_FILL;
+}
+
+void gr_iterm2_append(const char *data, size_t len) {
+	gr_iterm2_feed(gr_find_image(iterm2_upload_image_id), data, len, 1);
+}
+
+int gr_iterm2_finish() {
+	memset(&graphics_command_result, 0, sizeof(GraphicsCommandResult));
+	if (!iterm2_upload_image_id)
+		return 0;
+	global_command_counter++;
+	Image *img = gr_find_image(iterm2_upload_image_id);
+	iterm2_upload_image_id = 0;
+	gr_iterm2_feed(img, NULL, 0, 0);
+	return 1;
+}
+
+void gr_iterm2_abort() {
+	if (!iterm2_upload_image_id)
+		return;
+	Image *img = gr_find_image(iterm2_upload_image_id);
+	iterm2_upload_image_id = 0;
+	iterm2_carry_len = 0;
+	if (img) {
+		GR_LOG("iTerm2 upload of image %u was interrupted\n",
+		       img->image_id);
+		gr_delete_image(img);
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // base64 decoding part is basically copied from st.c
 ////////////////////////////////////////////////////////////////////////////////
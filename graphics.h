@@ -17,17 +17,74 @@ void gr_deinit();
 void gr_append_imagerect(Drawable buf, uint32_t image_id, uint32_t placement_id,
 			 int start_col, int end_col, int start_row, int end_row,
 			 int x_pix, int y_pix, int cw, int ch, int reverse);
+/// Returns a number identifying the pixels that will be drawn for the given
+/// placement with the cell size `cw` x `ch`. It changes whenever the placement
+/// is recreated or rescaled. Returns 0 if the placement isn't loaded with this
+/// cell size, or is drawn with debug decorations, in which case its cells must
+/// always be redrawn.
+uint32_t gr_get_placement_generation(uint32_t image_id, uint32_t placement_id,
+				     int cw, int ch);
+
+/// Decides which of two overlapping classic placements is on top when the
+/// placeholder of the new placement `image_id`/`placement_id` is about to
+/// overwrite a cell of the placement `under_image_id`/`under_placement_id`. The
+/// cell of the old placement is (`dcol`, `drow`) cells away from the one of the
+/// new placement. The placement with the lower z-index will be drawn under the
+/// other one where the other one is transparent. Returns 1 if the cell should
+/// be overwritten, 0 if it should be kept.
+int gr_stack_placements(uint32_t image_id, uint32_t placement_id,
+			uint32_t under_image_id, uint32_t under_placement_id,
+			int dcol, int drow);
+
 /// Prepare for image drawing. `cw` and `ch` are dimensions of the cell.
 void gr_start_drawing(Drawable buf, int cw, int ch);
 /// Finish image drawing. This functions will draw all the rectangles left to
 /// draw.
 void gr_finish_drawing(Drawable buf);
 
+/// Switches animated images to their next frames if it's time and marks the
+/// lines showing them as dirty. Returns the number of milliseconds until the
+/// next frame is due, or -1 if nothing is animated.
+double gr_update_animations();
+
+/// Marks the lines showing stretched previews of placements as dirty, so that
+/// they are rescaled exactly during the next redraws. Returns 0 if there are
+/// previews (the terminal should redraw soon), or -1 otherwise.
+double gr_update_previews();
+
+/// Returns a file descriptor that becomes readable when images decoded or
+/// scaled in the background are ready, or -1 if there are no background
+/// threads. The terminal should call `gr_update_decoded_images` when it's
+/// readable.
+int gr_decoding_wakeup_fd();
+/// Picks up the images decoded and scaled in the background and marks the
+/// lines showing them as dirty.
+void gr_update_decoded_images();
+
 /// Parse and execute a graphics command. `buf` must start with 'G' and contain
 /// at least `len + 1` characters (including '\0'). Returns 0 on success.
 /// Additional informations is returned through `graphics_command_result`.
 int gr_parse_command(char *buf, size_t len);
 
+/// Parses a DCS string and, if it's a Sixel image, decodes it and stores it like
+/// an image uploaded with the graphics protocol. The placeholder is requested
+/// through `graphics_command_result`. `buf` may contain '\0' instead of ';'.
+/// Returns 1 if the string was a Sixel image (even if it couldn't be decoded).
+int gr_parse_sixel(char *buf, size_t len);
+
+/// Starts an iTerm2 inline image upload (`OSC 1337;File=<args>:<base64>`).
+/// `args` are the arguments after "File=" (not including ':'), `cols` and
+/// `rows` are the size of the terminal, used for percentages.
+void gr_iterm2_start(const char *args, size_t len, int cols, int rows);
+/// Appends a piece of the base64-encoded file to the current iTerm2 upload.
+void gr_iterm2_append(const char *data, size_t len);
+/// Finishes the current iTerm2 upload. Returns 1 if there was one, in which
+/// case `graphics_command_result` tells whether a placeholder is needed.
+int gr_iterm2_finish();
+/// Discards the current iTerm2 upload if the sequence was interrupted before
+/// it was terminated.
+void gr_iterm2_abort();
+
 /// Executes `command` with the name of the file corresponding to `image_id` as
 /// the argument. Executes xmessage with an error message on failure.
 void gr_preview_image(uint32_t image_id, const char *command);
@@ -43,12 +100,25 @@ void gr_dump_state();
 void gr_unload_images_to_reduce_ram();
 
 /// Executes `callback` for each image cell. `callback` may return 1 to erase
-/// the cell or 0 to keep it. This function is implemented in `st.c`.
+/// the cell, 2 to redraw it, or 0 to keep it. This function is implemented in
+/// `st.c`.
 void gr_for_each_image_cell(int (*callback)(void *data, uint32_t image_id,
 					    uint32_t placement_id, int col,
 					    int row, char is_classic),
 			    void *data);
 
+/// Same as `gr_for_each_image_cell`, but only for the cells in the rectangle
+/// from (`x1`, `y1`) to (`x2`, `y2`) inclusive (0-based). Lines known to have
+/// no image cells are skipped. This function is implemented in `st.c`.
+void gr_for_each_image_cell_in(int x1, int y1, int x2, int y2,
+			       int (*callback)(void *data, uint32_t image_id,
+					       uint32_t placement_id, int col,
+					       int row, char is_classic),
+			       void *data);
+
+/// Returns the 0-based cursor position. This function is implemented in `st.c`.
+void gr_get_cursor_position(int *col, int *row);
+
 typedef enum {
 	GRAPHICS_DEBUG_NONE = 0,
 	GRAPHICS_DEBUG_LOG = 1,
@@ -0,0 +1,166 @@
+/* See LICENSE for license details. */
+
+// A microbenchmark comparing the built-in resampler of the graphics module
+// with the imlib scaling path it replaces. Build and run it with `make bench`.
+// It doesn't need an X server.
+
+#include "graphics.c"
+
+// The settings normally defined in config.h. Only the scaling filter matters
+// here, the rest are needed for linking.
+const char graphics_cache_dir_template[] = "/tmp/st-images-XXXXXX";
+unsigned graphics_max_single_image_file_size = 20 * 1024 * 1024;
+unsigned graphics_total_file_cache_size = 300 * 1024 * 1024;
+unsigned graphics_max_single_image_ram_size = 100 * 1024 * 1024;
+unsigned graphics_max_total_ram_size = 300 * 1024 * 1024;
+unsigned graphics_max_total_placements = 4096;
+double graphics_excess_tolerance_ratio = 0.05;
+int graphics_atlas_max_item_size = 0;
+unsigned graphics_tombstone_lifetime_ms = 0;
+unsigned graphics_progressive_redraw_interval_ms = 0;
+unsigned graphics_default_frame_gap_ms = 40;
+unsigned graphics_cache_pack_max_item_size = 0;
+unsigned graphics_cache_segment_size = 4 * 1024 * 1024;
+double graphics_cache_compaction_ratio = 0.5;
+char graphics_cache_compress_raw = 0;
+unsigned graphics_offscreen_scaled_lifetime_ms = 0;
+unsigned graphics_rescale_budget_ms = 0;
+unsigned graphics_decoding_threads = 0;
+unsigned graphics_scaling_filter = SCALING_FILTER_LANCZOS;
+
+// Normally implemented by the terminal.
+void gr_for_each_image_cell(int (*callback)(void *data, uint32_t image_id,
+					    uint32_t placement_id, int col,
+					    int row, char is_classic),
+			    void *data) {}
+void gr_for_each_image_cell_in(int x1, int y1, int x2, int y2,
+			       int (*callback)(void *data, uint32_t image_id,
+					       uint32_t placement_id, int col,
+					       int row, char is_classic),
+			       void *data) {}
+void gr_get_cursor_position(int *col, int *row) { *col = *row = 0; }
+
+/// A scaling case: the source size and the destination size.
+typedef struct {
+	int src_w, src_h, dest_w, dest_h;
+} BenchCase;
+
+static const BenchCase bench_cases[] = {
+	{4000, 3000, 800, 600},
+	{1920, 1080, 640, 360},
+	{1920, 1080, 1280, 720},
+	{1024, 768, 2048, 1536},
+	{512, 512, 96, 96},
+	{300, 200, 1200, 800},
+};
+
+/// Each case is repeated until it has taken this long.
+#define BENCH_MIN_MS 300
+
+/// Creates a source image with a gradient and some detail. Unless it's
+/// `opaque`, every seventh column is translucent.
+static PixelBuffer *bench_source(int w, int h, char opaque) {
+	DATA32 *pixels = malloc((size_t)w * h * sizeof(DATA32));
+	if (!pixels)
+		return NULL;
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			DATA32 a = opaque || x % 7 ? 0xFF : 0x40;
+			pixels[(size_t)y * w + x] =
+				a << 24 | (DATA32)(x * 255 / w) << 16 |
+				(DATA32)(y * 255 / h) << 8 |
+				((x ^ y) & 0xFF);
+		}
+	}
+	return gr_pixbuf_wrap(pixels, w, h, w * sizeof(DATA32));
+}
+
+/// Scales `src` the way `gr_create_scaled_image` does with the imlib filter:
+/// converts it to an imlib image, blends it onto a transparent one, and
+/// premultiplies the result.
+static void bench_imlib(PixelBuffer *src, Imlib_Image out, int w, int h,
+			char opaque) {
+	Imlib_Image source = gr_pixbuf_to_imlib(src, 0, 0, src->width,
+						 src->height);
+	imlib_context_set_image(out);
+	imlib_context_set_blend(!opaque);
+	imlib_context_set_anti_alias(1);
+	if (!opaque) {
+		DATA32 *data = imlib_image_get_data();
+		memset(data, 0, (size_t)w * h * sizeof(DATA32));
+		imlib_image_put_back_data(data);
+	}
+	imlib_blend_image_onto_image(source, 1, 0, 0, src->width,
+				     src->height, 0, 0, w, h);
+	imlib_context_set_blend(1);
+	if (!opaque) {
+		DATA32 *data = imlib_image_get_data();
+		gr_premultiply(data, (size_t)w * h);
+		imlib_image_put_back_data(data);
+	}
+	imlib_context_set_image(source);
+	imlib_free_image();
+}
+
+/// Runs one method of scaling (-1 for imlib, or a `ScalingFilter`) until
+/// `BENCH_MIN_MS` have passed and returns the average time in milliseconds.
+static double bench_run(PixelBuffer *src, const BenchCase *c, int method,
+			char opaque) {
+	Imlib_Image out = imlib_create_image(c->dest_w, c->dest_h);
+	if (!out)
+		return -1;
+	imlib_context_set_image(out);
+	imlib_image_set_has_alpha(1);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int runs = 0;
+	double ms = 0;
+	do {
+		if (method < 0) {
+			bench_imlib(src, out, c->dest_w, c->dest_h,
+				    opaque);
+		} else {
+			imlib_context_set_image(out);
+			DATA32 *data = imlib_image_get_data();
+			gr_resample(src, 0, 0, src->width, src->height,
+				    data, c->dest_w, c->dest_h, 0, 0,
+				    c->dest_w, c->dest_h, method);
+			imlib_image_put_back_data(data);
+		}
+		runs++;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ms = gr_ms_since(&end, &start);
+	} while (ms < BENCH_MIN_MS);
+	imlib_context_set_image(out);
+	imlib_free_image();
+	return ms / runs;
+}
+
+int main(int argc, char **argv) {
+	printf("Scaling kernels: %s\n", gr_resample_init_kernels());
+	printf("%-22s %-6s %10s %10s %10s\n", "case", "alpha", "imlib, ms",
+	       "box, ms", "lanczos, ms");
+	for (size_t i = 0; i < sizeof(bench_cases) / sizeof(*bench_cases);
+	     ++i) {
+		const BenchCase *c = &bench_cases[i];
+		for (int opaque = 1; opaque >= 0; --opaque) {
+			PixelBuffer *src =
+				bench_source(c->src_w, c->src_h, opaque);
+			if (!src)
+				return 1;
+			char name[32];
+			snprintf(name, sizeof(name), "%dx%d -> %dx%d",
+				 c->src_w, c->src_h, c->dest_w, c->dest_h);
+			double imlib_ms = bench_run(src, c, -1, opaque);
+			double box_ms =
+				bench_run(src, c, SCALING_FILTER_BOX, opaque);
+			double lanczos_ms = bench_run(
+				src, c, SCALING_FILTER_LANCZOS, opaque);
+			printf("%-22s %-6s %10.2f %10.2f %10.2f\n", name,
+			       opaque ? "no" : "yes", imlib_ms, box_ms,
+			       lanczos_ms);
+			gr_pixbuf_free(src);
+		}
+	}
+	return 0;
+}
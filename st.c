@@ -14,6 +14,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
@@ -36,6 +37,7 @@
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
+#define STR_STREAM_SIZ (64*1024)
 
 /* PUA character used as an image placeholder */
 #define IMAGE_PLACEHOLDER_CHAR 0x10EEEE
@@ -123,6 +125,8 @@ typedef struct {
 	Line *line;   /* screen */
 	Line *alt;    /* alternate screen */
 	int *dirty;   /* dirtyness of lines */
+	char *imgline; /* lines that may contain image cells */
+	char *imgalt;  /* same for the alternate screen */
 	TCursor c;    /* cursor */
 	int ocx;      /* old cursor col */
 	int ocy;      /* old cursor row */
@@ -157,12 +161,15 @@ typedef struct {
 	size_t len;            /* raw string length */
 	char *args[STR_ARG_SIZ];
 	int narg;              /* nb of args */
+	int stream;            /* buf is passed on to the graphics module */
 } STREscape;
 
 static void execsh(char *, char **);
 static void stty(char **);
 static void sigchld(int);
 static void ttywriteraw(const char *, size_t);
+static void ttyprocess(int);
+static int ttyoverbudget(void);
 
 static void csidump(void);
 static void csihandle(void);
@@ -233,6 +240,17 @@ static int iofd = 1;
 static int cmdfd;
 static pid_t pid;
 
+/* input read from the tty but not processed yet */
+static char ttybuf[BUFSIZ];
+static int ttybuflen = 0;
+/* whether processing stopped because graphics_command_budget_ms was spent */
+static int ttydeferred = 0;
+/* whether twrite() should check the budget, and when processing started */
+static int ttysliced = 0;
+static struct timespec ttystart;
+/* set by strhandle(), string sequences may carry image commands */
+static int strhandled = 0;
+
 static const uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static const Rune utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
@@ -830,19 +848,54 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 	return cmdfd;
 }
 
+void
+ttyprocess(int sliced)
+{
+	static int already_processing = 0;
+	int written = 0;
+
+	if (already_processing) {
+		/* Avoid recursive call to twrite() */
+		return;
+	}
+	already_processing = 1;
+	ttydeferred = 0;
+	ttysliced = sliced && graphics_command_budget_ms;
+	clock_gettime(CLOCK_MONOTONIC, &ttystart);
+	while (1) {
+		int buflen_before_processing = ttybuflen;
+		written += twrite(ttybuf + written, ttybuflen - written, 0);
+		// If buflen changed during the call to twrite, there is
+		// new data, and we need to keep processing, otherwise
+		// we can exit. This will not loop forever because the
+		// buffer is limited, and we don't clean it in this
+		// loop, so at some point ttywrite will have to drop
+		// some data. If the time budget is spent, the rest is
+		// processed by ttyresume() after drawing.
+		if (ttydeferred || buflen_before_processing == ttybuflen)
+			break;
+	}
+	ttysliced = 0;
+	already_processing = 0;
+	ttybuflen -= written;
+	/* keep any incomplete UTF-8 byte sequence and deferred input */
+	if (ttybuflen > 0)
+		memmove(ttybuf, ttybuf + written, ttybuflen);
+}
+
 size_t
 ttyread(void)
 {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
-	static int already_processing = 0;
-	int ret, written = 0;
+	int ret;
 
-	if (buflen >= LEN(buf))
+	/* make room by processing deferred input regardless of the budget */
+	if (ttybuflen >= LEN(ttybuf) && ttydeferred)
+		ttyprocess(0);
+	if (ttybuflen >= LEN(ttybuf))
 		return 0;
 
 	/* append read bytes to unprocessed bytes */
-	ret = read(cmdfd, buf+buflen, LEN(buf)-buflen);
+	ret = read(cmdfd, ttybuf+ttybuflen, LEN(ttybuf)-ttybuflen);
 
 	switch (ret) {
 	case 0:
@@ -850,33 +903,25 @@ ttyread(void)
 	case -1:
 		die("couldn't read from shell: %s\n", strerror(errno));
 	default:
-		buflen += ret;
-		if (already_processing) {
-			/* Avoid recursive call to twrite() */
-			return ret;
-		}
-		already_processing = 1;
-		while (1) {
-			int buflen_before_processing = buflen;
-			written += twrite(buf + written, buflen - written, 0);
-			// If buflen changed during the call to twrite, there is
-			// new data, and we need to keep processing, otherwise
-			// we can exit. This will not loop forever because the
-			// buffer is limited, and we don't clean it in this
-			// loop, so at some point ttywrite will have to drop
-			// some data.
-			if (buflen_before_processing == buflen)
-				break;
-		}
-		already_processing = 0;
-		buflen -= written;
-		/* keep any incomplete UTF-8 byte sequence for the next call */
-		if (buflen > 0)
-			memmove(buf, buf + written, buflen);
+		ttybuflen += ret;
+		ttyprocess(1);
 		return ret;
 	}
 }
 
+int
+ttypending(void)
+{
+	return ttydeferred;
+}
+
+void
+ttyresume(void)
+{
+	if (ttydeferred)
+		ttyprocess(1);
+}
+
 void
 ttywrite(const char *s, size_t n, int may_echo)
 {
@@ -1037,6 +1082,7 @@ void
 tfulldirt(void)
 {
 	tsetdirt(0, term.row-1);
+	xinvalidateimages();
 }
 
 void
@@ -1096,9 +1142,12 @@ void
 tswapscreen(void)
 {
 	Line *tmp = term.line;
+	char *imgtmp = term.imgline;
 
 	term.line = term.alt;
 	term.alt = tmp;
+	term.imgline = term.imgalt;
+	term.imgalt = imgtmp;
 	term.mode ^= MODE_ALTSCREEN;
 	tfulldirt();
 }
@@ -1108,6 +1157,7 @@ tscrolldown(int orig, int n)
 {
 	int i;
 	Line temp;
+	char imgtemp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
@@ -1118,6 +1168,9 @@ tscrolldown(int orig, int n)
 		temp = term.line[i];
 		term.line[i] = term.line[i-n];
 		term.line[i-n] = temp;
+		imgtemp = term.imgline[i];
+		term.imgline[i] = term.imgline[i-n];
+		term.imgline[i-n] = imgtemp;
 	}
 
 	selscroll(orig, n);
@@ -1128,6 +1181,7 @@ tscrollup(int orig, int n)
 {
 	int i;
 	Line temp;
+	char imgtemp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
@@ -1138,6 +1192,9 @@ tscrollup(int orig, int n)
 		temp = term.line[i];
 		term.line[i] = term.line[i+n];
 		term.line[i+n] = temp;
+		imgtemp = term.imgline[i];
+		term.imgline[i] = term.imgline[i+n];
+		term.imgline[i+n] = imgtemp;
 	}
 
 	selscroll(orig, -n);
@@ -1278,6 +1335,7 @@ tsetchar(Rune u, const Glyph *attr, int x, int y)
 	if (u == IMAGE_PLACEHOLDER_CHAR || u == IMAGE_PLACEHOLDER_CHAR_OLD) {
 		term.line[y][x].u = 0;
 		term.line[y][x].mode |= ATTR_IMAGE;
+		term.imgline[y] = 1;
 	}
 }
 
@@ -1299,6 +1357,8 @@ tclearregion(int x1, int y1, int x2, int y2)
 
 	for (y = y1; y <= y2; y++) {
 		term.dirty[y] = 1;
+		if (x1 == 0 && x2 == term.col-1)
+			term.imgline[y] = 0;
 		for (x = x1; x <= x2; x++) {
 			gp = &term.line[y][x];
 			if (selected(x, y))
@@ -1322,11 +1382,23 @@ tcreateimgplaceholder(uint32_t image_id, uint32_t placement_id,
 	for (int row = 0; row < rows; ++row) {
 		int y = term.c.y;
 		term.dirty[y] = 1;
+		term.imgline[y] = 1;
 		for (int col = 0; col < cols; ++col) {
 			int x = term.c.x + col;
 			if (x >= term.col)
 				break;
 			Glyph *gp = &term.line[y][x];
+			/* keep the cells of classic placements drawn on top */
+			if ((gp->mode & ATTR_IMAGE) &&
+			    tgetisclassicplaceholder(gp) &&
+			    (tgetimgid(gp) != image_id ||
+			     tgetimgplacementid(gp) != placement_id) &&
+			    !gr_stack_placements(image_id, placement_id,
+						 tgetimgid(gp),
+						 tgetimgplacementid(gp),
+						 tgetimgcol(gp) - 1 - col,
+						 tgetimgrow(gp) - 1 - row))
+				continue;
 			if (selected(x, y))
 				selclear();
 			gp->mode = ATTR_IMAGE;
@@ -1361,16 +1433,24 @@ tcreateimgplaceholder(uint32_t image_id, uint32_t placement_id,
 	}
 }
 
-void gr_for_each_image_cell(int (*callback)(void *data, uint32_t image_id,
-					    uint32_t placement_id, int col,
-					    int row, char is_classic),
-			    void *data) {
-	for (int row = 0; row < term.row; ++row) {
-		for (int col = 0; col < term.col; ++col) {
+void gr_for_each_image_cell_in(int x1, int y1, int x2, int y2,
+			       int (*callback)(void *data, uint32_t image_id,
+					       uint32_t placement_id, int col,
+					       int row, char is_classic),
+			       void *data) {
+	if (x1 >= term.col || y1 >= term.row || x2 < 0 || y2 < 0)
+		return;
+	x1 = MAX(x1, 0);
+	y1 = MAX(y1, 0);
+	x2 = MIN(x2, term.col-1);
+	y2 = MIN(y2, term.row-1);
+	for (int row = y1; row <= y2; ++row) {
+		if (!term.imgline[row])
+			continue;
+		char has_images = 0;
+		for (int col = x1; col <= x2; ++col) {
 			Glyph *gp = &term.line[row][col];
 			if (gp->mode & ATTR_IMAGE) {
-				uint32_t image_id = tgetimgid(gp);
-				uint32_t placement_id = tgetimgplacementid(gp);
 				int ret =
 					callback(data, tgetimgid(gp),
 						 tgetimgplacementid(gp),
@@ -1380,12 +1460,32 @@ void gr_for_each_image_cell(int (*callback)(void *data, uint32_t image_id,
 					term.dirty[row] = 1;
 					gp->mode = 0;
 					gp->u = ' ';
+				} else {
+					has_images = 1;
+					if (ret == 2)
+						term.dirty[row] = 1;
 				}
 			}
 		}
+		// If we've looked at the whole line, we know whether it still
+		// contains image cells.
+		if (x1 == 0 && x2 == term.col-1)
+			term.imgline[row] = has_images;
 	}
 }
 
+void gr_for_each_image_cell(int (*callback)(void *data, uint32_t image_id,
+					    uint32_t placement_id, int col,
+					    int row, char is_classic),
+			    void *data) {
+	gr_for_each_image_cell_in(0, 0, term.col-1, term.row-1, callback, data);
+}
+
+void gr_get_cursor_position(int *col, int *row) {
+	*col = term.c.x;
+	*row = term.c.y;
+}
+
 void
 tdeletechar(int n)
 {
@@ -2052,6 +2152,8 @@ strhandle(void)
 {
 	char *p = NULL, *dec;
 	int j, narg, par;
+
+	strhandled = 1;
 	const struct { int idx; char *str; } osc_table[] = {
 		{ defaultfg, "foreground" },
 		{ defaultbg, "background" },
@@ -2059,6 +2161,21 @@ strhandle(void)
 	};
 
 	term.esc &= ~(ESC_STR_END|ESC_STR);
+	if (strescseq.stream) { /* OSC 1337;File= -- iTerm2 inline image */
+		gr_iterm2_append(strescseq.buf, strescseq.len);
+		if (gr_iterm2_finish() &&
+		    graphics_command_result.create_placeholder) {
+			GraphicsCommandResult *res = &graphics_command_result;
+			tcreateimgplaceholder(res->placeholder.image_id,
+					      res->placeholder.placement_id,
+					      res->placeholder.columns,
+					      res->placeholder.rows, 0);
+			/* continue below the image */
+			if (term.c.x != 0)
+				tnewline(1);
+		}
+		return;
+	}
 	strparse();
 	par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -2158,6 +2275,20 @@ strhandle(void)
 		}
 		return;
 	case 'P': /* DCS -- Device Control String */
+		if (gr_parse_sixel(strescseq.buf, strescseq.len)) {
+			GraphicsCommandResult *res = &graphics_command_result;
+			if (res->create_placeholder) {
+				tcreateimgplaceholder(
+					res->placeholder.image_id,
+					res->placeholder.placement_id,
+					res->placeholder.columns,
+					res->placeholder.rows, 0);
+				/* like xterm, continue below the image */
+				if (term.c.x != 0)
+					tnewline(1);
+			}
+		}
+		return;
 	case '^': /* PM -- Privacy Message */
 		return;
 	}
@@ -2218,6 +2349,9 @@ strdump(void)
 void
 strreset(void)
 {
+	/* an iTerm2 image that was never terminated */
+	if (strescseq.stream)
+		gr_iterm2_abort();
 	strescseq = (STREscape){
 		.buf = xrealloc(strescseq.buf, STR_BUF_SIZ),
 		.siz = STR_BUF_SIZ,
@@ -2609,6 +2743,26 @@ tputc(Rune u)
 			strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
 		}
 
+		/*
+		 * The body of an iTerm2 inline image may be huge, so it's
+		 * passed on to the graphics module in pieces instead of being
+		 * accumulated.
+		 */
+		if (strescseq.stream) {
+			if (strescseq.len >= STR_STREAM_SIZ) {
+				gr_iterm2_append(strescseq.buf, strescseq.len);
+				strescseq.len = 0;
+			}
+		} else if (u == ':' && strescseq.type == ']' &&
+		           strescseq.len >= 10 &&
+		           !memcmp(strescseq.buf, "1337;File=", 10)) {
+			gr_iterm2_start(strescseq.buf + 10, strescseq.len - 10,
+			                term.col, term.row);
+			strescseq.stream = 1;
+			strescseq.len = 0;
+			return;
+		}
+
 		memmove(&strescseq.buf[strescseq.len], c, len);
 		strescseq.len += len;
 		return;
@@ -2731,6 +2885,15 @@ check_control_code:
 	}
 }
 
+int
+ttyoverbudget(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return TIMEDIFF(now, ttystart) >= graphics_command_budget_ms;
+}
+
 int
 twrite(const char *buf, int buflen, int show_ctrl)
 {
@@ -2759,6 +2922,15 @@ twrite(const char *buf, int buflen, int show_ctrl)
 			}
 		}
 		tputc(u);
+		/* leave the rest for later if image commands took too long */
+		if (strhandled) {
+			strhandled = 0;
+			if (ttysliced && ttyoverbudget()) {
+				ttydeferred = 1;
+				n += charsize;
+				break;
+			}
+		}
 	}
 	return n;
 }
@@ -2791,6 +2963,8 @@ tresize(int col, int row)
 	if (i > 0) {
 		memmove(term.line, term.line + i, row * sizeof(Line));
 		memmove(term.alt, term.alt + i, row * sizeof(Line));
+		memmove(term.imgline, term.imgline + i, row);
+		memmove(term.imgalt, term.imgalt + i, row);
 	}
 	for (i += row; i < term.row; i++) {
 		free(term.line[i]);
@@ -2801,6 +2975,8 @@ tresize(int col, int row)
 	term.line = xrealloc(term.line, row * sizeof(Line));
 	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
 	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
+	term.imgline = xrealloc(term.imgline, row);
+	term.imgalt = xrealloc(term.imgalt, row);
 	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
 
 	/* resize each row to new width, zero-pad if needed */
@@ -2813,6 +2989,7 @@ tresize(int col, int row)
 	for (/* i = minrow */; i < row; i++) {
 		term.line[i] = xmalloc(col * sizeof(Glyph));
 		term.alt[i] = xmalloc(col * sizeof(Glyph));
+		term.imgline[i] = term.imgalt[i] = 0;
 	}
 	if (col > term.col) {
 		bp = term.tabs + term.col;
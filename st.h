@@ -98,6 +98,8 @@ void tsetdirtattr(int);
 void ttyhangup(void);
 int ttynew(const char *, char *, const char *, char **);
 size_t ttyread(void);
+int ttypending(void);
+void ttyresume(void);
 void ttyresize(int, int);
 void ttywrite(const char *, size_t, int);
 
@@ -131,6 +133,7 @@ extern unsigned int tabspaces;
 extern unsigned int defaultfg;
 extern unsigned int defaultbg;
 extern unsigned int defaultcs;
+extern unsigned graphics_command_budget_ms;
 
 // Some accessors to image placeholder properties stored in `u`:
 // - row (1-base) - 9 bits
@@ -42,3 +42,4 @@ void xximspot(int, int);
 
 void xstartimagedraw();
 void xfinishimagedraw();
+void xinvalidateimages(void);
@@ -150,11 +150,21 @@ typedef struct {
 	GC gc;
 } DC;
 
+/* What was last drawn in an image cell (see xdrawimages) */
+typedef struct {
+	uint32_t image_id, placement_id, generation;
+	uint32_t bg;
+	ushort col, row, mode;
+} ImageCell;
+
 static inline ushort sixd_to_16bit(int);
 static int xmakeglyphfontspecs(XftGlyphFontSpec *, const Glyph *, int, int, int);
 static void xdrawglyphfontspecs(const XftGlyphFontSpec *, Glyph, int, int, int);
 static void xdrawglyph(Glyph, int, int);
-static void xdrawimages(Glyph, Line, int x1, int y1, int x2);
+static void xdrawimages(const XftGlyphFontSpec *, Glyph, Line, int x1, int y1,
+                        int x2);
+static int ximagecellchanged(int x, int y, ImageCell *);
+static void xforgetimagecells(int x1, int y, int x2);
 static void xdrawoneimagecell(Glyph, int x, int y);
 static void xclear(int, int, int, int);
 static int xgeommasktogravity(int);
@@ -233,6 +243,8 @@ static XWindow xw;
 static XSelection xsel;
 static TermWindow win;
 static unsigned int mouse_col = 0, mouse_row = 0;
+static ImageCell *imagecells;
+static int imagecellscol, imagecellsrow;
 
 /* Font Ring Cache */
 enum {
@@ -850,6 +862,13 @@ xresize(int col, int row)
 
 	/* resize to new width */
 	xw.specbuf = xrealloc(xw.specbuf, col * sizeof(GlyphFontSpec));
+
+	/* the buffer is cleared, so forget all drawn image cells */
+	free(imagecells);
+	imagecells = xmalloc(col * row * sizeof(ImageCell));
+	imagecellscol = col;
+	imagecellsrow = row;
+	xinvalidateimages();
 }
 
 ushort
@@ -1727,22 +1746,69 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
 	}
 }
 
+/* Forget what was drawn in all image cells, so that they are redrawn next time
+ * their lines are drawn. */
+void
+xinvalidateimages(void)
+{
+	if (imagecells)
+		memset(imagecells, 0, imagecellscol * imagecellsrow * sizeof(ImageCell));
+}
+
+/* Forget image cells between columns x1 and x2 on the line y (they are going to
+ * be overdrawn with something else). */
+void
+xforgetimagecells(int x1, int y, int x2)
+{
+	if (!imagecells || y >= imagecellsrow)
+		return;
+	x2 = MIN(x2, imagecellscol);
+	if (x1 < x2)
+		memset(&imagecells[y * imagecellscol + x1], 0,
+		       (x2 - x1) * sizeof(ImageCell));
+}
+
+/* Check whether the image cell at (x, y) has to be redrawn to show `cell`, and
+ * remember `cell` as the content of this position. */
+int
+ximagecellchanged(int x, int y, ImageCell *cell)
+{
+	ImageCell *old;
+
+	if (!imagecells || x >= imagecellscol || y >= imagecellsrow)
+		return 1;
+	old = &imagecells[y * imagecellscol + x];
+	if (cell->generation != 0 &&
+	    memcmp(old, cell, sizeof(ImageCell)) == 0)
+		return 0;
+	*old = *cell;
+	return 1;
+}
+
 /* Draw (or queue for drawing) image cells between columns x1 and x2 assuming
  * that they have the same attributes (and thus the same lower 24 bits of the
- * image ID and the same placement ID). */
+ * image ID and the same placement ID). `specs` are the glyph specs of these
+ * cells, used to draw the background of cells that have to be redrawn. Cells
+ * that already show the same part of the same image are skipped completely. */
 void
-xdrawimages(Glyph base, Line line, int x1, int y1, int x2) {
+xdrawimages(const XftGlyphFontSpec *specs, Glyph base, Line line, int x1,
+            int y1, int x2) {
 	int x_pix_start = win.hborderpx + x1 * win.cw;
-	int x_pix = x_pix_start;
 	int y_pix = win.vborderpx + y1 * win.ch;
 	uint32_t image_id_24bits = base.fg & 0xFFFFFF;
 	uint32_t placement_id = tgetimgplacementid(&base);
 	// Columns and rows are 1-based, 0 means unspecified.
 	int last_col = 0;
 	int last_row = 0;
-	int last_start_col = 0;
 	// The most significant byte is also 1-base, subtract 1 before use.
 	uint32_t last_id_4thbyteplus1 = 0;
+	// The current stripe of cells to redraw (offsets relative to x1). The
+	// background and the image are drawn separately since the background
+	// run doesn't have to be contiguous in the image.
+	int stripe_start = 0, stripe_len = 0, bg_start = 0, bg_len = 0;
+	int stripe_col = 0, stripe_row = 0;
+	uint32_t stripe_id = 0;
+	ImageCell cell;
 	// We may need to inherit row/column/4th byte from the previous cell.
 	Glyph *prev = &line[x1 - 1];
 	if (x1 > 0 && (prev->mode & ATTR_IMAGE) &&
@@ -1751,7 +1817,6 @@ xdrawimages(Glyph base, Line line, int x1, int y1, int x2) {
 		last_row = tgetimgrow(prev);
 		last_col = tgetimgcol(prev);
 		last_id_4thbyteplus1 = tgetimgid4thbyteplus1(prev);
-		last_start_col = last_col + 1;
 	}
 	for (int i = 0; i < x2 - x1; ++i) {
 		Glyph *g = &line[x1 + i];
@@ -1784,22 +1849,49 @@ xdrawimages(Glyph base, Line line, int x1, int y1, int x2) {
 			cur_row = 1;
 		if (cur_col == 0)
 			cur_col = 1;
-		// If this cell breaks a contiguous stripe of image cells, draw
-		// that line and start a new one.
-		if (cur_col != last_col + 1 || cur_row != last_row ||
-		    cur_id_4thbyteplus1 != last_id_4thbyteplus1) {
-			uint32_t image_id = image_id_24bits;
-			if (last_id_4thbyteplus1)
-				image_id |= (last_id_4thbyteplus1 - 1) << 24;
-			if (last_row != 0)
-				gr_append_imagerect(
-					xw.buf, image_id, placement_id,
-					last_start_col - 1, last_col,
-					last_row - 1, last_row, x_pix, y_pix,
-					win.cw, win.ch,
-					base.mode & ATTR_REVERSE);
-			last_start_col = cur_col;
-			x_pix = x_pix_start + i * win.cw;
+		uint32_t image_id = image_id_24bits;
+		if (cur_id_4thbyteplus1)
+			image_id |= (cur_id_4thbyteplus1 - 1) << 24;
+		// Check whether this cell already shows the same thing.
+		memset(&cell, 0, sizeof(cell));
+		cell.image_id = image_id;
+		cell.placement_id = placement_id;
+		cell.generation = gr_get_placement_generation(
+			image_id, placement_id, win.cw, win.ch);
+		cell.bg = base.bg;
+		cell.col = cur_col;
+		cell.row = cur_row;
+		cell.mode = base.mode & ATTR_REVERSE;
+		int changed = ximagecellchanged(x1 + i, y1, &cell);
+		// If this cell doesn't need redrawing or breaks a contiguous
+		// stripe of image cells, draw that stripe.
+		if (stripe_len && (!changed || cur_col != last_col + 1 ||
+		                   cur_row != last_row ||
+		                   cur_id_4thbyteplus1 != last_id_4thbyteplus1)) {
+			gr_append_imagerect(
+				xw.buf, stripe_id, placement_id,
+				stripe_col - 1, stripe_col - 1 + stripe_len,
+				stripe_row - 1, stripe_row,
+				x_pix_start + stripe_start * win.cw, y_pix,
+				win.cw, win.ch, base.mode & ATTR_REVERSE);
+			stripe_len = 0;
+		}
+		if (!changed && bg_len) {
+			xdrawglyphfontspecs(specs + bg_start, base, bg_len,
+			                    x1 + bg_start, y1);
+			bg_len = 0;
+		}
+		if (changed) {
+			if (!stripe_len) {
+				stripe_start = i;
+				stripe_col = cur_col;
+				stripe_row = cur_row;
+				stripe_id = image_id;
+			}
+			if (!bg_len)
+				bg_start = i;
+			stripe_len++;
+			bg_len++;
 		}
 		last_row = cur_row;
 		last_col = cur_col;
@@ -1814,15 +1906,16 @@ xdrawimages(Glyph base, Line line, int x1, int y1, int x2) {
 		if (!tgetimgid4thbyteplus1(g))
 			tsetimg4thbyteplus1(g, cur_id_4thbyteplus1);
 	}
-	uint32_t image_id = image_id_24bits;
-	if (last_id_4thbyteplus1)
-		image_id |= (last_id_4thbyteplus1 - 1) << 24;
-	// Draw the last contiguous stripe.
-	if (last_row != 0)
-		gr_append_imagerect(xw.buf, image_id, placement_id,
-				    last_start_col - 1, last_col, last_row - 1,
-				    last_row, x_pix, y_pix, win.cw, win.ch,
-				    base.mode & ATTR_REVERSE);
+	// Draw the last background run and the last stripe.
+	if (bg_len)
+		xdrawglyphfontspecs(specs + bg_start, base, bg_len,
+		                    x1 + bg_start, y1);
+	if (stripe_len)
+		gr_append_imagerect(xw.buf, stripe_id, placement_id,
+		                    stripe_col - 1, stripe_col - 1 + stripe_len,
+		                    stripe_row - 1, stripe_row,
+		                    x_pix_start + stripe_start * win.cw, y_pix,
+		                    win.cw, win.ch, base.mode & ATTR_REVERSE);
 }
 
 /* Draw just one image cell without inheriting attributes from the left. */
@@ -1909,9 +2002,12 @@ xdrawline(Line line, int x1, int y1, int x2)
 		if (selected(x, y1))
 			new.mode ^= ATTR_REVERSE;
 		if (i > 0 && ATTRCMP(base, new)) {
-			xdrawglyphfontspecs(specs, base, i, ox, y1);
-			if (base.mode & ATTR_IMAGE)
-				xdrawimages(base, line, ox, y1, x);
+			if (base.mode & ATTR_IMAGE) {
+				xdrawimages(specs, base, line, ox, y1, x);
+			} else {
+				xdrawglyphfontspecs(specs, base, i, ox, y1);
+				xforgetimagecells(ox, y1, x);
+			}
 			specs += i;
 			numspecs -= i;
 			i = 0;
@@ -1922,10 +2018,12 @@ xdrawline(Line line, int x1, int y1, int x2)
 		}
 		i++;
 	}
-	if (i > 0)
+	if (i > 0 && base.mode & ATTR_IMAGE) {
+		xdrawimages(specs, base, line, ox, y1, x);
+	} else if (i > 0) {
 		xdrawglyphfontspecs(specs, base, i, ox, y1);
-	if (i > 0 && base.mode & ATTR_IMAGE)
-		xdrawimages(base, line, ox, y1, x);
+		xforgetimagecells(ox, y1, x);
+	}
 }
 
 void
@@ -2170,9 +2268,9 @@ run(void)
 	XEvent ev;
 	int w = win.w, h = win.h;
 	fd_set rfd;
-	int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing;
+	int xfd = XConnectionNumber(xw.dpy), gfd, ttyfd, ttyin, xev, drawing;
 	struct timespec seltv, *tv, now, lastblink, trigger;
-	double timeout;
+	double timeout, animtimeout;
 
 	/* Waiting for window mapping */
 	do {
@@ -2191,29 +2289,38 @@ run(void)
 	} while (ev.type != MapNotify);
 
 	ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
+	gfd = gr_decoding_wakeup_fd();
 	cresize(w, h);
 
 	for (timeout = -1, drawing = 0, lastblink = (struct timespec){0};;) {
 		FD_ZERO(&rfd);
 		FD_SET(ttyfd, &rfd);
 		FD_SET(xfd, &rfd);
+		if (gfd >= 0)
+			FD_SET(gfd, &rfd);
 
 		if (XPending(xw.dpy))
 			timeout = 0;  /* existing events might not set xfd */
+		if (ttypending())
+			timeout = 0;  /* input deferred by the time budget */
 
 		seltv.tv_sec = timeout / 1E3;
 		seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
 		tv = timeout >= 0 ? &seltv : NULL;
 
-		if (pselect(MAX(xfd, ttyfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
+		if (pselect(MAX(MAX(xfd, ttyfd), gfd)+1, &rfd, NULL, NULL, tv,
+		            NULL) < 0) {
 			if (errno == EINTR)
 				continue;
 			die("select failed: %s\n", strerror(errno));
 		}
 		clock_gettime(CLOCK_MONOTONIC, &now);
 
+		ttyin = FD_ISSET(ttyfd, &rfd) || ttypending();
 		if (FD_ISSET(ttyfd, &rfd))
 			ttyread();
+		else
+			ttyresume();
 
 		xev = 0;
 		while (XPending(xw.dpy)) {
@@ -2225,6 +2332,10 @@ run(void)
 				(handler[ev.type])(&ev);
 		}
 
+		/* pick up images decoded and scaled in the background */
+		if (gfd >= 0 && FD_ISSET(gfd, &rfd))
+			gr_update_decoded_images();
+
 		/*
 		 * To reduce flicker and tearing, when new content or event
 		 * triggers drawing, we first wait a bit to ensure we got
@@ -2236,7 +2347,7 @@ run(void)
 		 * maximum latency intervals during `cat huge.txt`, and perfect
 		 * sync with periodic updates from animations/key-repeats/etc.
 		 */
-		if (FD_ISSET(ttyfd, &rfd) || xev) {
+		if (ttyin || xev) {
 			if (!drawing) {
 				trigger = now;
 				drawing = 1;
@@ -2261,6 +2372,15 @@ run(void)
 			}
 		}
 
+		/* switch animated images to their next frames */
+		animtimeout = gr_update_animations();
+		if (animtimeout >= 0 && (timeout < 0 || animtimeout < timeout))
+			timeout = animtimeout;
+
+		/* replace stretched previews with exactly scaled images */
+		if (gr_update_previews() >= 0)
+			timeout = 0;
+
 		draw();
 		XFlush(xw.dpy);
 		drawing = 0;